@@ -0,0 +1,52 @@
+#!/bin/bash
+# Generate a synthetic C translation unit for benchmarking llvm-sprofgen
+#
+# Usage: ./generate_module.sh <num_functions> [output.c]
+#   num_functions - Number of functions to generate
+#   output.c      - Output file (default: stdout)
+#
+# Every function mixes the control flow static profiles are made of: a
+# counted loop, a data-dependent branch, a switch, an early return and a
+# call to an earlier function, so the call graph is deep as well as wide.
+
+set -e
+
+NUM_FUNCTIONS="${1:?Usage: $0 <num_functions> [output.c]}"
+OUTPUT="${2:-/dev/stdout}"
+
+{
+    echo "/* Generated by generate_module.sh with $NUM_FUNCTIONS functions. */"
+    echo ""
+    for ((i = 0; i < NUM_FUNCTIONS; i++)); do
+        echo "int f$i(int *data, int n) {"
+        echo "  int acc = $i;"
+        echo "  if (!data)"
+        echo "    return -1;"
+        echo "  for (int j = 0; j < n; ++j) {"
+        echo "    if (data[j] > acc)"
+        echo "      acc += data[j] % $((i % 7 + 2));"
+        echo "    else"
+        echo "      acc -= j;"
+        echo "    switch ((acc + j) & 3) {"
+        echo "    case 0: acc ^= $i; break;"
+        echo "    case 1: acc += 3; break;"
+        echo "    case 2: if (acc < 0) return acc; break;"
+        echo "    default: break;"
+        echo "    }"
+        echo "  }"
+        if ((i > 0)); then
+            echo "  if (acc & 1)"
+            echo "    acc += f$(( (i * 7919 + 17) % i ))(data, n / 2);"
+        fi
+        echo "  return acc;"
+        echo "}"
+        echo ""
+    done
+    echo "int main(int argc, char **argv) {"
+    echo "  int data[16] = {0};"
+    echo "  (void)argv;"
+    echo "  for (int i = 0; i < 16; ++i)"
+    echo "    data[i] = i * argc;"
+    echo "  return f$((NUM_FUNCTIONS - 1))(data, 16) & 0xff;"
+    echo "}"
+} > "$OUTPUT"
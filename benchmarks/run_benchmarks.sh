@@ -0,0 +1,86 @@
+#!/bin/bash
+# Measure the throughput of llvm-sprofgen on generated and real modules
+#
+# Usage: ./run_benchmarks.sh <llvm-sprofgen> <work_dir> [corpus_dir...]
+#   llvm-sprofgen - Tool to benchmark
+#   work_dir      - Directory for generated modules, profiles and reports
+#   corpus_dir    - Directories of additional .ll/.bc modules to export
+#
+# Environment:
+#   CLANG    - Compiler used to build the generated modules (default: clang)
+#   SIZES    - Function counts of the generated modules (default: "100 1000 10000")
+#   THREADS  - Values of --threads every module is exported with (default: "1 0")
+#   CASP_ARGS - Extra arguments passed to every llvm-sprofgen run
+#
+# Every run writes its --benchmark-json report to <work_dir>/reports, and all
+# of them are collected into <work_dir>/benchmark.json, a JSON array that can
+# be compared between CASP releases.
+
+set -e
+
+SPROFGEN="${1:?Usage: $0 <llvm-sprofgen> <work_dir> [corpus_dir...]}"
+WORK_DIR="${2:?Usage: $0 <llvm-sprofgen> <work_dir> [corpus_dir...]}"
+shift 2
+
+CLANG="${CLANG:-clang}"
+SIZES="${SIZES:-100 1000 10000}"
+THREADS="${THREADS:-1 0}"
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+
+mkdir -p "$WORK_DIR/modules" "$WORK_DIR/reports"
+rm -f "$WORK_DIR"/reports/*.json
+
+MODULES=()
+
+if command -v "$CLANG" &> /dev/null; then
+    for size in $SIZES; do
+        module="$WORK_DIR/modules/generated_$size.bc"
+        if [ ! -f "$module" ]; then
+            echo "=== Generating module with $size functions ==="
+            "$SCRIPT_DIR/generate_module.sh" "$size" "$WORK_DIR/modules/generated_$size.c"
+            "$CLANG" -O1 -fprofile-instr-generate -fcoverage-mapping -emit-llvm -c \
+                "$WORK_DIR/modules/generated_$size.c" -o "$module"
+        fi
+        MODULES+=("$module")
+    done
+else
+    echo "Warning: '$CLANG' not found, skipping generated modules"
+fi
+
+for dir in "$@"; do
+    while IFS= read -r -d '' module; do
+        MODULES+=("$module")
+    done < <(find "$dir" -type f \( -name '*.ll' -o -name '*.bc' \) -print0 | sort -z)
+done
+
+if [ ${#MODULES[@]} -eq 0 ]; then
+    echo "Error: No modules to benchmark"
+    exit 1
+fi
+
+for module in "${MODULES[@]}"; do
+    name=$(basename "$module")
+    name="${name%.*}"
+    for threads in $THREADS; do
+        echo "=== $name (--threads=$threads) ==="
+        # shellcheck disable=SC2086
+        "$SPROFGEN" $CASP_ARGS --threads="$threads" \
+            --benchmark-json="$WORK_DIR/reports/$name.threads$threads.json" \
+            "$module" "$WORK_DIR/$name.profdata" > /dev/null
+    done
+done
+
+REPORT="$WORK_DIR/benchmark.json"
+{
+    echo "["
+    first=1
+    for report in "$WORK_DIR"/reports/*.json; do
+        [ $first -eq 1 ] || echo ","
+        first=0
+        cat "$report"
+    done
+    echo "]"
+} > "$REPORT"
+
+echo ""
+echo "Benchmark report written to: $REPORT"
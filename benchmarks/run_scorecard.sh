@@ -0,0 +1,157 @@
+#!/bin/bash
+# Score the static profiles of llvm-sprofgen against profiles of real runs
+#
+# Usage: ./run_scorecard.sh <llvm-sprofgen> <work_dir> [program_dir...]
+#   llvm-sprofgen - Tool to score
+#   work_dir      - Directory for modules, executables, profiles and reports
+#   program_dir   - Directories of C programs; every .c file in them that
+#                   defines main is built and run as one program
+#
+# Environment:
+#   CLANG         - Compiler of the programs (default: clang)
+#   LLVM_PROFDATA - Merges the raw profiles of the runs (default: llvm-profdata)
+#   SIZES         - Function counts of generated programs (default: "1000")
+#   CASP_ARGS     - Extra arguments passed to every export, e.g. the scaling or
+#                   heuristic mode to score
+#
+# A program <name>.c runs with the arguments listed in <name>.args next to it,
+# if there is one. Every program is compiled with -fprofile-instr-generate
+# -fcoverage-mapping, once to IR for llvm-sprofgen and once to an executable
+# whose run writes the dynamic profile; both profiles then have the same
+# function hashes. For every program, <work_dir>/reports/<name>.json holds the
+# --benchmark-json report of the export and the --compare-profiles score of
+# the static profile: the rank correlation of the counters of each function,
+# that of the functions by maximum count, and the fraction of counters whose
+# coverage (zero or not) the static profile gets wrong. All of them are
+# collected into <work_dir>/scorecard.json, a JSON array, so modes and
+# releases can be compared on accuracy and throughput together. A program
+# whose export or comparison fails gets an "error" member instead of a score,
+# and the script exits with a nonzero status once every program is done.
+
+set -e
+
+SPROFGEN="${1:?Usage: $0 <llvm-sprofgen> <work_dir> [program_dir...]}"
+WORK_DIR="${2:?Usage: $0 <llvm-sprofgen> <work_dir> [program_dir...]}"
+shift 2
+
+CLANG="${CLANG:-clang}"
+LLVM_PROFDATA="${LLVM_PROFDATA:-llvm-profdata}"
+SIZES="${SIZES:-1000}"
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+
+for tool in "$CLANG" "$LLVM_PROFDATA"; do
+    if ! command -v "$tool" &> /dev/null; then
+        echo "Error: Required tool '$tool' not found"
+        exit 1
+    fi
+done
+
+mkdir -p "$WORK_DIR/programs" "$WORK_DIR/reports"
+rm -f "$WORK_DIR"/reports/*.json
+
+PROGRAMS=()
+
+for size in $SIZES; do
+    program="$WORK_DIR/programs/generated_$size.c"
+    if [ ! -f "$program" ]; then
+        echo "=== Generating program with $size functions ==="
+        "$SCRIPT_DIR/generate_module.sh" "$size" "$program"
+    fi
+    PROGRAMS+=("$program")
+done
+
+for dir in "$@"; do
+    while IFS= read -r -d '' program; do
+        if grep -q -E '^[a-z ]*int[[:space:]]+main[[:space:]]*\(' "$program"; then
+            PROGRAMS+=("$program")
+        fi
+    done < <(find "$dir" -maxdepth 1 -type f -name '*.c' -print0 | sort -z)
+done
+
+if [ ${#PROGRAMS[@]} -eq 0 ]; then
+    echo "Error: No programs to score"
+    exit 1
+fi
+
+FAILED=0
+for program in "${PROGRAMS[@]}"; do
+    name=$(basename "$program" .c)
+    out="$WORK_DIR/$name"
+    echo "=== $name ==="
+
+    args=()
+    if [ -f "${program%.c}.args" ]; then
+        read -r -a args < "${program%.c}.args"
+    fi
+
+    if ! "$CLANG" -O2 -fprofile-instr-generate -fcoverage-mapping -emit-llvm -c \
+            "$program" -o "$out.bc" ||
+       ! "$CLANG" -O2 -fprofile-instr-generate -fcoverage-mapping \
+            "$program" -o "$out.exe"; then
+        echo "Warning: Cannot build '$program', skipping"
+        FAILED=1
+        continue
+    fi
+
+    # A nonzero exit status is the program's business; its profile is written
+    # either way.
+    rm -f "$out".*.profraw
+    LLVM_PROFILE_FILE="$out.%p.profraw" "$out.exe" "${args[@]}" > /dev/null || true
+    if ! "$LLVM_PROFDATA" merge -o "$out.dynamic.profdata" "$out".*.profraw; then
+        echo "Warning: No profile of a run of '$name', skipping"
+        FAILED=1
+        continue
+    fi
+
+    # A failed export or comparison is recorded in the program's report, so
+    # the scorecard still covers every program.
+    rm -f "$out.benchmark.json" "$out.static.profdata" "$out.score.json"
+    error=""
+    # shellcheck disable=SC2086
+    if ! "$SPROFGEN" $CASP_ARGS --benchmark-json="$out.benchmark.json" \
+            "$out.bc" "$out.static.profdata" > /dev/null; then
+        echo "Warning: Cannot export the static profile of '$name'"
+        error="export failed"
+    elif ! "$SPROFGEN" --compare-profiles "$out.static.profdata" \
+            "$out.dynamic.profdata" > "$out.score.json"; then
+        echo "Warning: Cannot compare the profiles of '$name'"
+        error="comparison failed"
+    fi
+    if [ -n "$error" ]; then
+        FAILED=1
+    fi
+
+    {
+        echo "{"
+        echo "\"program\": \"$name\","
+        if [ -s "$out.benchmark.json" ]; then
+            echo "\"export\":"
+            cat "$out.benchmark.json"
+            echo ","
+        fi
+        if [ -n "$error" ]; then
+            echo "\"error\": \"$error\""
+        else
+            echo "\"score\":"
+            cat "$out.score.json"
+        fi
+        echo "}"
+    } > "$WORK_DIR/reports/$name.json"
+done
+
+REPORT="$WORK_DIR/scorecard.json"
+{
+    echo "["
+    first=1
+    for report in "$WORK_DIR"/reports/*.json; do
+        [ -f "$report" ] || continue
+        [ $first -eq 1 ] || echo ","
+        first=0
+        cat "$report"
+    done
+    echo "]"
+} > "$REPORT"
+
+echo ""
+echo "Scorecard written to: $REPORT"
+exit $FAILED
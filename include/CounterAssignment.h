@@ -0,0 +1,76 @@
+//===- CounterAssignment.h - Map BFI counts onto counters ------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the counter assignment engine used for instrumented IR.
+// Every instrumentation counter is tied to the basic blocks that increment it
+// (llvm.instrprof.increment calls, or the loads/stores and atomics they are
+// lowered to, including counters promoted out of loops), and gets the sum of
+// those blocks' static counts. The function's coverage mapping is then used to
+// keep counter expressions such as "A - B" from going negative.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_COUNTERASSIGNMENT_H
+#define CASP_COUNTERASSIGNMENT_H
+
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ProfileData/Coverage/CoverageMapping.h"
+#include <cstdint>
+#include <vector>
+
+namespace llvm {
+
+class BasicBlock;
+class CoverageRecordIndex;
+class Function;
+struct InstrumentedFunctionRecord;
+
+/// A block that increments counter Index.
+struct CounterSite {
+  unsigned Index;
+  const BasicBlock *BB;
+
+  bool operator==(const CounterSite &RHS) const {
+    return Index == RHS.Index && BB == RHS.BB;
+  }
+};
+
+/// Working storage of the conversion of block frequencies to counters. One
+/// instance is kept per thread and reused for every function, so once its
+/// buffers have grown to the largest function, computing counters does not
+/// allocate beyond the counter vector that ends up in the profile record.
+struct CounterScratch {
+  SmallVector<uint64_t, 32> Freqs;
+  /// Scaled counts of the blocks of the function, indexed by block number.
+  SmallVector<uint64_t, 32> BlockCounts;
+  SmallVector<CounterSite, 16> Sites;
+  std::vector<coverage::CounterExpression> Expressions;
+  std::vector<coverage::CounterMappingRegion> Regions;
+  std::vector<StringRef> Filenames;
+};
+
+/// Compute the value of every instrumentation counter of \p F.
+///
+/// \p PGOName and \p Instr identify the counters that belong to \p F itself,
+/// as opposed to counters of inlined callees. \p BlockCount returns the static
+/// execution count of a block. Counters whose increment cannot be found are
+/// unreachable and get a count of zero.
+///
+/// Returns false, leaving \p Counts empty, if no increment of \p F could be
+/// located at all. \p Scratch holds the intermediate results.
+bool assignInstrumentationCounters(
+    const Function &F, StringRef PGOName,
+    const InstrumentedFunctionRecord &Instr, const CoverageRecordIndex &Index,
+    function_ref<uint64_t(const BasicBlock &)> BlockCount,
+    CounterScratch &Scratch, std::vector<uint64_t> &Counts);
+
+} // namespace llvm
+
+#endif // CASP_COUNTERASSIGNMENT_H
@@ -0,0 +1,95 @@
+//===- CoverageRecordIndex.h - Index of instrumentation records -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares CoverageRecordIndex, a module-wide table of the coverage
+// records (__covrec_) and profile data records (__profd_) emitted by
+// -fprofile-instr-generate -fcoverage-mapping. Both kinds of records start
+// with the MD5 of the function's PGO name, so the index is built with one scan
+// over the module globals and queried by that hash, without formatting or
+// looking up symbol names per function. The same scan decodes the filenames
+// tables (__llvm_coverage_mapping) that the encoded mapping regions refer to.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_COVERAGERECORDINDEX_H
+#define CASP_COVERAGERECORDINDEX_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class Module;
+
+namespace coverage {
+struct CounterExpression;
+struct CounterMappingRegion;
+} // namespace coverage
+
+/// Instrumentation metadata of one function, decoded from its coverage record
+/// and profile data globals.
+struct InstrumentedFunctionRecord {
+  /// Structural hash from the coverage record; llvm-cov matches profile
+  /// records against it.
+  std::optional<uint64_t> StructHash;
+  /// Number of counters allocated by the instrumentation (__profd_).
+  std::optional<unsigned> NumCounters;
+  /// Name of the counter array (__profc_) the function increments.
+  StringRef CountersName;
+  /// Hash of the filenames blob the coverage mapping refers to.
+  uint64_t FilenamesRef = 0;
+  /// Encoded coverage mapping regions. Points into the module's constants.
+  StringRef MappingData;
+};
+
+class CoverageRecordIndex {
+  DenseMap<uint64_t, InstrumentedFunctionRecord> Records;
+  /// Translation unit filenames, keyed by the hash of their encoded blob.
+  DenseMap<uint64_t, std::vector<std::string>> Filenames;
+
+public:
+  /// Build the index with a single scan over the globals of \p M.
+  explicit CoverageRecordIndex(const Module &M);
+
+  /// Return the records of the function whose PGO name hashes to
+  /// \p NameHash, or null if it is not instrumented.
+  const InstrumentedFunctionRecord *lookup(uint64_t NameHash) const {
+    auto It = Records.find(NameHash);
+    return It == Records.end() ? nullptr : &It->second;
+  }
+
+  /// Decode the coverage mapping of \p Record into its counter expressions
+  /// and mapping regions. If \p FunctionFilenames is given, it receives the
+  /// files the FileIDs of the regions refer to; they point into the index.
+  Error readMapping(const InstrumentedFunctionRecord &Record,
+                    std::vector<coverage::CounterExpression> &Expressions,
+                    std::vector<coverage::CounterMappingRegion> &Regions,
+                    std::vector<StringRef> *FunctionFilenames = nullptr) const;
+
+  /// Return the filenames of the translation unit whose filenames blob hashes
+  /// to \p FilenamesRef.
+  ArrayRef<std::string> getFilenames(uint64_t FilenamesRef) const {
+    auto It = Filenames.find(FilenamesRef);
+    if (It == Filenames.end())
+      return {};
+    return It->second;
+  }
+
+  bool empty() const { return Records.empty(); }
+  size_t size() const { return Records.size(); }
+};
+
+} // namespace llvm
+
+#endif // CASP_COVERAGERECORDINDEX_H
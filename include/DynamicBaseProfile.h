@@ -0,0 +1,66 @@
+//===- DynamicBaseProfile.h - Runtime profile under a static one -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares DynamicBaseProfile, an indexed profile of real runs that
+// a static profile export builds on. Functions with nonzero counts in it keep
+// their recorded counts, including value profiles, and are not analyzed; only
+// the functions the runs missed get static counts. Those are scaled to the
+// magnitude of the runtime profile, so both kinds of records can be compared.
+//
+// A record is only reused if its hash matches the function, which holds for
+// profiles of frontend instrumentation (-fprofile-instr-generate) of the
+// same source. Records of IR-level instrumentation use a different hash and
+// are never reused.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_DYNAMICBASEPROFILE_H
+#define CASP_DYNAMICBASEPROFILE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+namespace llvm {
+
+class IndexedInstrProfReader;
+
+class DynamicBaseProfile {
+  /// Lookups decode records into the reader's buffers.
+  mutable std::mutex Mutex;
+  std::unique_ptr<IndexedInstrProfReader> Reader;
+  uint64_t EntryCount = 0;
+
+  DynamicBaseProfile() = default;
+
+public:
+  ~DynamicBaseProfile();
+
+  /// Read the indexed profile at \p Path.
+  static Expected<std::shared_ptr<const DynamicBaseProfile>>
+  create(StringRef Path);
+
+  /// Median of the nonzero entry counts (counter 0) of the profile, the
+  /// entry count static records are scaled to. 0 if the profile holds no
+  /// nonzero record.
+  uint64_t getEntryCount() const { return EntryCount; }
+
+  /// The counts of the function named \p Name with hash \p Hash, if it has
+  /// a nonzero count. Records of older profiles may be named \p AltName
+  /// instead. May be called from several threads.
+  std::optional<InstrProfRecord> lookup(StringRef Name, StringRef AltName,
+                                        uint64_t Hash) const;
+};
+
+} // namespace llvm
+
+#endif // CASP_DYNAMICBASEPROFILE_H
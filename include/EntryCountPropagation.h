@@ -0,0 +1,75 @@
+//===- EntryCountPropagation.h - Interprocedural entry counts --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the interprocedural stage that gives every function an
+// entry count derived from its callers, instead of the same count for all.
+//
+// Functions that can be entered from outside the module (externally visible
+// or address-taken) start at the root entry count; local functions without
+// callers end up with zero. The direct call graph is
+// then walked in SCC order, callers first, and each call site adds the
+// caller's entry count times the call site's frequency relative to the
+// caller's entry block to the callee. Inside a recursive SCC the recursive
+// contributions are damped and iterated a bounded number of rounds.
+//
+// The call graph is stored as flat edge arrays and every edge is visited once
+// per round of its SCC, so the stage is linear in the number of call sites.
+// The calls of each function are collected separately, one function body at
+// a time, so that they can be collected on several threads and from bodies
+// that are loaded only for the purpose.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_ENTRYCOUNTPROPAGATION_H
+#define CASP_ENTRYCOUNTPROPAGATION_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/ScaledNumber.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+
+class BlockFrequencyInfo;
+class Function;
+
+/// The direct calls of one function to the functions of the call graph, and
+/// the functions whose address it takes. Functions are identified by their
+/// index in the graph, so calls collected from another copy of the module
+/// apply as well.
+struct FunctionCalls {
+  /// Callee of every call site and the frequency of its block relative to
+  /// the caller's entry block.
+  std::vector<std::pair<unsigned, ScaledNumber<uint64_t>>> Calls;
+  /// Functions used other than as the callee of a direct call.
+  std::vector<unsigned> AddressesTaken;
+};
+
+/// Collect the calls of \p F, whose blocks have the frequencies \p BFI, to the
+/// functions \p Ids maps to their index in the call graph.
+void collectFunctionCalls(const Function &F, const BlockFrequencyInfo &BFI,
+                          const DenseMap<const Function *, unsigned> &Ids,
+                          FunctionCalls &Calls);
+
+/// Compute the entry count of every function of \p Defined into the matching
+/// element of \p EntryCounts. \p Calls holds the calls of each function of
+/// \p Defined, indexed like it. \p RootEntryCount is the entry count of the
+/// functions that can be called from outside the module: those that are not
+/// local, and local ones whose address is taken, either in \p Calls or by a
+/// user outside the function bodies. The bodies of \p Defined need not be
+/// loaded.
+void propagateEntryCounts(ArrayRef<Function *> Defined,
+                          ArrayRef<FunctionCalls> Calls,
+                          uint64_t RootEntryCount,
+                          std::vector<uint64_t> &EntryCounts);
+
+} // namespace llvm
+
+#endif // CASP_ENTRYCOUNTPROPAGATION_H
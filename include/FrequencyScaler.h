@@ -0,0 +1,107 @@
+//===- FrequencyScaler.h - Scale block frequencies to counts ---*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares FrequencyScaler, which turns the block frequencies of one
+// function into execution counts relative to the function's entry count:
+//
+//   Count = floor(EntryCount * Freq / EntryFreq)
+//
+// The result is exact for every 64-bit input and saturates at UINT64_MAX
+// instead of wrapping. The division is done once per function: the scaler
+// keeps the 128-bit fixed-point ratio EntryCount * 2^64 / EntryFreq, and each
+// frequency costs three 64x64-bit multiplications plus one more to correct the
+// rounding of the ratio.
+//
+// Whole functions are scaled at once from a contiguous array of frequencies.
+// When the entry count, the entry frequency and the frequencies all fit in 32
+// bits, which covers most functions, every product fits in a 32x32-bit
+// multiplication and the array is scaled several frequencies at a time with
+// AVX2 or NEON, with the same exact result.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_FREQUENCYSCALER_H
+#define CASP_FREQUENCYSCALER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+namespace llvm {
+
+namespace fixedpoint {
+
+/// Return the 128-bit product of \p A and \p B as {high, low} halves.
+inline std::pair<uint64_t, uint64_t> multiply(uint64_t A, uint64_t B) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 P = static_cast<unsigned __int128>(A) * B;
+  return {static_cast<uint64_t>(P >> 64), static_cast<uint64_t>(P)};
+#else
+  uint64_t AL = A & 0xffffffff, AH = A >> 32;
+  uint64_t BL = B & 0xffffffff, BH = B >> 32;
+  uint64_t LL = AL * BL, LH = AL * BH, HL = AH * BL, HH = AH * BH;
+  uint64_t Mid = (LL >> 32) + (LH & 0xffffffff) + (HL & 0xffffffff);
+  return {HH + (LH >> 32) + (HL >> 32) + (Mid >> 32),
+          (Mid << 32) | (LL & 0xffffffff)};
+#endif
+}
+
+/// Return true if the 128-bit value {AH, AL} is at most {BH, BL}.
+inline bool lessOrEqual(std::pair<uint64_t, uint64_t> A,
+                        std::pair<uint64_t, uint64_t> B) {
+  return A.first < B.first || (A.first == B.first && A.second <= B.second);
+}
+
+} // namespace fixedpoint
+
+class FrequencyScaler {
+  uint64_t EntryCount;
+  uint64_t EntryFreq;
+  /// EntryCount * 2^64 / EntryFreq, rounded down, as {high, low} halves.
+  uint64_t RatioHi = 0;
+  uint64_t RatioLo = 0;
+  /// Whether EntryCount and EntryFreq fit in 32 bits, so that frequencies
+  /// that do as well can take the vector kernel.
+  bool Narrow = false;
+
+public:
+  /// Scale frequencies relative to \p EntryFreq, the frequency of the entry
+  /// block, which must be nonzero.
+  FrequencyScaler(uint64_t EntryCount, uint64_t EntryFreq);
+
+  uint64_t getEntryCount() const { return EntryCount; }
+
+  /// Return floor(EntryCount * Freq / EntryFreq), saturated to 64 bits.
+  uint64_t scale(uint64_t Freq) const {
+    constexpr uint64_t Max = std::numeric_limits<uint64_t>::max();
+
+    // Freq * Ratio / 2^64 = Freq * RatioHi + high(Freq * RatioLo).
+    auto [HiHi, HiLo] = fixedpoint::multiply(Freq, RatioHi);
+    if (HiHi)
+      return Max;
+    uint64_t Count = HiLo + fixedpoint::multiply(Freq, RatioLo).first;
+    if (Count < HiLo)
+      return Max;
+
+    // The ratio was rounded down, so Count is the exact result or one less.
+    if (Count != Max &&
+        fixedpoint::lessOrEqual(fixedpoint::multiply(Count + 1, EntryFreq),
+                                fixedpoint::multiply(EntryCount, Freq)))
+      ++Count;
+    return Count;
+  }
+
+  /// Scale every frequency of \p Freqs into the matching element of \p Counts,
+  /// which must be at least as long. \p Counts may be \p Freqs itself.
+  void scale(ArrayRef<uint64_t> Freqs, uint64_t *Counts) const;
+};
+
+} // namespace llvm
+
+#endif // CASP_FREQUENCYSCALER_H
@@ -0,0 +1,96 @@
+//===- FunctionFilter.h - Select the functions to export -------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares FunctionFilter, which restricts a static profile export
+// to part of a module: the functions of some source files, functions whose
+// names match a pattern, functions placed in some sections, an explicit list
+// of function GUIDs, or a deterministic sample of all functions. Rejected
+// functions are dropped before their body is loaded or analyzed, so a partial
+// export costs in proportion to the code it covers.
+//
+// Every kind of rule has an include and an exclude list. A function is
+// exported if, for every kind that has include rules, it matches one of them,
+// and it matches no exclude rule.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_FUNCTIONFILTER_H
+#define CASP_FUNCTIONFILTER_H
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/Regex.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class Function;
+
+/// Filter rules as given on the command line.
+struct FunctionFilterOptions {
+  /// Glob patterns of source file paths. A pattern matches a path if it
+  /// matches the whole path or any trailing part of it that starts after a
+  /// '/', so "net/*.c" matches "/src/net/tcp.c".
+  std::vector<std::string> IncludeFiles, ExcludeFiles;
+  /// Regular expressions searched for in the mangled and demangled names.
+  std::vector<std::string> IncludeFunctions, ExcludeFunctions;
+  /// Names of object file sections.
+  std::vector<std::string> IncludeSections, ExcludeSections;
+  /// Files listing one function GUID (the MD5 of the PGO name, as in the
+  /// indexed profile) per line, in decimal or with a 0x prefix. Empty lines
+  /// and lines starting with '#' are ignored.
+  std::string IncludeGUIDFile, ExcludeGUIDFile;
+  /// Percentage of the functions to export, chosen by GUID so that every run
+  /// picks the same ones.
+  unsigned SamplePercent = 100;
+};
+
+class FunctionFilter {
+  struct Rules {
+    std::vector<GlobPattern> Files;
+    std::vector<Regex> Names;
+    StringSet<> Sections;
+    DenseSet<uint64_t> GUIDs;
+    bool HasGUIDs = false;
+  };
+
+  Rules Include, Exclude;
+  unsigned SamplePercent = 100;
+
+  FunctionFilter() = default;
+
+public:
+  /// Build the filter described by \p Opts. Returns null if it accepts every
+  /// function, and an error if a pattern or GUID list is invalid.
+  static Expected<std::shared_ptr<const FunctionFilter>>
+  create(const FunctionFilterOptions &Opts);
+
+  /// Whether any rule depends on the source file of a function.
+  bool hasFileRules() const {
+    return !Include.Files.empty() || !Exclude.Files.empty();
+  }
+
+  /// Whether \p F, whose PGO name hashes to \p GUID, is exported.
+  /// \p GetSourceFile returns the path of the file that defines \p F, or an
+  /// empty string if it is unknown; it is only called when every other rule
+  /// accepts \p F and there are file rules. Functions of unknown files only
+  /// pass the file rules if there are no include rules.
+  bool accepts(const Function &F, uint64_t GUID,
+               function_ref<std::string()> GetSourceFile) const;
+};
+
+} // namespace llvm
+
+#endif // CASP_FUNCTIONFILTER_H
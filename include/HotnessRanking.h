@@ -0,0 +1,200 @@
+//===- HotnessRanking.h - Hot and cold code from static profiles -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares HotnessRanking, which ranks the functions and counters of
+// a static profile as the records are produced, for link ordering and hot/cold
+// splitting decisions that do not need a profile file. The K hottest functions
+// and counters are kept in bounded heaps, so a top-K ranking costs O(K) memory
+// however large the module is; the entry and maximum count of every function
+// are only kept on request, for a symbol ordering file. StaticHotnessAnalysis
+// makes the ranking of a module available to other passes.
+//
+// Counts of different functions are only comparable when they are not all
+// scaled to the same entry count, i.e. with propagated or profile-provided
+// entry counts (see StaticProfileExporterOptions).
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_HOTNESSRANKING_H
+#define CASP_HOTNESSRANKING_H
+
+#include "StaticProfileExporter.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/PassManager.h"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class Function;
+class Module;
+class raw_ostream;
+
+/// The \p K largest elements of a stream under \p Less, in a min-heap.
+template <typename T, typename Less> class TopK {
+  std::vector<T> Heap;
+  size_t K;
+
+  // std::*_heap keep the largest element in front; invert the order to keep
+  // the smallest of the K largest there, ready to be evicted.
+  static bool greater(const T &L, const T &R) { return Less()(R, L); }
+
+public:
+  explicit TopK(size_t K) : K(K) { Heap.reserve(K); }
+
+  /// Whether push(\p Value) would keep \p Value, so callers can skip
+  /// building costly elements the heap would drop.
+  bool accepts(const T &Value) const {
+    return K && (Heap.size() < K || Less()(Heap.front(), Value));
+  }
+
+  void push(T Value) {
+    if (!K)
+      return;
+    if (Heap.size() < K) {
+      Heap.push_back(std::move(Value));
+      std::push_heap(Heap.begin(), Heap.end(), greater);
+    } else if (Less()(Heap.front(), Value)) {
+      std::pop_heap(Heap.begin(), Heap.end(), greater);
+      Heap.back() = std::move(Value);
+      std::push_heap(Heap.begin(), Heap.end(), greater);
+    }
+  }
+
+  /// The elements kept, largest first.
+  std::vector<T> getSorted() const {
+    std::vector<T> Sorted = Heap;
+    std::sort(Sorted.begin(), Sorted.end(), greater);
+    return Sorted;
+  }
+};
+
+class HotnessRanking {
+public:
+  struct FunctionHotness {
+    /// Symbol name of the function.
+    std::string Name;
+    /// Count of counter 0: the entry block, or the entry region of an
+    /// instrumented function.
+    uint64_t EntryCount = 0;
+    uint64_t MaxCount = 0;
+  };
+
+  struct CounterHotness {
+    /// Symbol name of the function.
+    std::string Name;
+    /// Position of the function in the order the functions were added.
+    size_t Function;
+    /// Counter of the record: the block in layout order for uninstrumented
+    /// functions, the instrumentation counter otherwise.
+    unsigned Counter;
+    uint64_t Count;
+  };
+
+private:
+  struct RankedFunction {
+    FunctionHotness Hotness;
+    /// Position of the function in the order the functions were added.
+    size_t Index;
+  };
+  struct ByMaxCount {
+    bool operator()(const RankedFunction &L, const RankedFunction &R) const {
+      // Among equal counts, functions seen first rank higher.
+      if (L.Hotness.MaxCount != R.Hotness.MaxCount)
+        return L.Hotness.MaxCount < R.Hotness.MaxCount;
+      return L.Index > R.Index;
+    }
+  };
+  struct ByCount {
+    bool operator()(const CounterHotness &L, const CounterHotness &R) const {
+      if (L.Count != R.Count)
+        return L.Count < R.Count;
+      return L.Function != R.Function ? L.Function > R.Function
+                                      : L.Counter > R.Counter;
+    }
+  };
+
+  std::mutex Mutex;
+  bool KeepFunctions;
+  size_t NumFunctions = 0;
+  std::vector<FunctionHotness> Functions;
+  TopK<RankedFunction, ByMaxCount> HotFunctions;
+  TopK<CounterHotness, ByCount> HotCounters;
+
+public:
+  /// Keep the \p K hottest functions and counters and, with
+  /// \p KeepFunctions, the entry and maximum count of every function.
+  explicit HotnessRanking(size_t K = 100, bool KeepFunctions = false)
+      : KeepFunctions(KeepFunctions), HotFunctions(K), HotCounters(K) {}
+
+  HotnessRanking(HotnessRanking &&RHS)
+      : KeepFunctions(RHS.KeepFunctions), NumFunctions(RHS.NumFunctions),
+        Functions(std::move(RHS.Functions)),
+        HotFunctions(std::move(RHS.HotFunctions)),
+        HotCounters(std::move(RHS.HotCounters)) {}
+
+  /// Rank the function with symbol name \p Name and counters \p Counts. May
+  /// be called from several threads.
+  void addFunction(StringRef Name, ArrayRef<uint64_t> Counts);
+
+  /// Entry and maximum count of every function, in the order they were added.
+  /// Empty unless the ranking keeps every function.
+  ArrayRef<FunctionHotness> getFunctions() const { return Functions; }
+
+  /// The K functions with the highest maximum count, hottest first.
+  std::vector<FunctionHotness> getHottestFunctions() const;
+
+  /// The K counters with the highest count across all functions, hottest
+  /// first.
+  std::vector<CounterHotness> getHottestCounters() const {
+    return HotCounters.getSorted();
+  }
+
+  /// Print the hottest functions and counters.
+  void print(raw_ostream &OS) const;
+
+  /// Write every function with a nonzero count to \p Path as an lld
+  /// --symbol-ordering-file, hottest first by maximum count, then by entry
+  /// count. Needs a ranking that keeps every function. Errors are reported on
+  /// stderr.
+  bool writeSymbolOrderingFile(StringRef Path) const;
+
+  /// Invalidated unless StaticHotnessAnalysis or all module analyses are
+  /// preserved.
+  bool invalidate(Module &M, const PreservedAnalyses &PA,
+                  ModuleAnalysisManager::Invalidator &Inv);
+};
+
+/// Computes the static profile of a module and ranks it, without writing a
+/// profile. The ranking keeps every function, for passes that order or split
+/// all of them.
+class StaticHotnessAnalysis : public AnalysisInfoMixin<StaticHotnessAnalysis> {
+  friend AnalysisInfoMixin<StaticHotnessAnalysis>;
+  static AnalysisKey Key;
+
+  StaticProfileExporterOptions Options;
+  size_t K;
+
+public:
+  using Result = HotnessRanking;
+
+  explicit StaticHotnessAnalysis(StaticProfileExporterOptions Opts = {},
+                                 size_t K = 100)
+      : Options(std::move(Opts)), K(K) {}
+
+  Result run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+} // namespace llvm
+
+#endif // CASP_HOTNESSRANKING_H
@@ -0,0 +1,68 @@
+//===- LoopTripCountRefinement.h - Known loop trip counts ------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares LoopTripCountRefinement, which corrects block
+// frequencies for the loops whose trip count ScalarEvolution knows.
+// BlockFrequencyInfo derives the iterations of a loop from the probability of
+// its back edges, which is the same guess for a loop of four iterations as for
+// one that runs until a pointer is null.
+//
+// For every loop, the iterations BlockFrequencyInfo assumed are the frequency
+// of the header over the frequency of the edges entering it. A loop with a
+// constant trip count gets that many instead, and a loop with a constant
+// maximum trip count at most that many; all the blocks of the loop are scaled
+// by the same factor. The frequencies of a loop already scale with the loops
+// around it, so the factor of each loop is independent of the others, and the
+// factor of a block is the product of those of the loops that contain it.
+// Computing them takes one pass over the loop forest, which multiplies the
+// factor of each loop into those of its subloops, and one over the blocks,
+// besides the trip counts themselves.
+//
+// Blocks outside every corrected loop keep their frequencies, and the entry
+// block is never in a loop, so counts scaled to the entry block stay valid.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_LOOPTRIPCOUNTREFINEMENT_H
+#define CASP_LOOPTRIPCOUNTREFINEMENT_H
+
+#include "llvm/ADT/SmallVector.h"
+#include <cstdint>
+
+namespace llvm {
+
+class BasicBlock;
+class BlockFrequencyInfo;
+class Function;
+class LoopInfo;
+class ScalarEvolution;
+
+class LoopTripCountRefinement {
+  /// Factor of every block, indexed by block number. Empty when no loop was
+  /// corrected.
+  SmallVector<double, 32> Scales;
+  unsigned LoopsRefined = 0;
+
+public:
+  /// Compute the factors of the blocks of \p F from the loops \p LI, the trip
+  /// counts of \p SE and the frequencies of \p BFI, replacing those of the
+  /// previous function.
+  void compute(const Function &F, const LoopInfo &LI, ScalarEvolution &SE,
+               const BlockFrequencyInfo &BFI);
+
+  /// \p Freq, the frequency of \p BB, corrected for the trip counts of its
+  /// loops. Saturates instead of overflowing.
+  uint64_t refine(const BasicBlock &BB, uint64_t Freq) const;
+
+  /// Number of loops of the last function whose frequencies were corrected.
+  unsigned getNumLoopsRefined() const { return LoopsRefined; }
+};
+
+} // namespace llvm
+
+#endif // CASP_LOOPTRIPCOUNTREFINEMENT_H
@@ -0,0 +1,63 @@
+//===- StaticCoverageReport.h - Coverage summary of a profile --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares StaticCoverageReport, which evaluates the coverage
+// mapping regions of a module against the counters of its static profile and
+// summarizes region, function, line and branch coverage per source file in
+// the layout of `llvm-cov report`. It works on the in-memory counters, so no
+// profile has to be written and no instrumented binary has to be linked.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_STATICCOVERAGEREPORT_H
+#define CASP_STATICCOVERAGEREPORT_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include <cstdint>
+
+namespace llvm {
+
+class CoverageRecordIndex;
+class raw_ostream;
+struct InstrumentedFunctionRecord;
+
+class StaticCoverageReport {
+  struct FileSummary {
+    unsigned Regions = 0;
+    unsigned CoveredRegions = 0;
+    unsigned Functions = 0;
+    unsigned ExecutedFunctions = 0;
+    unsigned Branches = 0;
+    unsigned CoveredBranches = 0;
+    /// Whether each line with code was executed by any function.
+    DenseMap<unsigned, bool> Lines;
+  };
+
+  StringMap<FileSummary> Files;
+  unsigned UnmappedFunctions = 0;
+
+public:
+  /// Add the coverage of the function with the instrumentation records
+  /// \p Instr, whose counters hold \p Counts. Functions whose mapping cannot be
+  /// decoded are only counted (see getUnmappedFunctions).
+  void addFunction(const CoverageRecordIndex &Index,
+                   const InstrumentedFunctionRecord &Instr,
+                   ArrayRef<uint64_t> Counts);
+
+  bool empty() const { return Files.empty(); }
+  unsigned getUnmappedFunctions() const { return UnmappedFunctions; }
+
+  /// Print one line per source file, sorted by name, and the totals.
+  void print(raw_ostream &OS) const;
+};
+
+} // namespace llvm
+
+#endif // CASP_STATICCOVERAGEREPORT_H
@@ -0,0 +1,111 @@
+//===- StaticFrequencyFile.h - Per-block static frequencies ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the writer and reader of static frequency files, a
+// sidecar to the indexed profile for tools that want the scaled count of
+// every basic block rather than of every coverage counter. The file is meant
+// to be memory-mapped and queried in place:
+//
+//   Header    magic, version, number of functions, offsets of the sections
+//   Index     one fixed-size entry per function, sorted by GUID:
+//             GUID, offset and size of its data, number of blocks
+//   Data      per function, two columns over its blocks in layout order:
+//             the source line of each block, then its scaled count, each
+//             stored as the first value followed by the deltas to the
+//             previous value, all LEB128 encoded
+//
+// All fixed-size fields are little-endian. The GUID is the MD5 of the name
+// the function's record has in the indexed profile (its IR PGO name), so a
+// lookup is a binary search of the index followed by decoding one function's
+// columns.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_STATICFREQUENCYFILE_H
+#define CASP_STATICFREQUENCYFILE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llvm {
+
+class Function;
+
+/// Collects the per-block counts of exported functions and writes them as a
+/// static frequency file. Functions may be added from several threads.
+class StaticFrequencyWriter {
+  struct FunctionData {
+    uint32_t NumBlocks = 0;
+    std::string Columns;
+  };
+
+  std::mutex Mutex;
+  /// Encoded columns, keyed by GUID. Adding a function again keeps the first
+  /// one, so the order functions are added in decides.
+  DenseMap<uint64_t, FunctionData> Functions;
+
+public:
+  /// Add the function with GUID \p GUID, whose blocks, in layout order, start
+  /// on source lines \p Lines (0 if unknown) and have counts \p Counts.
+  void addFunction(uint64_t GUID, ArrayRef<uint32_t> Lines,
+                   ArrayRef<uint64_t> Counts);
+
+  /// Add \p F, whose blocks have counts \p Counts, taking the line of each
+  /// block from the first instruction with a debug location.
+  void addFunction(const Function &F, uint64_t GUID,
+                   ArrayRef<uint64_t> Counts);
+
+  /// Move the functions of \p Other that this writer does not have yet into
+  /// it, leaving \p Other empty.
+  void merge(StaticFrequencyWriter &&Other);
+
+  /// Replace the counts of the function with GUID \p GUID by \p Counts,
+  /// keeping its lines. Returns false if there is no such function or it has
+  /// another number of blocks.
+  bool replaceCounts(uint64_t GUID, ArrayRef<uint64_t> Counts);
+
+  /// Write every function added so far to \p Path. Errors are reported on
+  /// stderr.
+  bool write(StringRef Path);
+};
+
+/// A static frequency file, read in place from a memory mapping.
+class StaticFrequencyFile {
+  std::unique_ptr<MemoryBuffer> Buffer;
+  uint64_t NumFunctions = 0;
+  const char *Index = nullptr;
+  StringRef Data;
+
+  StaticFrequencyFile() = default;
+
+public:
+  static Expected<std::unique_ptr<StaticFrequencyFile>> open(StringRef Path);
+
+  size_t size() const { return NumFunctions; }
+
+  /// GUID of the \p I-th function, in ascending GUID order.
+  uint64_t getGUID(size_t I) const;
+
+  /// Decode the lines and counts of the blocks of the function with GUID
+  /// \p GUID. Returns false if the file has no such function or its data is
+  /// malformed.
+  bool lookup(uint64_t GUID, SmallVectorImpl<uint32_t> &Lines,
+              SmallVectorImpl<uint64_t> &Counts) const;
+};
+
+} // namespace llvm
+
+#endif // CASP_STATICFREQUENCYFILE_H
@@ -0,0 +1,57 @@
+//===- StaticProfileCache.h - On-disk cache of static profiles -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares StaticProfileCache, a directory of finished per-function
+// profile records. Each entry is keyed by a hash of everything its record is
+// derived from (see computeStaticProfileCacheKey in StaticProfileExporter.cpp),
+// so a re-export only runs block frequency analysis on functions that changed.
+//
+// Entries are written to a temporary file and renamed into place, so several
+// processes or threads can share one cache directory.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_STATICPROFILECACHE_H
+#define CASP_STATICPROFILECACHE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class StaticProfileCache {
+  std::string Dir;
+
+  std::string getEntryPath(uint64_t Key) const;
+
+public:
+  /// Version of the cache contents. Bump it whenever CASP computes different
+  /// counts for the same IR, so entries of older releases are not reused.
+  static constexpr uint64_t Version = 1;
+
+  /// Use the cache in \p Dir, creating the directory if needed. Failing to
+  /// create it is reported and leaves the cache disabled.
+  explicit StaticProfileCache(StringRef Dir);
+
+  bool isEnabled() const { return !Dir.empty(); }
+
+  /// Load the record hash and counters stored under \p Key. Returns false if
+  /// there is no entry or it cannot be read.
+  bool lookup(uint64_t Key, uint64_t &Hash, std::vector<uint64_t> &Counts) const;
+
+  /// Store \p Hash and \p Counts under \p Key. Failures only cost a future
+  /// cache miss and are not reported.
+  void store(uint64_t Key, uint64_t Hash, ArrayRef<uint64_t> Counts) const;
+};
+
+} // namespace llvm
+
+#endif // CASP_STATICPROFILECACHE_H
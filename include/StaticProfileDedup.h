@@ -0,0 +1,97 @@
+//===- StaticProfileDedup.h - Duplicate functions --------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares StaticProfileDedup, which tracks the functions that more
+// than one module of an export defines. Template instantiations and inline
+// functions of headers are emitted, with the same profile name and hash, by
+// every translation unit that uses them, and the linker keeps one copy.
+// Adding a record per copy to one profile would sum them and multiply their
+// counts by the number of copies.
+//
+// Copies are identified by profile name and function hash. A DuplicatePolicy
+// says what the profile gets:
+//
+//   Sum      one record per copy, summed by the profile writer
+//   KeepOne  the record of the first copy exported; the others are dropped
+//            before their block frequencies are computed
+//   Average  the counter-wise average of all copies, which only differs from
+//            KeepOne when entry counts come from the module, e.g. when they
+//            are propagated from callers. Value profiles, which only records
+//            of a base profile have, are those of the first copy
+//
+// Across runs, identical copies already share one entry of the record cache
+// (see StaticProfileCache.h), whose key is the content of the function.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_STATICPROFILEDEDUP_H
+#define CASP_STATICPROFILEDEDUP_H
+
+#include "StaticProfileExporter.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+
+class Function;
+
+enum class DuplicatePolicy { Sum, KeepOne, Average };
+
+class StaticProfileDedup {
+  struct Entry {
+    std::string Name;
+    uint64_t Hash = 0;
+    /// The record of the first copy, whose counts are the sums of all.
+    InstrProfRecord Record;
+    unsigned Copies = 0;
+  };
+
+  DuplicatePolicy Policy;
+  std::mutex Mutex;
+  /// Index into Entries, keyed by the MD5 of the profile name and the hash.
+  DenseMap<std::pair<uint64_t, uint64_t>, size_t> EntryIndex;
+  std::vector<Entry> Entries;
+  unsigned Duplicates = 0;
+
+public:
+  explicit StaticProfileDedup(DuplicatePolicy Policy) : Policy(Policy) {}
+
+  DuplicatePolicy getPolicy() const { return Policy; }
+
+  /// Whether \p F may be defined by more than one module, i.e. the linker
+  /// keeps one of several definitions.
+  static bool mayBeDuplicated(const Function &F);
+
+  /// With KeepOne, whether the copy named \p Name with hash \p Hash is the
+  /// first one; later copies are counted as duplicates.
+  bool claim(StringRef Name, uint64_t Hash);
+
+  /// With KeepOne, give up the claim of a copy that got no record after all,
+  /// so that a copy claimed later takes its place.
+  void release(StringRef Name, uint64_t Hash);
+
+  /// With Average, add the counts of one copy. Copies whose number of
+  /// counters differs from the first one are reported and dropped.
+  void add(const NamedInstrProfRecord &Record);
+
+  /// With Average, hand the average of the copies of every function to
+  /// \p Sink, in the order they were first added.
+  void flush(StaticProfileRecordSink Sink);
+
+  /// Copies that did not get a record of their own.
+  unsigned getNumDuplicates() const { return Duplicates; }
+};
+
+} // namespace llvm
+
+#endif // CASP_STATICPROFILEDEDUP_H
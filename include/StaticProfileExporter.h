@@ -23,23 +23,384 @@
 #ifndef CASP_STATICPROFILEEXPORTER_H
 #define CASP_STATICPROFILEEXPORTER_H
 
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/ProfileData/InstrProf.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBufferRef.h"
+#include <algorithm>
+#include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 namespace llvm {
 
+class CoverageRecordIndex;
+class DynamicBaseProfile;
+class Function;
+class FunctionFilter;
+class HotnessRanking;
 class Module;
+class StaticFrequencyWriter;
+class StaticProfileDedup;
+class ThreadPoolInterface;
+class raw_ostream;
+struct CounterScratch;
 
-// Command-line option for Wu-Larus heuristics
+/// Compute branch probabilities with the Wu-Larus heuristics instead of
+/// BranchProbabilityInfo (see WuLarusBranchProbability.h). Read into
+/// StaticProfileExporterOptions::WuLarusHeuristics by the tool and the plugin.
 extern cl::opt<bool> UseWuLarusHeuristics;
 
+/// Tunables shared by the standalone tool and the plugin.
+struct StaticProfileExporterOptions {
+  /// Execution count of the entry block that block frequencies are scaled to.
+  /// The default keeps counts small and readable; larger values keep more
+  /// resolution for cold blocks, which round down to zero otherwise. Scaling
+  /// is exact and saturates instead of overflowing (see FrequencyScaler).
+  uint64_t EntryCount = 100;
+
+  /// Scale to the function's own entry count instead, when it has one
+  /// (function_entry_count metadata, e.g. from a sample profile or synthetic
+  /// entry counts).
+  bool UseFunctionEntryCount = false;
+
+  /// Derive every function's entry count from its callers instead (see
+  /// EntryCountPropagation.h); EntryCount then applies to the functions that
+  /// can be called from outside the module. This computes the block
+  /// frequencies of every function body once more up front, on Threads
+  /// threads; a lazily loaded module keeps its bodies unloaded if its bitcode
+  /// is given to exportStaticProfile. Profiles captured earlier in the
+  /// pipeline are not used in this mode.
+  bool PropagateEntryCounts = false;
+
+  /// Number of threads used to compute block frequencies. 1 keeps the work on
+  /// the calling thread; 0 uses every available hardware thread.
+  unsigned Threads = 1;
+
+  /// Thread pool to compute block frequencies on when Threads is not 1, for
+  /// clients that export many modules. Null starts a pool for every export.
+  ThreadPoolInterface *Pool = nullptr;
+
+  /// The export runs on a worker thread of a client that exports several
+  /// modules at once. Its phases are then not timed for -time-passes, since
+  /// timers must not run on several threads at once (see StaticProfilePhase);
+  /// the client times the work of each module on its own thread instead.
+  bool OnWorkerThread = false;
+
+  /// Index of the coverage and profile data records of the module, for
+  /// clients that need it themselves. Null builds one for the export.
+  const CoverageRecordIndex *Index = nullptr;
+
+  /// When nonzero, records are spilled to disk in chunks of this many records
+  /// while functions are analyzed, and the indexed profile is built from the
+  /// spill at the end (see StaticProfileWriter).
+  unsigned StreamChunkSize = 0;
+
+  /// Write each module's records to its own shard next to the output path
+  /// (see getStaticProfileShardPath) instead of the output path itself, for
+  /// exports that run concurrently on one output path, such as ThinLTO
+  /// backends.
+  bool ShardByModule = false;
+
+  /// Replace or insert the records of this export in the profile already at
+  /// the output path, keeping the records of every other function, instead of
+  /// overwriting it (see StaticProfileWriter).
+  bool UpdateProfile = false;
+
+  /// Directory of the on-disk cache of finished records (see
+  /// StaticProfileCache). Empty disables caching.
+  std::string CacheDir;
+
+  /// Only export functions that carry instrumentation records. Other
+  /// functions are dropped before their body is loaded or analyzed.
+  bool InstrumentedOnly = false;
+
+  /// Receives the per-block counts of every exported function that has one
+  /// counter per basic block, i.e. is not instrumented (see
+  /// StaticFrequencyFile.h). Null collects none.
+  StaticFrequencyWriter *Frequencies = nullptr;
+
+  /// Path StaticProfileExporterPass writes the per-block counts to, unless
+  /// Frequencies is set. Empty writes none.
+  std::string FrequencyFile;
+
+  /// Ranks every exported function by its counts (see HotnessRanking.h), in
+  /// the order the records are produced, which breaks ties. Null ranks none.
+  HotnessRanking *Hotness = nullptr;
+
+  /// Path StaticProfileExporterPass writes an lld --symbol-ordering-file to,
+  /// hottest functions first, unless Hotness is set. Empty writes none.
+  std::string SymbolOrderingFile;
+
+  /// Tracks the functions other exports into the same profile define as
+  /// well (see StaticProfileDedup.h). With DuplicatePolicy::KeepOne, copies
+  /// another export claimed first are dropped before they are analyzed. Null
+  /// exports every copy.
+  StaticProfileDedup *Dedup = nullptr;
+
+  /// Profile of real runs whose records are kept for the functions they
+  /// reached (see DynamicBaseProfile.h); only the other functions are
+  /// analyzed. Null analyzes every function.
+  std::shared_ptr<const DynamicBaseProfile> BaseProfile;
+
+  /// Only export the functions this filter accepts (see FunctionFilter.h).
+  /// Rejected functions are dropped before their body is loaded or analyzed.
+  /// Null exports every function.
+  std::shared_ptr<const FunctionFilter> Filter;
+
+  /// Derive block frequencies from the branch probabilities of the Wu-Larus
+  /// heuristics (see WuLarusBranchProbability.h) instead of the ones of
+  /// BranchProbabilityInfo. Block frequencies cached in the pipeline cannot
+  /// be reused then, since they come from BranchProbabilityInfo.
+  bool WuLarusHeuristics = false;
+
+  /// Correct the block frequencies of loops whose constant or maximum trip
+  /// count ScalarEvolution knows, instead of keeping the iterations branch
+  /// probabilities imply (see LoopTripCountRefinement.h). This computes
+  /// ScalarEvolution for every analyzed function.
+  bool RefineLoopTripCounts = false;
+
+  /// Number of the slowest functions to analyze that are recorded in
+  /// StaticProfileStats::SlowestFunctions (see printSlowestFunctions). 0
+  /// records none.
+  unsigned SlowestFunctions = 0;
+
+  /// Attribute the heap growth of the export to analyses and records (see
+  /// StaticProfileStats::AnalysisPeakBytes). Sampling the heap is cheap but
+  /// not free, and the figures are only meaningful with Threads set to 1.
+  bool StatsMemory = false;
+
+  /// Clear each function's analyses from the FunctionAnalysisManager once its
+  /// counts are taken, so they do not pile up over the module. Analyses of
+  /// function bodies loaded lazily by the export are always cleared.
+  bool ClearAnalyses = false;
+};
+
+/// Number of functions exported or skipped while generating a static profile.
+struct StaticProfileStats {
+  unsigned FunctionsProcessed = 0;
+  unsigned FunctionsSkipped = 0;
+  /// Functions rejected by StaticProfileExporterOptions::Filter.
+  unsigned FunctionsFiltered = 0;
+  /// Processed functions whose record was loaded from the cache.
+  unsigned CacheHits = 0;
+  /// Processed functions whose record was taken from
+  /// StaticProfileExporterOptions::BaseProfile.
+  unsigned FunctionsFromBaseProfile = 0;
+  /// Basic blocks of the functions whose block frequencies were computed.
+  uint64_t BlocksAnalyzed = 0;
+  /// Profiles StaticProfileExporterPass failed to write, e.g. because the
+  /// profile to update was malformed or could not be replaced.
+  unsigned WriteFailures = 0;
+
+  /// Seconds spent computing block frequencies, converting them to counts and
+  /// writing the indexed profile. The first two are summed over all threads,
+  /// so they can exceed the wall time of a parallel export.
+  double BFISeconds = 0;
+  double ConvertSeconds = 0;
+  double WriteSeconds = 0;
+
+  /// Time a function took to analyze, from computing its block frequencies
+  /// to converting them to counts.
+  struct FunctionTime {
+    double Seconds = 0;
+    unsigned Blocks = 0;
+    std::string Name;
+  };
+  /// At least the StaticProfileExporterOptions::SlowestFunctions slowest
+  /// functions, in no particular order.
+  std::vector<FunctionTime> SlowestFunctions;
+
+  /// With StaticProfileExporterOptions::StatsMemory, the heap in bytes taken
+  /// by the IR of the exported modules, as measured by the callers that load
+  /// them; the most heap the analyses of functions in flight held at once, on
+  /// top of the records; the heap analyses still held after the export; the
+  /// heap taken by the records handed to the sink, e.g. by the profile
+  /// writer; and the growth of the peak resident set size while the indexed
+  /// profile was built.
+  uint64_t IRBytes = 0;
+  uint64_t AnalysisPeakBytes = 0;
+  uint64_t AnalysisRetainedBytes = 0;
+  uint64_t RecordBytes = 0;
+  uint64_t WritePeakRSSGrowth = 0;
+
+  StaticProfileStats &operator+=(const StaticProfileStats &RHS) {
+    FunctionsProcessed += RHS.FunctionsProcessed;
+    FunctionsSkipped += RHS.FunctionsSkipped;
+    FunctionsFiltered += RHS.FunctionsFiltered;
+    CacheHits += RHS.CacheHits;
+    FunctionsFromBaseProfile += RHS.FunctionsFromBaseProfile;
+    BlocksAnalyzed += RHS.BlocksAnalyzed;
+    WriteFailures += RHS.WriteFailures;
+    BFISeconds += RHS.BFISeconds;
+    ConvertSeconds += RHS.ConvertSeconds;
+    WriteSeconds += RHS.WriteSeconds;
+    IRBytes += RHS.IRBytes;
+    AnalysisPeakBytes = std::max(AnalysisPeakBytes, RHS.AnalysisPeakBytes);
+    AnalysisRetainedBytes += RHS.AnalysisRetainedBytes;
+    RecordBytes += RHS.RecordBytes;
+    WritePeakRSSGrowth += RHS.WritePeakRSSGrowth;
+    SlowestFunctions.insert(SlowestFunctions.end(),
+                            RHS.SlowestFunctions.begin(),
+                            RHS.SlowestFunctions.end());
+    return *this;
+  }
+};
+
+/// Print the \p N slowest functions recorded in \p Stats to \p OS, slowest
+/// first.
+void printSlowestFunctions(raw_ostream &OS, const StaticProfileStats &Stats,
+                           unsigned N);
+
+/// Receives every static profile record together with the function it was
+/// computed for. The function is null for records captured earlier in the
+/// pipeline from functions that no longer exist (see StaticProfileCapture).
+/// The record's name is only valid for the duration of the call.
+using StaticProfileRecordSink =
+    function_ref<void(const Function *, NamedInstrProfRecord &&)>;
+
+/// A finished profile record that does not reference the IR it was computed
+/// from.
+struct StaticFunctionProfile {
+  std::string Name;
+  uint64_t Hash = 0;
+  std::vector<uint64_t> Counts;
+};
+
+/// Profiles captured by StaticProfileCapturePass while the pipeline still has
+/// block frequencies cached, and replayed by exportStaticProfile at the end.
+/// One instance is shared by the capture pass and the exporter pass.
+class StaticProfileCapture {
+  struct Entry {
+    StaticFunctionProfile Profile;
+    bool Exported = false;
+  };
+
+  const Module *IndexedModule = nullptr;
+  std::unique_ptr<CoverageRecordIndex> Index;
+  std::unique_ptr<CounterScratch> Scratch;
+  StringMap<size_t> EntryIndex;
+  std::vector<Entry> Entries;
+  unsigned ReusedBFI = 0;
+  unsigned ComputedBFI = 0;
+
+public:
+  StaticProfileCapture();
+  ~StaticProfileCapture();
+
+  /// Compute and record the profile of \p F, preferring the block frequencies
+  /// cached in \p FAM. A function captured more than once keeps the latest
+  /// profile. \p Opts must match the options of the exporter.
+  void capture(Function &F, FunctionAnalysisManager &FAM,
+               const StaticProfileExporterOptions &Opts);
+
+  /// Return the captured profile exported under \p Name and mark it exported,
+  /// or null if none was captured.
+  StaticFunctionProfile *take(StringRef Name);
+
+  /// Hand every captured profile that was not taken to \p Sink, in capture
+  /// order, and forget all captured state.
+  void flushRemaining(StaticProfileRecordSink Sink, StaticProfileStats &Stats);
+
+  bool empty() const { return Entries.empty(); }
+};
+
+/// Captures the static profile of every function it runs on. Scheduled at an
+/// extension point where block frequencies are usually still cached, it lets
+/// the exporter skip recomputing DomTree, LoopInfo, BPI and BFI at the end of
+/// the pipeline.
+class StaticProfileCapturePass
+    : public PassInfoMixin<StaticProfileCapturePass> {
+  std::shared_ptr<StaticProfileCapture> Capture;
+  StaticProfileExporterOptions Options;
+
+public:
+  StaticProfileCapturePass(std::shared_ptr<StaticProfileCapture> C,
+                           StaticProfileExporterOptions Opts)
+      : Capture(std::move(C)), Options(std::move(Opts)) {}
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+/// Compute the static profile of every defined function in \p M and hand the
+/// records to \p Sink in module order. Block frequencies are taken from \p FAM
+/// when one is given and computed directly otherwise, which lets callers
+/// process modules without setting up a pass pipeline. Functions found in
+/// \p Capture reuse the profile captured for them.
+///
+/// \p M may be lazily loaded, in which case each function body is only
+/// materialized while its record is computed and deleted afterwards. Passing
+/// the bitcode it was loaded from as \p SourceBitcode lets the worker threads
+/// load it as well instead of serializing \p M.
+StaticProfileStats
+exportStaticProfile(Module &M, FunctionAnalysisManager *FAM,
+                    const StaticProfileExporterOptions &Opts,
+                    StaticProfileRecordSink Sink,
+                    StaticProfileCapture *Capture = nullptr,
+                    std::optional<MemoryBufferRef> SourceBitcode = std::nullopt);
+
+/// Record the profile names of the local functions of \p M in metadata, so
+/// that exporting a module \p M is later linked into gives them the same
+/// names, and finds the same coverage records, as exporting \p M itself.
+/// Linking renames local functions that clash and gives the result the source
+/// file name of the first module. Works on lazily loaded modules.
+void preserveProfileNames(Module &M);
+
+/// Name of \p F in frontend instrumentation (getPGOFuncName), whose MD5 keys
+/// its coverage and profile data records, or in the profile
+/// (getIRPGOFuncName) if \p IR is set. Local functions of a linked module may
+/// have been renamed and belong to another source file than the module, so
+/// they keep the names of the module they came from.
+std::string getProfileName(const Function &F, bool IR = false);
+
+/// Counts of one function computed with one branch probability engine, and
+/// the time it took to compute the analyses they are derived from.
+struct BranchEngineResult {
+  double Seconds = 0;
+  /// Empty if no counts could be derived from the block frequencies.
+  std::vector<uint64_t> Counts;
+};
+
+/// The records of one function computed with BranchProbabilityInfo and with
+/// the Wu-Larus heuristics.
+struct BranchEngineComparison {
+  const Function *F = nullptr;
+  /// Name the record is exported under, and the frontend name the function
+  /// may be found under in older profiles.
+  std::string Name;
+  std::string PGOName;
+  uint64_t Hash = 0;
+  unsigned NumBlocks = 0;
+  BranchEngineResult Stock;
+  BranchEngineResult WuLarus;
+};
+
+/// Compute the record of every defined function in \p M with both branch
+/// probability engines and hand the results to \p Consume in module order.
+/// Each engine runs its analyses from scratch, without an analysis manager or
+/// cache, and is timed over a few runs, keeping the fastest. The engine and
+/// entry count propagation settings of \p Opts are ignored.
+void compareBranchProbabilityEngines(
+    Module &M, const StaticProfileExporterOptions &Opts,
+    function_ref<void(BranchEngineComparison &&)> Consume);
+
 class StaticProfileExporterPass : public PassInfoMixin<StaticProfileExporterPass> {
   std::string ProfilePath;
+  StaticProfileExporterOptions Options;
+  std::shared_ptr<StaticProfileCapture> Capture;
+  StaticProfileStats *StatsOut;
 
 public:
-  explicit StaticProfileExporterPass(std::string Path = "")
-      : ProfilePath(std::move(Path)) {}
+  /// The statistics of every run are added to \p StatsOut, if given.
+  explicit StaticProfileExporterPass(
+      std::string Path = "", StaticProfileExporterOptions Opts = {},
+      std::shared_ptr<StaticProfileCapture> Capture = nullptr,
+      StaticProfileStats *StatsOut = nullptr)
+      : ProfilePath(std::move(Path)), Options(Opts),
+        Capture(std::move(Capture)), StatsOut(StatsOut) {}
 
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
 };
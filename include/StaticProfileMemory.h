@@ -0,0 +1,40 @@
+//===- StaticProfileMemory.h - Memory use of a static profile --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the memory probes behind the memory statistics of a
+// static profile export (see StaticProfileExporterOptions::StatsMemory). Heap
+// usage comes from the allocator and is sampled at phase boundaries, so the
+// growth of one phase can be told apart from the next; the peak resident set
+// size shows which phase set the high-water mark of the process.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_STATICPROFILEMEMORY_H
+#define CASP_STATICPROFILEMEMORY_H
+
+#include <cstdint>
+#include <optional>
+
+namespace llvm {
+
+/// Bytes of heap currently allocated, as reported by malloc, or 0 if the
+/// allocator does not report it.
+uint64_t getHeapUsageBytes();
+
+/// Peak resident set size of the process in bytes, if the system reports it.
+std::optional<uint64_t> getPeakRSSBytes();
+
+/// Growth of getHeapUsageBytes() since \p Start, or 0 if it shrank.
+inline uint64_t getHeapGrowthBytes(uint64_t Start) {
+  uint64_t Now = getHeapUsageBytes();
+  return Now > Start ? Now - Start : 0;
+}
+
+} // namespace llvm
+
+#endif // CASP_STATICPROFILEMEMORY_H
@@ -0,0 +1,46 @@
+//===- StaticProfileTimer.h - Time phases of a static profile --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares StaticProfilePhase, which makes the phases of a static
+// profile export visible in -ftime-trace flame graphs and -time-passes
+// reports. Both are free when neither is enabled.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_STATICPROFILETIMER_H
+#define CASP_STATICPROFILETIMER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+
+namespace llvm {
+
+/// Times the enclosing scope as one phase of a static profile export. The
+/// phase shows up as a \p Name region, with \p Detail, in -ftime-trace output
+/// and, with -time-passes, as a timer of the "static-profile-export" group.
+///
+/// Trace regions are only recorded on threads that run the time trace
+/// profiler, and timers must not run on several threads at once, so phases
+/// on worker threads pass \p Timed = false.
+class StaticProfilePhase {
+  TimeTraceScope Trace;
+  NamedRegionTimer Timer;
+
+public:
+  StaticProfilePhase(StringRef Name, StringRef Description,
+                     StringRef Detail = "", bool Timed = true)
+      : Trace(Name, Detail),
+        Timer(Name, Description, "static-profile-export",
+              "Static Profile Export", Timed && TimePassesIsEnabled) {}
+};
+
+} // namespace llvm
+
+#endif // CASP_STATICPROFILETIMER_H
@@ -0,0 +1,125 @@
+//===- StaticProfileWriter.h - Output of static profiles -------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares StaticProfileWriter, the destination of the records of a
+// static profile export. By default records are accumulated in an
+// InstrProfWriter. In streaming mode they are appended to a spill file in
+// bounded-size chunks as functions complete, and only loaded into the writer
+// when the indexed profile is built, so the analysis holds at most one chunk
+// of records next to the IR. Building the indexed profile still needs every
+// record in memory, since its hash table and summary cover all of them, but
+// by then the IR and its analyses have been released; the peak is the larger
+// of the two rather than their sum. The spill uses the text profile format,
+// which llvm-profdata can read as well. It only holds counters; records with
+// value profiles or MC/DC bitmap bytes, which only come from a base profile,
+// are added to the InstrProfWriter directly.
+//
+// In update mode the records replace or join those of the profile already at
+// the output path, so exports of separate modules can accumulate in one
+// profile without a merge step.
+//
+// It also declares the helpers behind sharded exports, where several exports
+// that share one output path (such as ThinLTO backends) each write a partial
+// profile next to it and a later step merges them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_STATICPROFILEWRITER_H
+#define CASP_STATICPROFILEWRITER_H
+
+#include "StaticProfileExporter.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ProfileData/InstrProfWriter.h"
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace llvm {
+
+class raw_fd_ostream;
+
+class StaticProfileWriter {
+  std::string OutputPath;
+  InstrProfWriter Writer;
+
+  /// Number of records per chunk; 0 keeps every record in Writer.
+  unsigned ChunkSize;
+  /// Text of the records that have not been flushed to the spill yet.
+  std::string Chunk;
+  unsigned ChunkRecords = 0;
+  SmallString<128> SpillPath;
+  std::unique_ptr<raw_fd_ostream> Spill;
+  /// Set when the spill file cannot be created; records then stay in Chunk.
+  bool SpillFailed = false;
+
+  /// Whether to keep the records of the existing profile at OutputPath.
+  bool Update;
+  /// Names of the functions added so far, in update mode.
+  StringSet<> Names;
+
+  void flushChunk();
+  bool loadSpill(StaticProfileStats &Stats);
+  bool loadBaseProfile();
+  bool writeUpdate();
+
+public:
+  /// Create a writer for the indexed profile at \p OutputPath. A nonzero
+  /// \p ChunkSize enables streaming with chunks of that many records. With
+  /// \p Update, the profile at \p OutputPath, if any, keeps the records of
+  /// every function that is not added again.
+  explicit StaticProfileWriter(std::string OutputPath, unsigned ChunkSize = 0,
+                               bool Update = false);
+  ~StaticProfileWriter();
+
+  StaticProfileWriter(const StaticProfileWriter &) = delete;
+  StaticProfileWriter &operator=(const StaticProfileWriter &) = delete;
+
+  /// Add \p Record to the profile. A failure to merge the record is reported
+  /// and counted as a skipped function in \p Stats.
+  void addRecord(NamedInstrProfRecord &&Record, StaticProfileStats &Stats);
+
+  /// Build the indexed profile from every record added so far and write it to
+  /// the output path. Errors are reported on stderr. The time it takes is
+  /// added to Stats.WriteSeconds.
+  ///
+  /// In update mode, the existing profile is read through a memory mapping
+  /// and the new one replaces it atomically. Updates of the same path are
+  /// serialized with a lock file, "<OutputPath>.lock", so concurrent exports
+  /// do not lose each other's records.
+  bool write(StaticProfileStats &Stats);
+};
+
+/// Path of the partial profile of the module \p ModuleID in a sharded export
+/// to \p OutputPath. Shards are named "<OutputPath>.thinlto.<hash>", where the
+/// hash of the module identifier keeps archive members and other unusual
+/// identifiers out of the file name.
+std::string getStaticProfileShardPath(StringRef OutputPath,
+                                      StringRef ModuleID);
+
+/// Collect the shards of a sharded export to \p OutputPath, sorted by path.
+std::error_code findStaticProfileShards(StringRef OutputPath,
+                                        std::vector<std::string> &Shards);
+
+/// Add the records of every profile in \p Shards to \p Writer. A function
+/// exported by several shards, such as a linkonce_odr function emitted in
+/// more than one module, keeps one record rather than the sum of all of them.
+/// Shards are read from the most recently written one, so when the records
+/// of a function differ in hash, as when a stale shard of a module that has
+/// since changed is still around, the newest is kept and the others are
+/// reported. Errors are reported on stderr.
+bool mergeStaticProfileShards(ArrayRef<std::string> Shards,
+                              StaticProfileWriter &Writer,
+                              StaticProfileStats &Stats);
+
+} // namespace llvm
+
+#endif // CASP_STATICPROFILEWRITER_H
@@ -0,0 +1,39 @@
+//===- WuLarusBranchProbability.h - Wu-Larus branch heuristics -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares an alternative to the branch probabilities computed by
+// BranchProbabilityInfo::calculate, following Wu and Larus, "Static Branch
+// Frequency and Program Profile Analysis" (MICRO 1994). Every conditional
+// branch is predicted by the loop branch, loop exit, loop header, pointer,
+// opcode, guard, call, store and return heuristics of Ball and Larus, each
+// with the hit rate measured by Wu and Larus, and the predictions of all the
+// heuristics that apply are combined with Dempster-Shafer theory.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CASP_WULARUSBRANCHPROBABILITY_H
+#define CASP_WULARUSBRANCHPROBABILITY_H
+
+namespace llvm {
+
+class BranchProbabilityInfo;
+class Function;
+class LoopInfo;
+class PostDominatorTree;
+
+/// Set the probabilities of the conditional branches of \p F in \p BPI from
+/// the Wu-Larus heuristics. \p BPI should be freshly constructed; blocks that
+/// end in anything but a two-way conditional branch keep the uniform
+/// probabilities BranchProbabilityInfo assumes for unknown blocks.
+void computeWuLarusProbabilities(const Function &F, const LoopInfo &LI,
+                                 const PostDominatorTree &PDT,
+                                 BranchProbabilityInfo &BPI);
+
+} // namespace llvm
+
+#endif // CASP_WULARUSBRANCHPROBABILITY_H
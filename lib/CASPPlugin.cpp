@@ -11,10 +11,14 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "DynamicBaseProfile.h"
+#include "FunctionFilter.h"
+#include "HotnessRanking.h"
 #include "StaticProfileExporter.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
 
 using namespace llvm;
 
@@ -29,22 +33,301 @@ static cl::opt<bool> StaticProfileDump(
     cl::desc("Enable static profile dump"),
     cl::init(false));
 
+static cl::opt<unsigned> StaticProfileThreads(
+    "static-profile-threads",
+    cl::desc("Number of threads used to compute static profiles "
+             "(0 = all hardware threads)"),
+    cl::init(1));
+
+static cl::opt<unsigned> StaticProfileStreamChunkSize(
+    "static-profile-stream-chunk-size",
+    cl::desc("Spill static profile records to disk in chunks of N records "
+             "(0 = keep all records in memory)"),
+    cl::init(0));
+
+static cl::opt<std::string> StaticProfileCacheDir(
+    "static-profile-cache-dir",
+    cl::desc("Directory caching static profile records of unchanged "
+             "functions across builds"),
+    cl::value_desc("directory"), cl::init(""));
+
+static cl::opt<bool> StaticProfileUpdate(
+    "static-profile-update",
+    cl::desc("Replace or insert the records of each module in the existing "
+             "static profile instead of overwriting it"),
+    cl::init(false));
+
+static cl::opt<std::string> StaticProfileFrequencyFile(
+    "static-profile-frequency-file",
+    cl::desc("Also write the per-block counts of uninstrumented functions to "
+             "this static frequency file"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<std::string> StaticProfileBaseProfile(
+    "static-profile-base-profile",
+    cl::desc("Indexed profile of real runs whose records are kept for the "
+             "functions it reached; only the others get static counts"),
+    cl::value_desc("profdata"), cl::init(""));
+
+static cl::opt<std::string> StaticProfileSymbolOrderingFile(
+    "static-profile-symbol-ordering-file",
+    cl::desc("Also write the functions with a nonzero static count, hottest "
+             "first, as an lld --symbol-ordering-file"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<bool> StaticProfileInstrumentedOnly(
+    "static-profile-instrumented-only",
+    cl::desc("Only export functions with instrumentation records"),
+    cl::init(false));
+
+static cl::list<std::string> StaticProfileIncludeFiles(
+    "static-profile-include-file",
+    cl::desc("Only export functions defined in source files matching this "
+             "glob"),
+    cl::value_desc("glob"));
+
+static cl::list<std::string> StaticProfileExcludeFiles(
+    "static-profile-exclude-file",
+    cl::desc("Do not export functions defined in source files matching this "
+             "glob"),
+    cl::value_desc("glob"));
+
+static cl::list<std::string> StaticProfileIncludeFunctions(
+    "static-profile-include-function",
+    cl::desc("Only export functions whose name matches this regex"),
+    cl::value_desc("regex"));
+
+static cl::list<std::string> StaticProfileExcludeFunctions(
+    "static-profile-exclude-function",
+    cl::desc("Do not export functions whose name matches this regex"),
+    cl::value_desc("regex"));
+
+static cl::list<std::string> StaticProfileIncludeSections(
+    "static-profile-include-section",
+    cl::desc("Only export functions placed in this section"),
+    cl::value_desc("section"));
+
+static cl::list<std::string> StaticProfileExcludeSections(
+    "static-profile-exclude-section",
+    cl::desc("Do not export functions placed in this section"),
+    cl::value_desc("section"));
+
+static cl::opt<std::string> StaticProfileIncludeGUIDs(
+    "static-profile-include-guids",
+    cl::desc("Only export the functions whose GUIDs are listed in this file"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<std::string> StaticProfileExcludeGUIDs(
+    "static-profile-exclude-guids",
+    cl::desc("Do not export the functions whose GUIDs are listed in this "
+             "file"),
+    cl::value_desc("file"), cl::init(""));
+
+static cl::opt<unsigned> StaticProfileSamplePercent(
+    "static-profile-sample-percent",
+    cl::desc("Export a fixed, GUID-based sample of N percent of the "
+             "functions"),
+    cl::value_desc("N"), cl::init(100));
+
+static cl::opt<uint64_t> StaticProfileEntryCount(
+    "static-profile-entry-count",
+    cl::desc("Entry block count that block frequencies are scaled to"),
+    cl::init(StaticProfileExporterOptions().EntryCount));
+
+static cl::opt<bool> StaticProfileUseFunctionEntryCount(
+    "static-profile-use-function-entry-count",
+    cl::desc("Scale block frequencies to the function's entry count metadata "
+             "when present"),
+    cl::init(false));
+
+static cl::opt<bool> StaticProfilePropagateEntryCounts(
+    "static-profile-propagate-entry-counts",
+    cl::desc("Derive function entry counts from callers along the call graph "
+             "(disables -static-profile-capture-point)"),
+    cl::init(false));
+
+static cl::opt<unsigned> StaticProfileReportSlowest(
+    "static-profile-report-slowest",
+    cl::desc("Print the N functions that took longest to analyze for the "
+             "static profile"),
+    cl::init(0));
+
+static cl::opt<bool> StaticProfileRefineTripCounts(
+    "static-profile-refine-trip-counts",
+    cl::desc("Correct the block frequencies of loops with a constant or "
+             "maximum trip count known to ScalarEvolution"),
+    cl::init(false));
+
+static cl::opt<bool> StaticProfileClearAnalyses(
+    "static-profile-clear-analyses",
+    cl::desc("Clear each function's analyses once its static profile counts "
+             "are taken"),
+    cl::init(false));
+
+namespace {
+enum class CapturePoint { OptimizerLast, ScalarOptimizerLate, VectorizerStart };
+} // end anonymous namespace
+
+static cl::opt<CapturePoint> StaticProfileCapturePoint(
+    "static-profile-capture-point",
+    cl::desc("Where in the pipeline block frequencies are read for the "
+             "static profile"),
+    cl::values(
+        clEnumValN(CapturePoint::OptimizerLast, "optimizer-last",
+                   "Compute them at the end of the pipeline (default)"),
+        clEnumValN(CapturePoint::ScalarOptimizerLate, "scalar-optimizer-late",
+                   "Capture them after function simplification, while they "
+                   "are usually still cached"),
+        clEnumValN(CapturePoint::VectorizerStart, "vectorizer-start",
+                   "Capture them before vectorization, while they are "
+                   "usually still cached")),
+    cl::init(CapturePoint::OptimizerLast));
+
+/// Output path requested on the command line, or an empty string when static
+/// profile export is disabled.
+static std::string getOutputPath() {
+  std::string OutputPath = StaticProfileDumpPath;
+  if (OutputPath.empty() && StaticProfileDump)
+    OutputPath = "default.profdata";
+  return OutputPath;
+}
+
+/// Function filter requested on the command line. Invalid rules are reported
+/// and leave every function exported.
+static std::shared_ptr<const FunctionFilter> createFunctionFilter() {
+  FunctionFilterOptions FilterOpts;
+  FilterOpts.IncludeFiles.assign(StaticProfileIncludeFiles.begin(),
+                                 StaticProfileIncludeFiles.end());
+  FilterOpts.ExcludeFiles.assign(StaticProfileExcludeFiles.begin(),
+                                 StaticProfileExcludeFiles.end());
+  FilterOpts.IncludeFunctions.assign(StaticProfileIncludeFunctions.begin(),
+                                     StaticProfileIncludeFunctions.end());
+  FilterOpts.ExcludeFunctions.assign(StaticProfileExcludeFunctions.begin(),
+                                     StaticProfileExcludeFunctions.end());
+  FilterOpts.IncludeSections.assign(StaticProfileIncludeSections.begin(),
+                                    StaticProfileIncludeSections.end());
+  FilterOpts.ExcludeSections.assign(StaticProfileExcludeSections.begin(),
+                                    StaticProfileExcludeSections.end());
+  FilterOpts.IncludeGUIDFile = StaticProfileIncludeGUIDs;
+  FilterOpts.ExcludeGUIDFile = StaticProfileExcludeGUIDs;
+  FilterOpts.SamplePercent = StaticProfileSamplePercent;
+
+  auto FilterOrErr = FunctionFilter::create(FilterOpts);
+  if (!FilterOrErr) {
+    errs() << "Warning: Ignoring static profile function filters: "
+           << toString(FilterOrErr.takeError()) << "\n";
+    return nullptr;
+  }
+  return std::move(*FilterOrErr);
+}
+
+/// The base profile requested on the command line, or null if there is none
+/// or it cannot be read.
+static std::shared_ptr<const DynamicBaseProfile> loadBaseProfile() {
+  if (StaticProfileBaseProfile.empty())
+    return nullptr;
+  auto BaseOrErr = DynamicBaseProfile::create(StaticProfileBaseProfile);
+  if (!BaseOrErr) {
+    errs() << "Warning: Ignoring static profile base profile: "
+           << toString(BaseOrErr.takeError()) << "\n";
+    return nullptr;
+  }
+  return std::move(*BaseOrErr);
+}
+
+/// Exporter options requested on the command line.
+static StaticProfileExporterOptions getExporterOptions() {
+  // Built once, since GUID lists are read from disk.
+  static std::shared_ptr<const FunctionFilter> Filter = createFunctionFilter();
+  static std::shared_ptr<const DynamicBaseProfile> Base = loadBaseProfile();
+
+  StaticProfileExporterOptions Opts;
+  Opts.EntryCount = StaticProfileEntryCount;
+  Opts.UseFunctionEntryCount = StaticProfileUseFunctionEntryCount;
+  Opts.PropagateEntryCounts = StaticProfilePropagateEntryCounts;
+  Opts.Threads = StaticProfileThreads;
+  Opts.StreamChunkSize = StaticProfileStreamChunkSize;
+  Opts.CacheDir = StaticProfileCacheDir;
+  Opts.UpdateProfile = StaticProfileUpdate;
+  Opts.FrequencyFile = StaticProfileFrequencyFile;
+  Opts.SymbolOrderingFile = StaticProfileSymbolOrderingFile;
+  Opts.InstrumentedOnly = StaticProfileInstrumentedOnly;
+  Opts.WuLarusHeuristics = UseWuLarusHeuristics;
+  Opts.RefineLoopTripCounts = StaticProfileRefineTripCounts;
+  Opts.SlowestFunctions = StaticProfileReportSlowest;
+  Opts.ClearAnalyses = StaticProfileClearAnalyses;
+  Opts.Filter = Filter;
+  Opts.BaseProfile = Base;
+  // Static counts take the magnitude of the real ones.
+  if (Base && !StaticProfileEntryCount.getNumOccurrences() &&
+      Base->getEntryCount())
+    Opts.EntryCount = Base->getEntryCount();
+  return Opts;
+}
+
 static void registerCASPCallbacks(PassBuilder &PB) {
+  // Profiles captured at an earlier extension point are handed to the
+  // exporter through this object.
+  auto Capture = std::make_shared<StaticProfileCapture>();
+
+  auto AddCapturePass = [Capture](CapturePoint Point) {
+    return [Capture, Point](FunctionPassManager &FPM, OptimizationLevel) {
+      if (StaticProfileCapturePoint == Point &&
+          !StaticProfilePropagateEntryCounts && !getOutputPath().empty())
+        FPM.addPass(StaticProfileCapturePass(Capture, getExporterOptions()));
+    };
+  };
+  PB.registerScalarOptimizerLateEPCallback(
+      AddCapturePass(CapturePoint::ScalarOptimizerLate));
+  PB.registerVectorizerStartEPCallback(
+      AddCapturePass(CapturePoint::VectorizerStart));
+
+  auto AddExporter = [Capture](ModulePassManager &MPM, bool ShardByModule) {
+    std::string OutputPath = getOutputPath();
+
+    // We only add the pass if we have an output path
+    if (!OutputPath.empty()) {
+      StaticProfileExporterOptions Opts = getExporterOptions();
+      Opts.ShardByModule = ShardByModule;
+      MPM.addPass(StaticProfileExporterPass(
+          OutputPath, Opts,
+          StaticProfileCapturePoint == CapturePoint::OptimizerLast ? nullptr
+                                                                   : Capture));
+    }
+  };
+
   // Register the pass as an optimizer-last callback
   PB.registerOptimizerLastEPCallback(
-      [](ModulePassManager &MPM, OptimizationLevel Level, 
-         ThinOrFullLTOPhase Phase) {
-        // Determine the output path
-        std::string OutputPath = StaticProfileDumpPath;
-        if (OutputPath.empty() && StaticProfileDump) {
-          OutputPath = "default.profdata";
-        }
-        
-        // We only add the pass if we have an output path
-        if (!OutputPath.empty()) {
-          MPM.addPass(StaticProfileExporterPass(OutputPath));
+      [AddExporter](ModulePassManager &MPM, OptimizationLevel Level,
+                    ThinOrFullLTOPhase Phase) {
+        switch (Phase) {
+        case ThinOrFullLTOPhase::ThinLTOPreLink:
+        case ThinOrFullLTOPhase::FullLTOPreLink:
+        case ThinOrFullLTOPhase::FullLTOPostLink:
+          // Pre-link modules are optimized again after linking, and the full
+          // LTO module is exported from the callback below.
+          return;
+        case ThinOrFullLTOPhase::ThinLTOPostLink:
+          // Every ThinLTO backend sees the same output path; each writes its
+          // own shard, and llvm-sprofgen --merge-shards combines them.
+          AddExporter(MPM, /*ShardByModule=*/true);
+          return;
+        case ThinOrFullLTOPhase::None:
+          AddExporter(MPM, /*ShardByModule=*/false);
+          return;
         }
       });
+
+  // Lets other plugin passes query the static hotness of the module.
+  PB.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &MAM) {
+    MAM.registerPass([] { return StaticHotnessAnalysis(getExporterOptions()); });
+  });
+
+  // The full LTO post-link pipeline does not run optimizer-last callbacks.
+  PB.registerFullLinkTimeOptimizationLastEPCallback(
+      [AddExporter](ModulePassManager &MPM, OptimizationLevel Level) {
+        AddExporter(MPM, /*ShardByModule=*/false);
+      });
 }
 
 // Plugin registration
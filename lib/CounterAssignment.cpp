@@ -0,0 +1,221 @@
+//===- CounterAssignment.cpp - Map BFI counts onto counters ---------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the counter assignment engine for instrumented IR.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CounterAssignment.h"
+#include "CoverageRecordIndex.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/ProfileData/Coverage/CoverageMapping.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/Support/Debug.h"
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+using namespace llvm::coverage;
+
+/// Return the index of the counter \p Ptr points to, if it is an element of
+/// the counter array named \p CountersName.
+static std::optional<unsigned> getCounterIndex(const Value *Ptr,
+                                               StringRef CountersName,
+                                               const DataLayout &DL) {
+  APInt Offset(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
+  const Value *Base = Ptr->stripAndAccumulateConstantOffsets(
+      DL, Offset, /*AllowNonInbounds=*/true);
+  const auto *GV = dyn_cast<GlobalVariable>(Base);
+  if (!GV || GV->getName() != CountersName)
+    return std::nullopt;
+
+  const auto *ArrTy = dyn_cast<ArrayType>(GV->getValueType());
+  if (!ArrTy)
+    return std::nullopt;
+  uint64_t ElemSize = DL.getTypeAllocSize(ArrTy->getElementType());
+  if (ElemSize == 0 || Offset.isNegative() ||
+      Offset.getZExtValue() % ElemSize != 0)
+    return std::nullopt;
+  return Offset.getZExtValue() / ElemSize;
+}
+
+/// Follow the value added to a counter back to the block of the original
+/// increment. Counter promotion accumulates increments inside a loop in a
+/// register (phi + add of the step) and adds the total to the counter once at
+/// the loop exits, so the block of the final store is not the one whose
+/// frequency the counter measures.
+static const BasicBlock *findPromotedIncrementBlock(const Value *Step) {
+  SmallVector<const Value *, 8> Worklist{Step};
+  SmallPtrSet<const Value *, 8> Visited;
+  while (!Worklist.empty()) {
+    const Value *V = Worklist.pop_back_val();
+    if (!Visited.insert(V).second)
+      continue;
+
+    if (const auto *Phi = dyn_cast<PHINode>(V)) {
+      for (const Value *Incoming : Phi->incoming_values())
+        Worklist.push_back(Incoming);
+      continue;
+    }
+
+    const auto *Add = dyn_cast<BinaryOperator>(V);
+    if (!Add || Add->getOpcode() != Instruction::Add)
+      continue;
+    if (isa<ConstantInt>(Add->getOperand(1)))
+      return Add->getParent();
+    Worklist.push_back(Add->getOperand(0));
+    Worklist.push_back(Add->getOperand(1));
+  }
+  return nullptr;
+}
+
+/// Return the block whose execution \p Update (the value stored to, or added
+/// to, a counter) measures, defaulting to \p Fallback.
+static const BasicBlock *getIncrementBlock(const Value *Update,
+                                           const BasicBlock *Fallback) {
+  // store (add (load counter), step), counter
+  if (const auto *Add = dyn_cast<BinaryOperator>(Update)) {
+    if (Add->getOpcode() != Instruction::Add)
+      return Fallback;
+    Update = isa<LoadInst>(Add->getOperand(0)) ? Add->getOperand(1)
+                                               : Add->getOperand(0);
+  }
+  if (isa<Constant>(Update))
+    return Fallback;
+  if (const BasicBlock *Origin = findPromotedIncrementBlock(Update))
+    return Origin;
+  return Fallback;
+}
+
+/// Collect the blocks that increment the counters of the function.
+static void collectCounterSites(const Function &F, StringRef PGOName,
+                                StringRef CountersName,
+                                SmallVectorImpl<CounterSite> &Sites) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  for (const BasicBlock &BB : F) {
+    for (const Instruction &I : BB) {
+      // Unlowered instrumentation.
+      if (const auto *Inc = dyn_cast<InstrProfCntrInstBase>(&I)) {
+        if (isa<InstrProfTimestampInst>(Inc) ||
+            getPGOFuncNameVarInitializer(Inc->getName()) != PGOName)
+          continue;
+        Sites.push_back({static_cast<unsigned>(Inc->getIndex()->getZExtValue()),
+                         &BB});
+        continue;
+      }
+
+      if (CountersName.empty())
+        continue;
+
+      // Lowered increments: a load/add/store sequence, an atomic add, or a
+      // plain store for single byte coverage counters.
+      const Value *Ptr = nullptr;
+      const Value *Update = nullptr;
+      if (const auto *SI = dyn_cast<StoreInst>(&I)) {
+        Ptr = SI->getPointerOperand();
+        Update = SI->getValueOperand();
+      } else if (const auto *RMW = dyn_cast<AtomicRMWInst>(&I)) {
+        if (RMW->getOperation() != AtomicRMWInst::Add)
+          continue;
+        Ptr = RMW->getPointerOperand();
+        Update = RMW->getValOperand();
+      } else {
+        continue;
+      }
+
+      if (std::optional<unsigned> Index =
+              getCounterIndex(Ptr, CountersName, DL))
+        Sites.push_back({*Index, getIncrementBlock(Update, &BB)});
+    }
+  }
+}
+
+/// Keep every "LHS - RHS" expression of the coverage mapping non-negative by
+/// capping the subtracted counter. Independently scaled block counts can break
+/// the invariant by rounding, and llvm-cov would show the region as executed
+/// an enormous number of times.
+static void clampSubtractExpressions(ArrayRef<CounterExpression> Expressions,
+                                     std::vector<uint64_t> &Counts) {
+  CounterMappingContext Ctx(Expressions, Counts);
+  for (const CounterExpression &E : Expressions) {
+    if (E.Kind != CounterExpression::Subtract ||
+        E.RHS.getKind() != Counter::CounterValueReference ||
+        E.RHS.getCounterID() >= Counts.size())
+      continue;
+
+    Expected<int64_t> LHS = Ctx.evaluate(E.LHS);
+    if (!LHS) {
+      consumeError(LHS.takeError());
+      continue;
+    }
+    uint64_t Limit = std::max<int64_t>(*LHS, 0);
+    uint64_t &RHS = Counts[E.RHS.getCounterID()];
+    if (RHS > Limit) {
+      LLVM_DEBUG(dbgs() << "  Clamping counter " << E.RHS.getCounterID()
+                        << " from " << RHS << " to " << Limit << "\n");
+      RHS = Limit;
+    }
+  }
+}
+
+bool llvm::assignInstrumentationCounters(
+    const Function &F, StringRef PGOName,
+    const InstrumentedFunctionRecord &Instr, const CoverageRecordIndex &Index,
+    function_ref<uint64_t(const BasicBlock &)> BlockCount,
+    CounterScratch &Scratch, std::vector<uint64_t> &Counts) {
+  Counts.clear();
+  if (!Instr.NumCounters)
+    return false;
+
+  SmallVectorImpl<CounterSite> &Sites = Scratch.Sites;
+  Sites.clear();
+  collectCounterSites(F, PGOName, Instr.CountersName, Sites);
+
+  // Promoted counters are stored at every loop exit; count each original
+  // increment block only once.
+  llvm::sort(Sites, [](const CounterSite &A, const CounterSite &B) {
+    return A.Index != B.Index ? A.Index < B.Index
+                              : std::less<const BasicBlock *>()(A.BB, B.BB);
+  });
+  Sites.erase(std::unique(Sites.begin(), Sites.end()), Sites.end());
+
+  if (Sites.empty())
+    return false;
+
+  Counts.assign(*Instr.NumCounters, 0);
+  for (const CounterSite &Site : Sites) {
+    if (Site.Index >= Counts.size())
+      continue;
+    Counts[Site.Index] += BlockCount(*Site.BB);
+  }
+
+  if (Error Err = Index.readMapping(Instr, Scratch.Expressions,
+                                   Scratch.Regions, &Scratch.Filenames)) {
+    LLVM_DEBUG(dbgs() << "No coverage mapping for " << F.getName() << ": "
+                      << toString(std::move(Err)) << "\n");
+    consumeError(std::move(Err));
+  } else {
+    clampSubtractExpressions(Scratch.Expressions, Counts);
+  }
+
+  LLVM_DEBUG({
+    dbgs() << "Counter assignment for " << F.getName() << " (" << Sites.size()
+           << " increment sites):\n";
+    for (unsigned i = 0; i < Counts.size(); ++i)
+      dbgs() << "  Counter[" << i << "] = " << Counts[i] << "\n";
+  });
+  return true;
+}
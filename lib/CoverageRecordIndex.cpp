@@ -0,0 +1,156 @@
+//===- CoverageRecordIndex.cpp - Index of instrumentation records ---------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the module-wide index of coverage records and profile
+// data records.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CoverageRecordIndex.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+#include "llvm/ProfileData/Coverage/CoverageMapping.h"
+#include "llvm/ProfileData/Coverage/CoverageMappingReader.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/Support/Debug.h"
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+
+using namespace llvm::coverage;
+
+using RecordMap = DenseMap<uint64_t, InstrumentedFunctionRecord>;
+using FilenamesMap = DenseMap<uint64_t, std::vector<std::string>>;
+
+/// Return the integer operand \p Idx of \p CS, if it is a constant integer.
+static std::optional<uint64_t> getIntOperand(const ConstantStruct &CS,
+                                             unsigned Idx) {
+  if (Idx >= CS.getNumOperands())
+    return std::nullopt;
+  if (const auto *CI = dyn_cast<ConstantInt>(CS.getOperand(Idx)))
+    return CI->getZExtValue();
+  return std::nullopt;
+}
+
+/// Decode a coverage record.
+/// Structure: { name_hash (i64), data_size (i32), struct_hash (i64),
+///              filenames_ref (i64), [data_size x i8] mapping_data }
+static void decodeCoverageRecord(const ConstantStruct &CS, RecordMap &Records) {
+  std::optional<uint64_t> NameHash = getIntOperand(CS, 0);
+  std::optional<uint64_t> StructHash = getIntOperand(CS, 2);
+  if (!NameHash || !StructHash)
+    return;
+
+  InstrumentedFunctionRecord &Record = Records[*NameHash];
+  Record.StructHash = *StructHash;
+  Record.FilenamesRef = getIntOperand(CS, 3).value_or(0);
+  if (CS.getNumOperands() > 4)
+    if (const auto *Data = dyn_cast<ConstantDataSequential>(CS.getOperand(4)))
+      Record.MappingData = Data->getRawDataValues();
+}
+
+/// Return the counter array referenced by \p C. The counter pointer of a
+/// profile data record is either the array itself or, for relative pointers,
+/// an expression such as sub(ptrtoint(@__profc_), ptrtoint(@__profd_)).
+static const GlobalVariable *findCounterArray(const Constant *C) {
+  if (const auto *GV = dyn_cast<GlobalVariable>(C))
+    return GV->getName().starts_with("__profc_") ? GV : nullptr;
+  if (const auto *CE = dyn_cast<ConstantExpr>(C))
+    for (const Use &Op : CE->operands())
+      if (const GlobalVariable *GV = findCounterArray(cast<Constant>(Op)))
+        return GV;
+  return nullptr;
+}
+
+/// Decode a profile data record.
+/// Structure: { name_hash (i64), cfg_hash (i64), counter_ptr, bitmap_ptr,
+///              function_ptr, values (ptr), num_counters (i32), ... }
+static void decodeProfileDataRecord(const ConstantStruct &CS,
+                                    RecordMap &Records) {
+  std::optional<uint64_t> NameHash = getIntOperand(CS, 0);
+  // num_counters is the 7th field (index 6) in the __profd_ struct
+  std::optional<uint64_t> NumCounters = getIntOperand(CS, 6);
+  if (!NameHash || !NumCounters)
+    return;
+
+  InstrumentedFunctionRecord &Record = Records[*NameHash];
+  Record.NumCounters = *NumCounters;
+  if (CS.getNumOperands() > 2)
+    if (const GlobalVariable *Counters = findCounterArray(CS.getOperand(2)))
+      Record.CountersName = Counters->getName();
+}
+
+/// Decode the filenames table of a translation unit.
+/// Structure: { { i32 0, i32 filenames_size, i32 0, i32 version },
+///              [filenames_size x i8] filenames }
+static void decodeFilenames(const ConstantStruct &CS, FilenamesMap &Filenames) {
+  if (CS.getNumOperands() < 2)
+    return;
+  const auto *Header = dyn_cast<ConstantStruct>(CS.getOperand(0));
+  const auto *Blob = dyn_cast<ConstantDataSequential>(CS.getOperand(1));
+  if (!Header || !Blob)
+    return;
+  std::optional<uint64_t> Version = getIntOperand(*Header, 3);
+  if (!Version)
+    return;
+
+  StringRef Data = Blob->getRawDataValues();
+  std::vector<std::string> Names;
+  RawCoverageFilenamesReader Reader(Data, Names);
+  if (Error Err = Reader.read(static_cast<CovMapVersion>(*Version))) {
+    LLVM_DEBUG(dbgs() << "Cannot decode coverage filenames: "
+                      << toString(std::move(Err)) << "\n");
+    consumeError(std::move(Err));
+    return;
+  }
+  Filenames[IndexedInstrProf::ComputeHash(Data)] = std::move(Names);
+}
+
+CoverageRecordIndex::CoverageRecordIndex(const Module &M) {
+  for (const GlobalVariable &GV : M.globals()) {
+    if (!GV.hasInitializer())
+      continue;
+    const auto *CS = dyn_cast<ConstantStruct>(GV.getInitializer());
+    if (!CS)
+      continue;
+
+    StringRef Name = GV.getName();
+    if (Name.starts_with("__covrec_"))
+      decodeCoverageRecord(*CS, Records);
+    else if (Name.starts_with("__profd_"))
+      decodeProfileDataRecord(*CS, Records);
+    else if (Name.starts_with("__llvm_coverage_mapping"))
+      decodeFilenames(*CS, Filenames);
+  }
+
+  LLVM_DEBUG(dbgs() << "Indexed instrumentation records for " << Records.size()
+                    << " function(s)\n");
+}
+
+Error CoverageRecordIndex::readMapping(
+    const InstrumentedFunctionRecord &Record,
+    std::vector<CounterExpression> &Expressions,
+    std::vector<CounterMappingRegion> &Regions,
+    std::vector<StringRef> *FunctionFilenames) const {
+  if (Record.MappingData.empty())
+    return createStringError(inconvertibleErrorCode(),
+                             "function has no coverage mapping data");
+
+  ArrayRef<std::string> TUFilenames = getFilenames(Record.FilenamesRef);
+  std::vector<StringRef> LocalFilenames;
+  if (!FunctionFilenames)
+    FunctionFilenames = &LocalFilenames;
+  FunctionFilenames->clear();
+  Expressions.clear();
+  Regions.clear();
+  RawCoverageMappingReader Reader(Record.MappingData, TUFilenames,
+                                  *FunctionFilenames, Expressions, Regions);
+  return Reader.read();
+}
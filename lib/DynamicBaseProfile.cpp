@@ -0,0 +1,74 @@
+//===- DynamicBaseProfile.cpp - Runtime profile under a static one --------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the runtime profiles static profiles build on.
+//
+//===----------------------------------------------------------------------===//
+
+#include "DynamicBaseProfile.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+DynamicBaseProfile::~DynamicBaseProfile() = default;
+
+Expected<std::shared_ptr<const DynamicBaseProfile>>
+DynamicBaseProfile::create(StringRef Path) {
+  auto FS = vfs::getRealFileSystem();
+  auto ReaderOrErr = IndexedInstrProfReader::create(Path, *FS);
+  if (!ReaderOrErr)
+    return createStringError(inconvertibleErrorCode(),
+                             "cannot read base profile '" + Path + "': " +
+                                 toString(ReaderOrErr.takeError()));
+
+  std::shared_ptr<DynamicBaseProfile> Base(new DynamicBaseProfile());
+  Base->Reader = std::move(*ReaderOrErr);
+  if (Base->Reader->isIRLevelProfile())
+    errs() << "Warning: Base profile '" << Path
+           << "' is an IR-level profile; its records do not match the hashes "
+              "of static records and are not reused\n";
+
+  // One pass over the records to find their magnitude; lookups go through
+  // the on-disk hash table afterwards.
+  std::vector<uint64_t> EntryCounts;
+  for (const NamedInstrProfRecord &Record : *Base->Reader)
+    if (!Record.Counts.empty() && Record.Counts.front())
+      EntryCounts.push_back(Record.Counts.front());
+  if (Base->Reader->hasError())
+    return createStringError(inconvertibleErrorCode(),
+                             "malformed base profile '" + Path + "': " +
+                                 toString(Base->Reader->getError()));
+
+  if (!EntryCounts.empty()) {
+    auto Median = EntryCounts.begin() + EntryCounts.size() / 2;
+    std::nth_element(EntryCounts.begin(), Median, EntryCounts.end());
+    Base->EntryCount = *Median;
+  }
+  return Base;
+}
+
+std::optional<InstrProfRecord>
+DynamicBaseProfile::lookup(StringRef Name, StringRef AltName,
+                           uint64_t Hash) const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Expected<InstrProfRecord> RecordOrErr =
+      Reader->getInstrProfRecord(Name, Hash, AltName);
+  if (!RecordOrErr) {
+    // Missing functions and hash mismatches alike get static counts.
+    consumeError(RecordOrErr.takeError());
+    return std::nullopt;
+  }
+  if (none_of(RecordOrErr->Counts, [](uint64_t Count) { return Count; }))
+    return std::nullopt;
+  return std::move(*RecordOrErr);
+}
@@ -0,0 +1,228 @@
+//===- EntryCountPropagation.cpp - Interprocedural entry counts -----------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the propagation of entry counts along direct calls.
+//
+//===----------------------------------------------------------------------===//
+
+#include "EntryCountPropagation.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/GraphTraits.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ScaledNumber.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+
+using Scaled64 = ScaledNumber<uint64_t>;
+
+/// Weight of a recursive contribution in every round, which keeps recursive
+/// SCCs from inflating their own counts without bound.
+static const Scaled64 RecursionDamping(1, -1);
+
+/// Rounds spent on the recursive contributions of one SCC.
+static constexpr unsigned MaxRecursionRounds = 8;
+
+namespace {
+
+/// A function in the direct call graph. Its callees and the weights of the
+/// calls are ranges of the arrays of the graph.
+struct CallNode {
+  unsigned Id;
+  const CallNode *const *CalleesBegin = nullptr;
+  const CallNode *const *CalleesEnd = nullptr;
+  const Scaled64 *Weights = nullptr;
+};
+
+/// Direct calls between the functions of a module. The last node is a root
+/// that calls every function, so that one SCC walk reaches all of them.
+struct DirectCallGraph {
+  std::vector<CallNode> Nodes;
+  std::vector<const CallNode *> Callees;
+  std::vector<Scaled64> Weights;
+
+  const CallNode *getRoot() const { return &Nodes.back(); }
+};
+
+} // end anonymous namespace
+
+namespace llvm {
+template <> struct GraphTraits<const DirectCallGraph *> {
+  using NodeRef = const CallNode *;
+  using ChildIteratorType = const CallNode *const *;
+
+  static NodeRef getEntryNode(const DirectCallGraph *G) { return G->getRoot(); }
+  static ChildIteratorType child_begin(NodeRef N) { return N->CalleesBegin; }
+  static ChildIteratorType child_end(NodeRef N) { return N->CalleesEnd; }
+};
+} // namespace llvm
+
+void llvm::collectFunctionCalls(const Function &F,
+                                const BlockFrequencyInfo &BFI,
+                                const DenseMap<const Function *, unsigned> &Ids,
+                                FunctionCalls &Calls) {
+  Calls.Calls.clear();
+  Calls.AddressesTaken.clear();
+  uint64_t EntryFreq = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+  for (const BasicBlock &BB : F) {
+    uint64_t Freq = EntryFreq ? BFI.getBlockFreq(&BB).getFrequency() : 0;
+    for (const Instruction &Inst : BB) {
+      const auto *CB = dyn_cast<CallBase>(&Inst);
+      // The same uses Function::hasAddressTaken counts, for the bodies that
+      // are not loaded when the graph is built.
+      for (const Use &U : Inst.operands()) {
+        const auto *Callee = dyn_cast<Function>(U.get());
+        if (!Callee || (CB && CB->isCallee(&U) &&
+                        CB->getFunctionType() == Callee->getFunctionType()))
+          continue;
+        auto It = Ids.find(Callee);
+        if (It != Ids.end())
+          Calls.AddressesTaken.push_back(It->second);
+      }
+
+      if (!CB || !CB->getCalledFunction() || !Freq)
+        continue;
+      auto It = Ids.find(CB->getCalledFunction());
+      if (It == Ids.end())
+        continue;
+      Calls.Calls.emplace_back(It->second, Scaled64::get(Freq) /
+                                               Scaled64::get(EntryFreq));
+    }
+  }
+}
+
+/// Build the direct call graph of \p Defined from the calls \p Calls of each
+/// of its functions.
+static void buildCallGraph(ArrayRef<Function *> Defined,
+                           ArrayRef<FunctionCalls> Calls, DirectCallGraph &G) {
+  const unsigned N = Defined.size();
+
+  // Nodes must not move once edges point at them.
+  G.Nodes.resize(N + 1);
+  std::vector<std::pair<size_t, size_t>> Ranges(N + 1);
+  for (unsigned I = 0; I != N; ++I) {
+    G.Nodes[I].Id = I;
+    Ranges[I].first = G.Callees.size();
+    for (const auto &[Callee, Weight] : Calls[I].Calls) {
+      G.Callees.push_back(&G.Nodes[Callee]);
+      G.Weights.push_back(Weight);
+    }
+    Ranges[I].second = G.Callees.size();
+  }
+
+  G.Nodes[N].Id = N;
+  Ranges[N].first = G.Callees.size();
+  for (unsigned I = 0; I != N; ++I)
+    G.Callees.push_back(&G.Nodes[I]);
+  Ranges[N].second = G.Callees.size();
+
+  for (unsigned I = 0; I <= N; ++I) {
+    G.Nodes[I].CalleesBegin = G.Callees.data() + Ranges[I].first;
+    G.Nodes[I].CalleesEnd = G.Callees.data() + Ranges[I].second;
+    G.Nodes[I].Weights = G.Weights.data() + Ranges[I].first;
+  }
+}
+
+void llvm::propagateEntryCounts(ArrayRef<Function *> Defined,
+                                ArrayRef<FunctionCalls> Calls,
+                                uint64_t RootEntryCount,
+                                std::vector<uint64_t> &EntryCounts) {
+  assert(Calls.size() == Defined.size() && "calls of every function expected");
+  const unsigned N = Defined.size();
+  DirectCallGraph G;
+  buildCallGraph(Defined, Calls, G);
+
+  // Uses in bodies that are not loaded are only known from Calls.
+  std::vector<bool> AddressTaken(N);
+  for (const FunctionCalls &C : Calls)
+    for (unsigned Id : C.AddressesTaken)
+      AddressTaken[Id] = true;
+
+  std::vector<Scaled64> Counts(N);
+  for (unsigned I = 0; I != N; ++I) {
+    const Function &F = *Defined[I];
+    if (!F.hasLocalLinkage() || AddressTaken[I] || F.hasAddressTaken())
+      Counts[I] = Scaled64::get(RootEntryCount);
+  }
+
+  // scc_iterator visits callees before callers; the root comes last.
+  std::vector<std::pair<std::vector<const CallNode *>, bool>> SCCs;
+  const DirectCallGraph *CG = &G;
+  for (auto It = scc_begin(CG); !It.isAtEnd(); ++It)
+    if ((*It).front() != G.getRoot())
+      SCCs.emplace_back(*It, It.hasCycle());
+
+  // Everything an SCC receives from outside is final once its callers are
+  // done, so a single pass in reverse order settles every acyclic edge.
+  constexpr unsigned NoSCC = ~0U;
+  std::vector<unsigned> SCCOf(N, NoSCC);
+  std::vector<unsigned> LocalIndex(N);
+  std::vector<Scaled64> Base, Add;
+  unsigned Recursive = 0;
+  for (size_t Tag = SCCs.size(); Tag-- != 0;) {
+    const auto &[Members, HasCycle] = SCCs[Tag];
+    for (unsigned K = 0, E = Members.size(); K != E; ++K) {
+      SCCOf[Members[K]->Id] = Tag;
+      LocalIndex[Members[K]->Id] = K;
+    }
+
+    if (HasCycle) {
+      ++Recursive;
+      Base.resize(Members.size());
+      for (unsigned K = 0, E = Members.size(); K != E; ++K)
+        Base[K] = Counts[Members[K]->Id];
+
+      for (unsigned Round = 0; Round != MaxRecursionRounds; ++Round) {
+        Add.assign(Members.size(), Scaled64());
+        for (const CallNode *Caller : Members)
+          for (const CallNode *const *C = Caller->CalleesBegin;
+               C != Caller->CalleesEnd; ++C)
+            if (SCCOf[(*C)->Id] == Tag)
+              Add[LocalIndex[(*C)->Id]] +=
+                  Counts[Caller->Id] * Caller->Weights[C - Caller->CalleesBegin];
+
+        bool Changed = false;
+        for (unsigned K = 0, E = Members.size(); K != E; ++K) {
+          Scaled64 Next = Base[K] + Add[K] * RecursionDamping;
+          Scaled64 &Count = Counts[Members[K]->Id];
+          Changed |= Next.toInt<uint64_t>() != Count.toInt<uint64_t>();
+          Count = Next;
+        }
+        if (!Changed)
+          break;
+      }
+    }
+
+    for (const CallNode *Caller : Members)
+      for (const CallNode *const *C = Caller->CalleesBegin;
+           C != Caller->CalleesEnd; ++C)
+        if (SCCOf[(*C)->Id] != Tag)
+          Counts[(*C)->Id] +=
+              Counts[Caller->Id] * Caller->Weights[C - Caller->CalleesBegin];
+  }
+
+  // A function that is reached at all keeps an entry count of at least one,
+  // so rounding does not turn it into dead code.
+  EntryCounts.resize(N);
+  for (unsigned I = 0; I != N; ++I)
+    EntryCounts[I] = Counts[I].isZero()
+                         ? 0
+                         : std::max<uint64_t>(1, Counts[I].toInt<uint64_t>());
+
+  LLVM_DEBUG(dbgs() << "Propagated entry counts over " << N << " function(s), "
+                    << G.Weights.size() << " call edge(s), " << SCCs.size()
+                    << " SCC(s), " << Recursive << " recursive\n");
+}
@@ -0,0 +1,163 @@
+//===- FrequencyScaler.cpp - Scale block frequencies to counts ------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the per-function setup of FrequencyScaler and the
+// kernels that scale the frequencies of a whole function.
+//
+//===----------------------------------------------------------------------===//
+
+#include "FrequencyScaler.h"
+#include <cassert>
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__GNUC__) || defined(__clang__))
+#define CASP_SCALE_AVX2 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define CASP_SCALE_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace llvm;
+
+FrequencyScaler::FrequencyScaler(uint64_t EntryCount, uint64_t EntryFreq)
+    : EntryCount(EntryCount), EntryFreq(EntryFreq) {
+  assert(EntryFreq && "entry block frequency must be nonzero");
+
+  // RatioHi is a plain 64-bit division; RatioLo is the 64-bit quotient of the
+  // remainder shifted by 64, computed by long division one bit at a time.
+  // This runs once per function.
+  RatioHi = EntryCount / EntryFreq;
+  uint64_t Rem = EntryCount % EntryFreq;
+  for (int Bit = 63; Bit >= 0; --Bit) {
+    // Rem < EntryFreq, so 2 * Rem fits in 65 bits; track the carry.
+    bool Carry = Rem >> 63;
+    Rem <<= 1;
+    if (Carry || Rem >= EntryFreq) {
+      Rem -= EntryFreq;
+      RatioLo |= uint64_t(1) << Bit;
+    }
+  }
+
+  constexpr uint64_t Max32 = std::numeric_limits<uint32_t>::max();
+  Narrow = EntryCount <= Max32 && EntryFreq <= Max32;
+}
+
+// The vector kernels compute, for frequencies F below 2^32, with RatioLo split
+// into 32-bit halves RatioLo = A * 2^32 + B:
+//
+//   Count = F * RatioHi + ((F * A + ((F * B) >> 32)) >> 32)
+//
+// which is floor(F * Ratio / 2^64), like the scalar path, using only 32x32-bit
+// products: RatioHi <= EntryCount fits in 32 bits, and the sums cannot carry.
+// Count is again the exact result or one less, and the remainder
+//
+//   R = EntryCount * F - Count * EntryFreq
+//
+// lies in [0, 2 * EntryFreq), so it is exact in 64-bit arithmetic even though
+// Count * EntryFreq may not be; Count is one less exactly when R >= EntryFreq.
+// Both products are built from 32x32-bit multiplications.
+
+#if CASP_SCALE_AVX2
+__attribute__((target("avx2"))) static void
+scaleNarrowAVX2(const FrequencyScaler &Scaler, uint64_t RatioHi,
+                uint64_t RatioLo, uint64_t EntryFreq, const uint64_t *Freqs,
+                uint64_t *Counts, size_t N) {
+  const __m256i LoHalf = _mm256_set1_epi64x(int64_t(RatioLo & 0xffffffff));
+  const __m256i HiHalf = _mm256_set1_epi64x(int64_t(RatioLo >> 32));
+  const __m256i Whole = _mm256_set1_epi64x(int64_t(RatioHi));
+  const __m256i EntryCount =
+      _mm256_set1_epi64x(int64_t(Scaler.getEntryCount()));
+  const __m256i Freq0 = _mm256_set1_epi64x(int64_t(EntryFreq));
+  // R < 2^33, so a signed comparison with EntryFreq - 1 is exact.
+  const __m256i Threshold = _mm256_set1_epi64x(int64_t(EntryFreq - 1));
+  const __m256i Wide = _mm256_set1_epi64x(int64_t(0xffffffff00000000ULL));
+
+  size_t I = 0;
+  for (; I + 4 <= N; I += 4) {
+    __m256i F =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(Freqs + I));
+    if (!_mm256_testz_si256(F, Wide)) {
+      for (size_t J = I; J != I + 4; ++J)
+        Counts[J] = Scaler.scale(Freqs[J]);
+      continue;
+    }
+    __m256i Low = _mm256_srli_epi64(_mm256_mul_epu32(F, LoHalf), 32);
+    __m256i High = _mm256_srli_epi64(
+        _mm256_add_epi64(_mm256_mul_epu32(F, HiHalf), Low), 32);
+    __m256i Count = _mm256_add_epi64(_mm256_mul_epu32(F, Whole), High);
+
+    __m256i Product = _mm256_mul_epu32(F, EntryCount);
+    __m256i Scaled = _mm256_add_epi64(
+        _mm256_mul_epu32(Count, Freq0),
+        _mm256_slli_epi64(
+            _mm256_mul_epu32(_mm256_srli_epi64(Count, 32), Freq0), 32));
+    __m256i Rem = _mm256_sub_epi64(Product, Scaled);
+    // The mask is -1 where the remainder calls for one more.
+    Count = _mm256_sub_epi64(Count, _mm256_cmpgt_epi64(Rem, Threshold));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(Counts + I), Count);
+  }
+  for (; I != N; ++I)
+    Counts[I] = Scaler.scale(Freqs[I]);
+}
+#endif
+
+#if CASP_SCALE_NEON
+static void scaleNarrowNEON(const FrequencyScaler &Scaler, uint64_t RatioHi,
+                            uint64_t RatioLo, uint64_t EntryFreq,
+                            const uint64_t *Freqs, uint64_t *Counts,
+                            size_t N) {
+  const uint32x2_t LoHalf = vdup_n_u32(uint32_t(RatioLo));
+  const uint32x2_t HiHalf = vdup_n_u32(uint32_t(RatioLo >> 32));
+  const uint32x2_t Whole = vdup_n_u32(uint32_t(RatioHi));
+  const uint32x2_t EntryCount = vdup_n_u32(uint32_t(Scaler.getEntryCount()));
+  const uint32x2_t Freq0 = vdup_n_u32(uint32_t(EntryFreq));
+  const uint64x2_t Freq0Wide = vdupq_n_u64(EntryFreq);
+
+  size_t I = 0;
+  for (; I + 2 <= N; I += 2) {
+    if ((Freqs[I] | Freqs[I + 1]) >> 32) {
+      Counts[I] = Scaler.scale(Freqs[I]);
+      Counts[I + 1] = Scaler.scale(Freqs[I + 1]);
+      continue;
+    }
+    uint32x2_t F = vmovn_u64(vld1q_u64(Freqs + I));
+    uint64x2_t Low = vshrq_n_u64(vmull_u32(F, LoHalf), 32);
+    uint64x2_t High =
+        vshrq_n_u64(vaddq_u64(vmull_u32(F, HiHalf), Low), 32);
+    uint64x2_t Count = vaddq_u64(vmull_u32(F, Whole), High);
+
+    uint64x2_t Product = vmull_u32(F, EntryCount);
+    uint64x2_t Scaled =
+        vaddq_u64(vmull_u32(vmovn_u64(Count), Freq0),
+                  vshlq_n_u64(vmull_u32(vshrn_n_u64(Count, 32), Freq0), 32));
+    uint64x2_t Rem = vsubq_u64(Product, Scaled);
+    // The mask is all ones, i.e. -1, where the remainder calls for one more.
+    Count = vsubq_u64(Count, vcgeq_u64(Rem, Freq0Wide));
+    vst1q_u64(Counts + I, Count);
+  }
+  for (; I != N; ++I)
+    Counts[I] = Scaler.scale(Freqs[I]);
+}
+#endif
+
+void FrequencyScaler::scale(ArrayRef<uint64_t> Freqs, uint64_t *Counts) const {
+  if (Narrow) {
+#if CASP_SCALE_AVX2
+    static const bool HasAVX2 = __builtin_cpu_supports("avx2");
+    if (HasAVX2)
+      return scaleNarrowAVX2(*this, RatioHi, RatioLo, EntryFreq, Freqs.data(),
+                             Counts, Freqs.size());
+#elif CASP_SCALE_NEON
+    return scaleNarrowNEON(*this, RatioHi, RatioLo, EntryFreq, Freqs.data(),
+                           Counts, Freqs.size());
+#endif
+  }
+  for (size_t I = 0, E = Freqs.size(); I != E; ++I)
+    Counts[I] = scale(Freqs[I]);
+}
@@ -0,0 +1,155 @@
+//===- FunctionFilter.cpp - Select the functions to export ----------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the selection of the functions of a partial export.
+//
+//===----------------------------------------------------------------------===//
+
+#include "FunctionFilter.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace llvm;
+
+/// Add the GUIDs listed in \p Path to \p GUIDs.
+static Error readGUIDList(StringRef Path, DenseSet<uint64_t> &GUIDs) {
+  auto BufferOrErr = MemoryBuffer::getFile(Path, /*IsText=*/true);
+  if (std::error_code EC = BufferOrErr.getError())
+    return createStringError(EC, "cannot read GUID list '" + Path +
+                                     "': " + EC.message());
+
+  for (line_iterator It(**BufferOrErr, /*SkipBlanks=*/true, '#');
+       !It.is_at_end(); ++It) {
+    StringRef Line = It->trim();
+    uint64_t GUID;
+    // A radix of 0 accepts both decimal and 0x-prefixed hexadecimal.
+    if (Line.getAsInteger(0, GUID))
+      return createStringError(inconvertibleErrorCode(),
+                               Path + ":" + Twine(It.line_number()) +
+                                   ": invalid function GUID '" + Line + "'");
+    GUIDs.insert(GUID);
+  }
+  return Error::success();
+}
+
+Expected<std::shared_ptr<const FunctionFilter>>
+FunctionFilter::create(const FunctionFilterOptions &Opts) {
+  if (Opts.SamplePercent == 0 || Opts.SamplePercent > 100)
+    return createStringError(inconvertibleErrorCode(),
+                             "sample percentage must be between 1 and 100");
+
+  std::shared_ptr<FunctionFilter> Filter(new FunctionFilter());
+  Filter->SamplePercent = Opts.SamplePercent;
+  bool Empty = Opts.SamplePercent == 100;
+
+  auto AddRules = [&](Rules &R, ArrayRef<std::string> Files,
+                      ArrayRef<std::string> Names,
+                      ArrayRef<std::string> Sections,
+                      StringRef GUIDFile) -> Error {
+    for (const std::string &Pattern : Files) {
+      Expected<GlobPattern> Glob = GlobPattern::create(Pattern);
+      if (!Glob)
+        return createStringError(inconvertibleErrorCode(),
+                                 "invalid file pattern '" + Pattern +
+                                     "': " + toString(Glob.takeError()));
+      R.Files.push_back(std::move(*Glob));
+    }
+    for (const std::string &Pattern : Names) {
+      Regex RE(Pattern);
+      std::string Message;
+      if (!RE.isValid(Message))
+        return createStringError(inconvertibleErrorCode(),
+                                 "invalid function pattern '" + Pattern +
+                                     "': " + Message);
+      R.Names.push_back(std::move(RE));
+    }
+    for (const std::string &Section : Sections)
+      R.Sections.insert(Section);
+    if (!GUIDFile.empty()) {
+      if (Error Err = readGUIDList(GUIDFile, R.GUIDs))
+        return Err;
+      R.HasGUIDs = true;
+    }
+    Empty &= R.Files.empty() && R.Names.empty() && R.Sections.empty() &&
+             !R.HasGUIDs;
+    return Error::success();
+  };
+
+  if (Error Err = AddRules(Filter->Include, Opts.IncludeFiles,
+                           Opts.IncludeFunctions, Opts.IncludeSections,
+                           Opts.IncludeGUIDFile))
+    return std::move(Err);
+  if (Error Err = AddRules(Filter->Exclude, Opts.ExcludeFiles,
+                           Opts.ExcludeFunctions, Opts.ExcludeSections,
+                           Opts.ExcludeGUIDFile))
+    return std::move(Err);
+
+  if (Empty)
+    return nullptr;
+  return Filter;
+}
+
+/// Whether \p Glob matches \p Path or a part of it that follows a '/'.
+static bool matchesPath(const GlobPattern &Glob, StringRef Path) {
+  while (true) {
+    if (Glob.match(Path))
+      return true;
+    size_t Slash = Path.find('/');
+    if (Slash == StringRef::npos)
+      return false;
+    Path = Path.drop_front(Slash + 1);
+  }
+}
+
+bool FunctionFilter::accepts(const Function &F, uint64_t GUID,
+                             function_ref<std::string()> GetSourceFile) const {
+  // Cheapest rules first; the demangled name and the source file are only
+  // computed when a rule needs them.
+  if (SamplePercent != 100 && GUID % 100 >= SamplePercent)
+    return false;
+
+  if (Include.HasGUIDs && !Include.GUIDs.contains(GUID))
+    return false;
+  if (Exclude.HasGUIDs && Exclude.GUIDs.contains(GUID))
+    return false;
+
+  StringRef Section = F.hasSection() ? F.getSection() : StringRef();
+  if (!Include.Sections.empty() && !Include.Sections.contains(Section))
+    return false;
+  if (Exclude.Sections.contains(Section))
+    return false;
+
+  if (!Include.Names.empty() || !Exclude.Names.empty()) {
+    std::string Demangled = demangle(F.getName());
+    auto Matches = [&](const Regex &RE) {
+      return RE.match(F.getName()) || RE.match(Demangled);
+    };
+    if (!Include.Names.empty() && none_of(Include.Names, Matches))
+      return false;
+    if (any_of(Exclude.Names, Matches))
+      return false;
+  }
+
+  if (hasFileRules()) {
+    std::string File = GetSourceFile();
+    auto Matches = [&](const GlobPattern &Glob) {
+      return matchesPath(Glob, File);
+    };
+    if (File.empty())
+      return Include.Files.empty();
+    if (!Include.Files.empty() && none_of(Include.Files, Matches))
+      return false;
+    if (any_of(Exclude.Files, Matches))
+      return false;
+  }
+  return true;
+}
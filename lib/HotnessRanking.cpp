@@ -0,0 +1,126 @@
+//===- HotnessRanking.cpp - Hot and cold code from static profiles --------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the hotness ranking of static profiles.
+//
+//===----------------------------------------------------------------------===//
+
+#include "HotnessRanking.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+using namespace llvm;
+
+AnalysisKey StaticHotnessAnalysis::Key;
+
+void HotnessRanking::addFunction(StringRef Name, ArrayRef<uint64_t> Counts) {
+  FunctionHotness Hotness;
+  if (!Counts.empty()) {
+    Hotness.EntryCount = Counts.front();
+    Hotness.MaxCount = *std::max_element(Counts.begin(), Counts.end());
+  }
+
+  // Names are only copied for the functions and counters that are kept, so a
+  // ranking without every function stays bounded by K.
+  std::lock_guard<std::mutex> Lock(Mutex);
+  size_t Index = NumFunctions++;
+  for (size_t I = 0, E = Counts.size(); I != E; ++I) {
+    CounterHotness Counter{std::string(), Index, static_cast<unsigned>(I),
+                           Counts[I]};
+    if (!HotCounters.accepts(Counter))
+      continue;
+    Counter.Name = Name.str();
+    HotCounters.push(std::move(Counter));
+  }
+  RankedFunction Ranked{std::move(Hotness), Index};
+  if (HotFunctions.accepts(Ranked)) {
+    Ranked.Hotness.Name = Name.str();
+    if (KeepFunctions)
+      Functions.push_back(Ranked.Hotness);
+    HotFunctions.push(std::move(Ranked));
+  } else if (KeepFunctions) {
+    Ranked.Hotness.Name = Name.str();
+    Functions.push_back(std::move(Ranked.Hotness));
+  }
+}
+
+std::vector<HotnessRanking::FunctionHotness>
+HotnessRanking::getHottestFunctions() const {
+  std::vector<FunctionHotness> Hottest;
+  for (const RankedFunction &F : HotFunctions.getSorted())
+    Hottest.push_back(F.Hotness);
+  return Hottest;
+}
+
+void HotnessRanking::print(raw_ostream &OS) const {
+  OS << "Hottest functions (max count, entry count):\n";
+  for (const FunctionHotness &F : getHottestFunctions())
+    OS << format("  %20llu %20llu  ", (unsigned long long)F.MaxCount,
+                 (unsigned long long)F.EntryCount)
+       << F.Name << "\n";
+  OS << "Hottest counters (count, counter):\n";
+  for (const CounterHotness &C : getHottestCounters())
+    OS << format("  %20llu %8u  ", (unsigned long long)C.Count, C.Counter)
+       << C.Name << "\n";
+}
+
+bool HotnessRanking::writeSymbolOrderingFile(StringRef Path) const {
+  std::vector<const FunctionHotness *> Order;
+  for (const FunctionHotness &F : Functions)
+    if (F.MaxCount)
+      Order.push_back(&F);
+  // Stable, so equally hot functions keep their module order.
+  llvm::stable_sort(Order, [](const FunctionHotness *L,
+                              const FunctionHotness *R) {
+    if (L->MaxCount != R->MaxCount)
+      return L->MaxCount > R->MaxCount;
+    return L->EntryCount > R->EntryCount;
+  });
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Error: Cannot open symbol ordering file '" << Path
+           << "': " << EC.message() << "\n";
+    return false;
+  }
+  for (const FunctionHotness *F : Order)
+    OS << F->Name << "\n";
+
+  OS.close();
+  if (OS.has_error()) {
+    errs() << "Error: Failed to write symbol ordering file '" << Path
+           << "': " << OS.error().message() << "\n";
+    OS.clear_error();
+    return false;
+  }
+  return true;
+}
+
+bool HotnessRanking::invalidate(Module &, const PreservedAnalyses &PA,
+                                ModuleAnalysisManager::Invalidator &) {
+  auto PAC = PA.getChecker<StaticHotnessAnalysis>();
+  return !PAC.preserved() && !PAC.preservedSet<AllAnalysesOn<Module>>();
+}
+
+HotnessRanking StaticHotnessAnalysis::run(Module &M,
+                                          ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  HotnessRanking Ranking(K, /*KeepFunctions=*/true);
+  StaticProfileExporterOptions Opts = Options;
+  Opts.Hotness = &Ranking;
+  exportStaticProfile(M, &FAM, Opts,
+                      [](const Function *, NamedInstrProfRecord &&) {});
+  return Ranking;
+}
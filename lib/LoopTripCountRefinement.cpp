@@ -0,0 +1,102 @@
+//===- LoopTripCountRefinement.cpp - Known loop trip counts ---------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the correction of block frequencies for loops with
+// known trip counts.
+//
+//===----------------------------------------------------------------------===//
+
+#include "LoopTripCountRefinement.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <limits>
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+
+/// The factor that gives \p L the iterations \p SE knows it takes, or 1 if
+/// it knows none or they agree with \p BFI.
+static double computeLoopScale(const Loop &L, ScalarEvolution &SE,
+                               const BlockFrequencyInfo &BFI,
+                               const BranchProbabilityInfo &BPI) {
+  const BasicBlock *Header = L.getHeader();
+  uint64_t HeaderFreq = BFI.getBlockFreq(Header).getFrequency();
+  BlockFrequency EnterFreq;
+  for (const BasicBlock *Pred : predecessors(Header))
+    if (!L.contains(Pred))
+      EnterFreq += BFI.getBlockFreq(Pred) * BPI.getEdgeProbability(Pred, Header);
+  if (!HeaderFreq || !EnterFreq.getFrequency())
+    return 1;
+
+  double Assumed = double(HeaderFreq) / double(EnterFreq.getFrequency());
+  double Known;
+  if (unsigned TripCount = SE.getSmallConstantTripCount(&L))
+    Known = TripCount;
+  else if (unsigned MaxTripCount = SE.getSmallConstantMaxTripCount(&L))
+    Known = std::min(Assumed, double(MaxTripCount));
+  else
+    return 1;
+
+  LLVM_DEBUG(dbgs() << "Loop at " << Header->getName() << ": "
+                    << format("%.2f", Assumed) << " iteration(s) assumed, "
+                    << format("%.2f", Known) << " known\n");
+  return Known / Assumed;
+}
+
+void LoopTripCountRefinement::compute(const Function &F, const LoopInfo &LI,
+                                      ScalarEvolution &SE,
+                                      const BlockFrequencyInfo &BFI) {
+  Scales.clear();
+  LoopsRefined = 0;
+  const BranchProbabilityInfo *BPI = BFI.getBPI();
+  if (LI.empty() || !BPI)
+    return;
+
+  // Preorder visits a loop before its subloops, so the factor of a parent is
+  // final when it is multiplied into its children.
+  DenseMap<const Loop *, double> LoopScales;
+  for (const Loop *L : LI.getLoopsInPreorder()) {
+    double Scale = computeLoopScale(*L, SE, BFI, *BPI);
+    if (Scale != 1)
+      ++LoopsRefined;
+    if (const Loop *Parent = L->getParentLoop())
+      Scale *= LoopScales.lookup(Parent);
+    LoopScales[L] = Scale;
+  }
+  if (!LoopsRefined)
+    return;
+
+  Scales.assign(F.getMaxBlockNumber(), 1);
+  for (const BasicBlock &BB : F)
+    if (const Loop *L = LI.getLoopFor(&BB))
+      Scales[BB.getNumber()] = LoopScales.lookup(L);
+}
+
+uint64_t LoopTripCountRefinement::refine(const BasicBlock &BB,
+                                         uint64_t Freq) const {
+  if (Scales.empty())
+    return Freq;
+  double Refined = double(Freq) * Scales[BB.getNumber()];
+  // A block that runs keeps running, however few its iterations.
+  if (Freq && Refined < 1)
+    return 1;
+  // 2^64 is the first double that does not fit.
+  if (Refined >= 18446744073709551616.0)
+    return std::numeric_limits<uint64_t>::max();
+  return uint64_t(Refined);
+}
@@ -0,0 +1,243 @@
+//===- StaticCoverageReport.cpp - Coverage summary of a profile -----------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the coverage summary of a static profile.
+//
+// Regions, functions and branches are counted the way llvm-cov counts them:
+// code regions with a nonzero count are covered, a function is executed when
+// its first region is, and every branch region that is not folded contributes
+// a true and a false branch. A line with code is executed when a region that
+// starts on it, or the innermost region that spans it, has a nonzero count.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StaticCoverageReport.h"
+#include "CoverageRecordIndex.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ProfileData/Coverage/CoverageMapping.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+using namespace llvm::coverage;
+
+namespace {
+
+/// The extent and count of a code region, for line coverage.
+struct CodeRegionCount {
+  unsigned LineStart;
+  unsigned ColumnStart;
+  unsigned LineEnd;
+  uint64_t Count;
+};
+
+} // end anonymous namespace
+
+/// Mark the lines spanned by \p Regions, the code regions of one function in
+/// one file, as executed or not in \p Lines.
+///
+/// Like the segment builder of llvm-cov, this is one sweep over the regions
+/// in start order. The regions that started on earlier lines form a stack in
+/// that order; those that end before the current line are popped from the
+/// top, and what is left on top is the innermost region spanning the line.
+static void addLineCoverage(std::vector<CodeRegionCount> &Regions,
+                            DenseMap<unsigned, bool> &Lines) {
+  llvm::sort(Regions, [](const CodeRegionCount &L, const CodeRegionCount &R) {
+    return std::tie(L.LineStart, L.ColumnStart) <
+           std::tie(R.LineStart, R.ColumnStart);
+  });
+
+  std::vector<const CodeRegionCount *> Active;
+  size_t Next = 0, NumRegions = Regions.size();
+  unsigned Line = Regions.front().LineStart;
+  while (true) {
+    while (!Active.empty() && Active.back()->LineEnd < Line)
+      Active.pop_back();
+    // Lines no region spans have no code; skip to the next region.
+    if (Active.empty()) {
+      if (Next == NumRegions)
+        break;
+      Line = Regions[Next].LineStart;
+    }
+
+    bool Executed = !Active.empty() && Active.back()->Count != 0;
+    for (; Next != NumRegions && Regions[Next].LineStart == Line; ++Next) {
+      Executed |= Regions[Next].Count != 0;
+      Active.push_back(&Regions[Next]);
+    }
+    Lines[Line] |= Executed;
+    ++Line;
+  }
+}
+
+void StaticCoverageReport::addFunction(const CoverageRecordIndex &Index,
+                                       const InstrumentedFunctionRecord &Instr,
+                                       ArrayRef<uint64_t> Counts) {
+  std::vector<CounterExpression> Expressions;
+  std::vector<CounterMappingRegion> Regions;
+  std::vector<StringRef> Filenames;
+  if (Error Err = Index.readMapping(Instr, Expressions, Regions, &Filenames)) {
+    LLVM_DEBUG(dbgs() << "Cannot decode coverage mapping for the report: "
+                      << toString(std::move(Err)) << "\n");
+    consumeError(std::move(Err));
+    ++UnmappedFunctions;
+    return;
+  }
+  if (Regions.empty() || Filenames.empty()) {
+    ++UnmappedFunctions;
+    return;
+  }
+
+  CounterMappingContext Ctx(Expressions, Counts);
+  auto Evaluate = [&](const Counter &C) -> uint64_t {
+    Expected<int64_t> Value = Ctx.evaluate(C);
+    if (!Value) {
+      consumeError(Value.takeError());
+      return 0;
+    }
+    return std::max<int64_t>(*Value, 0);
+  };
+  auto GetFile = [&](unsigned FileID) -> FileSummary * {
+    if (FileID >= Filenames.size())
+      return nullptr;
+    return &Files[Filenames[FileID]];
+  };
+
+  FileSummary &MainFile = *GetFile(0);
+  ++MainFile.Functions;
+  if (Evaluate(Regions.front().Count))
+    ++MainFile.ExecutedFunctions;
+
+  std::vector<std::vector<CodeRegionCount>> CodeRegions(Filenames.size());
+  for (const CounterMappingRegion &R : Regions) {
+    FileSummary *File = GetFile(R.FileID);
+    if (!File)
+      continue;
+    switch (R.Kind) {
+    case CounterMappingRegion::CodeRegion: {
+      uint64_t Count = Evaluate(R.Count);
+      ++File->Regions;
+      File->CoveredRegions += Count != 0;
+      CodeRegions[R.FileID].push_back(
+          {R.LineStart, R.ColumnStart, R.LineEnd, Count});
+      break;
+    }
+    case CounterMappingRegion::BranchRegion:
+      // Both counters are zero for conditions folded to a constant.
+      if (R.Count.isZero() && R.FalseCount.isZero())
+        break;
+      File->Branches += 2;
+      File->CoveredBranches +=
+          (Evaluate(R.Count) != 0) + (Evaluate(R.FalseCount) != 0);
+      break;
+    default:
+      break;
+    }
+  }
+
+  for (unsigned FileID = 0, E = CodeRegions.size(); FileID != E; ++FileID)
+    if (!CodeRegions[FileID].empty())
+      addLineCoverage(CodeRegions[FileID], GetFile(FileID)->Lines);
+}
+
+/// Percentage of \p Covered out of \p Total, or "-" if there is nothing to
+/// cover.
+static std::string formatPercent(unsigned Covered, unsigned Total) {
+  if (!Total)
+    return "-";
+  std::string S;
+  raw_string_ostream(S) << format("%.2f%%", 100.0 * Covered / Total);
+  return S;
+}
+
+void StaticCoverageReport::print(raw_ostream &OS) const {
+  struct Row {
+    StringRef Name;
+    unsigned Regions = 0, CoveredRegions = 0;
+    unsigned Functions = 0, ExecutedFunctions = 0;
+    unsigned Lines = 0, ExecutedLines = 0;
+    unsigned Branches = 0, CoveredBranches = 0;
+
+    Row &operator+=(const Row &RHS) {
+      Regions += RHS.Regions;
+      CoveredRegions += RHS.CoveredRegions;
+      Functions += RHS.Functions;
+      ExecutedFunctions += RHS.ExecutedFunctions;
+      Lines += RHS.Lines;
+      ExecutedLines += RHS.ExecutedLines;
+      Branches += RHS.Branches;
+      CoveredBranches += RHS.CoveredBranches;
+      return *this;
+    }
+  };
+
+  std::vector<Row> Rows;
+  Row Total;
+  Total.Name = "TOTAL";
+  size_t NameWidth = Total.Name.size();
+  for (const auto &Entry : Files) {
+    const FileSummary &File = Entry.getValue();
+    Row R;
+    R.Name = Entry.getKey();
+    R.Regions = File.Regions;
+    R.CoveredRegions = File.CoveredRegions;
+    R.Functions = File.Functions;
+    R.ExecutedFunctions = File.ExecutedFunctions;
+    R.Lines = File.Lines.size();
+    R.ExecutedLines =
+        count_if(File.Lines, [](const auto &Line) { return Line.second; });
+    R.Branches = File.Branches;
+    R.CoveredBranches = File.CoveredBranches;
+    Total += R;
+    NameWidth = std::max(NameWidth, R.Name.size());
+    Rows.push_back(R);
+  }
+  llvm::sort(Rows, [](const Row &L, const Row &R) { return L.Name < R.Name; });
+
+  // Title and width of every column after the filename, in groups of three:
+  // total, missed and covered percentage.
+  const std::pair<const char *, unsigned> Columns[] = {
+      {"Regions", 10},  {"Missed Regions", 17},   {"Cover", 10},
+      {"Functions", 12}, {"Missed Functions", 18}, {"Executed", 10},
+      {"Lines", 10},    {"Missed Lines", 14},     {"Cover", 10},
+      {"Branches", 10}, {"Missed Branches", 17},  {"Cover", 10}};
+  size_t LineWidth = NameWidth;
+  OS << left_justify("Filename", NameWidth);
+  for (const auto &[Title, Width] : Columns) {
+    OS << right_justify(Title, Width);
+    LineWidth += Width;
+  }
+  OS << "\n";
+  std::string Separator(LineWidth, '-');
+  OS << Separator << "\n";
+
+  auto PrintRow = [&](const Row &R) {
+    auto Stat = [&](unsigned Covered, unsigned All, unsigned I) {
+      OS << right_justify(std::to_string(All), Columns[I].second)
+         << right_justify(std::to_string(All - Covered), Columns[I + 1].second)
+         << right_justify(formatPercent(Covered, All), Columns[I + 2].second);
+    };
+    OS << left_justify(R.Name, NameWidth);
+    Stat(R.CoveredRegions, R.Regions, 0);
+    Stat(R.ExecutedFunctions, R.Functions, 3);
+    Stat(R.ExecutedLines, R.Lines, 6);
+    Stat(R.CoveredBranches, R.Branches, 9);
+    OS << "\n";
+  };
+  for (const Row &R : Rows)
+    PrintRow(R);
+  OS << Separator << "\n";
+  PrintRow(Total);
+}
@@ -0,0 +1,260 @@
+//===- StaticFrequencyFile.cpp - Per-block static frequencies -------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the writer and reader of static frequency files.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StaticFrequencyFile.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+// "CASPFREQ", little-endian.
+static constexpr uint64_t FileMagic = 0x5145524650534143ULL;
+// Version 2 keys functions by their IR PGO name instead of their PGO name.
+static constexpr uint32_t FileVersion = 2;
+// Magic, version and reserved word, number of functions, and the offsets of
+// the index and data sections and the size of the latter.
+static constexpr size_t HeaderSize = 8 + 4 + 4 + 8 + 8 + 8 + 8;
+// GUID, data offset, data size and number of blocks.
+static constexpr size_t IndexEntrySize = 8 + 8 + 4 + 4;
+
+/// Append \p Values to \p OS as the first value followed by the deltas to the
+/// previous value. Deltas wrap around, so they round-trip for any value.
+static void encodeColumn(raw_ostream &OS, ArrayRef<uint64_t> Values) {
+  uint64_t Prev = 0;
+  for (size_t I = 0, E = Values.size(); I != E; ++I) {
+    if (I == 0)
+      encodeULEB128(Values[I], OS);
+    else
+      encodeSLEB128(static_cast<int64_t>(Values[I] - Prev), OS);
+    Prev = Values[I];
+  }
+}
+
+/// Decode \p N values encoded by encodeColumn from \p Ptr, advancing it.
+template <typename T>
+static bool decodeColumn(const uint8_t *&Ptr, const uint8_t *End, uint32_t N,
+                         SmallVectorImpl<T> &Values) {
+  Values.clear();
+  // Every value takes at least one byte, so a count beyond the remaining
+  // bytes is malformed, and must not size the reservation.
+  if (N > static_cast<size_t>(End - Ptr))
+    return false;
+  Values.reserve(N);
+  uint64_t Value = 0;
+  for (uint32_t I = 0; I != N; ++I) {
+    unsigned Size;
+    const char *Error = nullptr;
+    if (I == 0)
+      Value = decodeULEB128(Ptr, &Size, End, &Error);
+    else
+      Value += static_cast<uint64_t>(decodeSLEB128(Ptr, &Size, End, &Error));
+    if (Error)
+      return false;
+    Ptr += Size;
+    Values.push_back(static_cast<T>(Value));
+  }
+  return true;
+}
+
+void StaticFrequencyWriter::addFunction(uint64_t GUID,
+                                        ArrayRef<uint32_t> Lines,
+                                        ArrayRef<uint64_t> Counts) {
+  assert(Lines.size() == Counts.size() && "one line per block expected");
+  FunctionData Data;
+  Data.NumBlocks = Counts.size();
+  raw_string_ostream OS(Data.Columns);
+  SmallVector<uint64_t, 32> WideLines(Lines.begin(), Lines.end());
+  encodeColumn(OS, WideLines);
+  encodeColumn(OS, Counts);
+
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Functions.try_emplace(GUID, std::move(Data));
+}
+
+void StaticFrequencyWriter::addFunction(const Function &F, uint64_t GUID,
+                                        ArrayRef<uint64_t> Counts) {
+  SmallVector<uint32_t, 32> Lines;
+  Lines.reserve(F.size());
+  for (const BasicBlock &BB : F) {
+    uint32_t Line = 0;
+    for (const Instruction &I : BB)
+      if (const DebugLoc &Loc = I.getDebugLoc(); Loc && Loc.getLine()) {
+        Line = Loc.getLine();
+        break;
+      }
+    Lines.push_back(Line);
+  }
+  addFunction(GUID, Lines, Counts);
+}
+
+void StaticFrequencyWriter::merge(StaticFrequencyWriter &&Other) {
+  std::scoped_lock Lock(Mutex, Other.Mutex);
+  for (auto &[GUID, Data] : Other.Functions)
+    Functions.try_emplace(GUID, std::move(Data));
+  Other.Functions.clear();
+}
+
+bool StaticFrequencyWriter::replaceCounts(uint64_t GUID,
+                                          ArrayRef<uint64_t> Counts) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto It = Functions.find(GUID);
+  if (It == Functions.end() || It->second.NumBlocks != Counts.size())
+    return false;
+
+  FunctionData &Data = It->second;
+  const uint8_t *Ptr = reinterpret_cast<const uint8_t *>(Data.Columns.data());
+  const uint8_t *End = Ptr + Data.Columns.size();
+  SmallVector<uint64_t, 32> Lines;
+  if (!decodeColumn(Ptr, End, Data.NumBlocks, Lines))
+    return false;
+  std::string Columns;
+  raw_string_ostream OS(Columns);
+  encodeColumn(OS, Lines);
+  encodeColumn(OS, Counts);
+  Data.Columns = std::move(Columns);
+  return true;
+}
+
+bool StaticFrequencyWriter::write(StringRef Path) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  std::vector<uint64_t> GUIDs;
+  GUIDs.reserve(Functions.size());
+  for (const auto &Entry : Functions)
+    GUIDs.push_back(Entry.first);
+  llvm::sort(GUIDs);
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << "Error: Cannot open frequency file '" << Path
+           << "': " << EC.message() << "\n";
+    return false;
+  }
+
+  uint64_t DataSize = 0;
+  for (uint64_t GUID : GUIDs)
+    DataSize += Functions[GUID].Columns.size();
+  uint64_t IndexOffset = HeaderSize;
+  uint64_t DataOffset = IndexOffset + GUIDs.size() * IndexEntrySize;
+
+  support::endian::Writer W(OS, llvm::endianness::little);
+  W.write<uint64_t>(FileMagic);
+  W.write<uint32_t>(FileVersion);
+  W.write<uint32_t>(0);
+  W.write<uint64_t>(GUIDs.size());
+  W.write<uint64_t>(IndexOffset);
+  W.write<uint64_t>(DataOffset);
+  W.write<uint64_t>(DataSize);
+
+  uint64_t Offset = 0;
+  for (uint64_t GUID : GUIDs) {
+    const FunctionData &Data = Functions[GUID];
+    W.write<uint64_t>(GUID);
+    W.write<uint64_t>(Offset);
+    W.write<uint32_t>(Data.Columns.size());
+    W.write<uint32_t>(Data.NumBlocks);
+    Offset += Data.Columns.size();
+  }
+  for (uint64_t GUID : GUIDs)
+    OS << Functions[GUID].Columns;
+
+  OS.close();
+  if (OS.has_error()) {
+    errs() << "Error: Failed to write frequency file '" << Path
+           << "': " << OS.error().message() << "\n";
+    OS.clear_error();
+    return false;
+  }
+  return true;
+}
+
+Expected<std::unique_ptr<StaticFrequencyFile>>
+StaticFrequencyFile::open(StringRef Path) {
+  auto BufferOrErr = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+  if (std::error_code EC = BufferOrErr.getError())
+    return createStringError(EC, "cannot read frequency file '" + Path +
+                                     "': " + EC.message());
+
+  auto Malformed = [&](const Twine &Reason) {
+    return createStringError(inconvertibleErrorCode(),
+                             "malformed frequency file '" + Path +
+                                 "': " + Reason);
+  };
+
+  std::unique_ptr<StaticFrequencyFile> File(new StaticFrequencyFile());
+  File->Buffer = std::move(*BufferOrErr);
+  StringRef Bytes = File->Buffer->getBuffer();
+  if (Bytes.size() < HeaderSize)
+    return Malformed("truncated header");
+
+  using namespace support;
+  const char *Ptr = Bytes.data();
+  if (endian::read64le(Ptr) != FileMagic)
+    return Malformed("bad magic");
+  if (endian::read32le(Ptr + 8) != FileVersion)
+    return Malformed("unsupported version");
+  File->NumFunctions = endian::read64le(Ptr + 16);
+  uint64_t IndexOffset = endian::read64le(Ptr + 24);
+  uint64_t DataOffset = endian::read64le(Ptr + 32);
+  uint64_t DataSize = endian::read64le(Ptr + 40);
+
+  if (IndexOffset > Bytes.size() ||
+      File->NumFunctions > (Bytes.size() - IndexOffset) / IndexEntrySize ||
+      DataOffset > Bytes.size() || DataSize > Bytes.size() - DataOffset)
+    return Malformed("sections out of bounds");
+
+  File->Index = Ptr + IndexOffset;
+  File->Data = Bytes.substr(DataOffset, DataSize);
+  return File;
+}
+
+uint64_t StaticFrequencyFile::getGUID(size_t I) const {
+  assert(I < NumFunctions && "function index out of range");
+  return support::endian::read64le(Index + I * IndexEntrySize);
+}
+
+bool StaticFrequencyFile::lookup(uint64_t GUID,
+                                 SmallVectorImpl<uint32_t> &Lines,
+                                 SmallVectorImpl<uint64_t> &Counts) const {
+  size_t Lo = 0, Hi = NumFunctions;
+  while (Lo < Hi) {
+    size_t Mid = Lo + (Hi - Lo) / 2;
+    if (getGUID(Mid) < GUID)
+      Lo = Mid + 1;
+    else
+      Hi = Mid;
+  }
+  if (Lo == NumFunctions || getGUID(Lo) != GUID)
+    return false;
+
+  using namespace support;
+  const char *Entry = Index + Lo * IndexEntrySize;
+  uint64_t Offset = endian::read64le(Entry + 8);
+  uint32_t Size = endian::read32le(Entry + 16);
+  uint32_t NumBlocks = endian::read32le(Entry + 20);
+  if (Offset > Data.size() || Size > Data.size() - Offset)
+    return false;
+
+  const auto *Ptr = reinterpret_cast<const uint8_t *>(Data.data() + Offset);
+  const uint8_t *End = Ptr + Size;
+  return decodeColumn(Ptr, End, NumBlocks, Lines) &&
+         decodeColumn(Ptr, End, NumBlocks, Counts);
+}
@@ -0,0 +1,117 @@
+//===- StaticProfileCache.cpp - On-disk cache of static profiles ----------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the on-disk cache of static profile records.
+//
+// An entry holds little-endian 64-bit words:
+//   magic, version, record hash, number of counters, counters...
+//
+//===----------------------------------------------------------------------===//
+
+#include "StaticProfileCache.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+
+/// "CASPPROF" in little-endian byte order.
+static constexpr uint64_t EntryMagic = 0x464F525050534143ULL;
+static constexpr size_t EntryHeaderWords = 4;
+
+StaticProfileCache::StaticProfileCache(StringRef Dir) {
+  if (Dir.empty())
+    return;
+  if (std::error_code EC = sys::fs::create_directories(Dir)) {
+    errs() << "Warning: Cannot create static profile cache directory '" << Dir
+           << "': " << EC.message() << "; caching disabled\n";
+    return;
+  }
+  this->Dir = Dir.str();
+}
+
+std::string StaticProfileCache::getEntryPath(uint64_t Key) const {
+  SmallString<128> Path(Dir);
+  std::string Name;
+  raw_string_ostream(Name) << "casp-" << format_hex_no_prefix(Key, 16);
+  sys::path::append(Path, Name);
+  return std::string(Path);
+}
+
+bool StaticProfileCache::lookup(uint64_t Key, uint64_t &Hash,
+                                std::vector<uint64_t> &Counts) const {
+  if (!isEnabled())
+    return false;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+      MemoryBuffer::getFile(getEntryPath(Key), /*IsText=*/false,
+                            /*RequiresNullTerminator=*/false);
+  if (!BufOrErr)
+    return false;
+
+  StringRef Data = (*BufOrErr)->getBuffer();
+  auto Word = [&](size_t I) {
+    return support::endian::read64le(Data.data() + I * sizeof(uint64_t));
+  };
+  if (Data.size() % sizeof(uint64_t) ||
+      Data.size() < EntryHeaderWords * sizeof(uint64_t) ||
+      Word(0) != EntryMagic || Word(1) != Version ||
+      Word(3) != Data.size() / sizeof(uint64_t) - EntryHeaderWords) {
+    LLVM_DEBUG(dbgs() << "Ignoring malformed static profile cache entry "
+                      << format_hex(Key, 18) << "\n");
+    return false;
+  }
+
+  Hash = Word(2);
+  Counts.resize(Word(3));
+  for (size_t I = 0, E = Counts.size(); I != E; ++I)
+    Counts[I] = Word(EntryHeaderWords + I);
+  return true;
+}
+
+void StaticProfileCache::store(uint64_t Key, uint64_t Hash,
+                               ArrayRef<uint64_t> Counts) const {
+  if (!isEnabled())
+    return;
+
+  SmallString<128> TempPath;
+  int FD;
+  if (std::error_code EC = sys::fs::createUniqueFile(
+          getEntryPath(Key) + ".tmp-%%%%%%", FD, TempPath)) {
+    LLVM_DEBUG(dbgs() << "Cannot create static profile cache entry: "
+                      << EC.message() << "\n");
+    return;
+  }
+
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    support::endian::Writer W(OS, llvm::endianness::little);
+    W.write<uint64_t>(EntryMagic);
+    W.write<uint64_t>(Version);
+    W.write<uint64_t>(Hash);
+    W.write<uint64_t>(Counts.size());
+    for (uint64_t Count : Counts)
+      W.write<uint64_t>(Count);
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(TempPath);
+      return;
+    }
+  }
+
+  // Renaming is atomic, so readers never see a partial entry.
+  if (sys::fs::rename(TempPath, getEntryPath(Key)))
+    sys::fs::remove(TempPath);
+}
@@ -0,0 +1,77 @@
+//===- StaticProfileDedup.cpp - Duplicate functions -----------------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the tracking of functions defined by several modules.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StaticProfileDedup.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+bool StaticProfileDedup::mayBeDuplicated(const Function &F) {
+  return F.isWeakForLinker() || F.hasComdat();
+}
+
+bool StaticProfileDedup::claim(StringRef Name, uint64_t Hash) {
+  assert(Policy == DuplicatePolicy::KeepOne && "claiming without KeepOne");
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Key = std::make_pair(IndexedInstrProf::ComputeHash(Name), Hash);
+  if (EntryIndex.try_emplace(Key, 0).second)
+    return true;
+  ++Duplicates;
+  return false;
+}
+
+void StaticProfileDedup::release(StringRef Name, uint64_t Hash) {
+  assert(Policy == DuplicatePolicy::KeepOne && "releasing without KeepOne");
+  std::lock_guard<std::mutex> Lock(Mutex);
+  EntryIndex.erase(std::make_pair(IndexedInstrProf::ComputeHash(Name), Hash));
+}
+
+void StaticProfileDedup::add(const NamedInstrProfRecord &Record) {
+  assert(Policy == DuplicatePolicy::Average && "averaging without Average");
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Key =
+      std::make_pair(IndexedInstrProf::ComputeHash(Record.Name), Record.Hash);
+  auto [It, Inserted] = EntryIndex.try_emplace(Key, Entries.size());
+  if (Inserted) {
+    Entries.push_back({Record.Name.str(), Record.Hash, Record, 1});
+    return;
+  }
+
+  Entry &E = Entries[It->second];
+  ++Duplicates;
+  std::vector<uint64_t> &Sums = E.Record.Counts;
+  if (Sums.size() != Record.Counts.size()) {
+    errs() << "Warning: Dropping a copy of " << Record.Name
+           << " with a different number of counters\n";
+    return;
+  }
+  for (size_t I = 0, N = Sums.size(); I != N; ++I)
+    Sums[I] = SaturatingAdd(Sums[I], Record.Counts[I]);
+  ++E.Copies;
+}
+
+void StaticProfileDedup::flush(StaticProfileRecordSink Sink) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  for (Entry &E : Entries) {
+    for (uint64_t &Count : E.Record.Counts)
+      Count /= E.Copies;
+    NamedInstrProfRecord Named;
+    static_cast<InstrProfRecord &>(Named) = std::move(E.Record);
+    Named.Name = E.Name;
+    Named.Hash = E.Hash;
+    Sink(nullptr, std::move(Named));
+  }
+  EntryIndex.clear();
+  Entries.clear();
+}
@@ -13,19 +13,60 @@
 //===----------------------------------------------------------------------===//
 
 #include "StaticProfileExporter.h"
+#include "CounterAssignment.h"
+#include "CoverageRecordIndex.h"
+#include "DynamicBaseProfile.h"
+#include "EntryCountPropagation.h"
+#include "FrequencyScaler.h"
+#include "FunctionFilter.h"
+#include "HotnessRanking.h"
+#include "LoopTripCountRefinement.h"
+#include "StaticFrequencyFile.h"
+#include "StaticProfileCache.h"
+#include "StaticProfileDedup.h"
+#include "StaticProfileMemory.h"
+#include "StaticProfileTimer.h"
+#include "StaticProfileWriter.h"
+#include "WuLarusBranchProbability.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StableHashing.h"
+#include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
-#include "llvm/IR/Constants.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
-#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/StructuralHash.h"
 #include "llvm/ProfileData/InstrProf.h"
-#include "llvm/ProfileData/InstrProfWriter.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/Error.h"
-#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBufferRef.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/TargetParser/Triple.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
 
 #define DEBUG_TYPE "static-profile-export"
 
@@ -33,43 +74,77 @@ using namespace llvm;
 
 namespace llvm {
 
-// Default entry count for scaling static frequencies to absolute counts.
-// This value is chosen to be large enough to provide granularity in frequency
-// ratios while avoiding overflow in typical calculations. Based on VESPA paper
-// and LLVM's sample profile conventions.
-static constexpr uint64_t DefaultEntryCount = 100;//1000000;
-
-/// Extract the structural hash from coverage mapping metadata.
-/// Coverage records (__covrec_) contain the hash needed for llvm-cov compatibility.
-/// Structure: { name_hash (i64), data_size (i32), struct_hash (i64), ... }
-static std::optional<uint64_t> tryExtractCoverageHash(const Module &M, const Function &F) {
-  // We need to look for coverage record global like so __covrec_<name_hash>u
-  std::string FuncName = getPGOFuncName(F);
-  uint64_t NameHash = IndexedInstrProf::ComputeHash(FuncName);
-  
-  // The coverage records are named __covrec_<hexhash>u where hash is the function name hash
-  SmallString<64> CovRecName;
-  raw_svector_ostream OS(CovRecName);
-  OS << "__covrec_" << format_hex_no_prefix(NameHash, 16, /*Upper=*/true) << "u";
-  
-  if (const GlobalVariable *CovRec = M.getNamedGlobal(OS.str())) {
-    // We extract structural hash from the coverage record
-    // Field 0: name hash (i64) -> for naming the record
-    // Field 1: data size (i32) -> size of encoded mapping data
-    // Field 2: structural hash (i64) -> THIS is what we need for profile compatibility
-    if (const ConstantStruct *CS = dyn_cast_or_null<ConstantStruct>(CovRec->getInitializer())) {
-      if (CS->getNumOperands() >= 3) {
-        if (const ConstantInt *StructHashVal = dyn_cast<ConstantInt>(CS->getOperand(2))) {
-          uint64_t StructHash = StructHashVal->getZExtValue();
-          LLVM_DEBUG(dbgs() << "Extracted coverage struct hash for " << F.getName() 
-                           << ": " << format_hex(StructHash, 18) << "\n");
-          return StructHash;
-        }
-      }
-    }
+cl::opt<bool> UseWuLarusHeuristics(
+    "use-wu-larus-heuristics",
+    cl::desc("Compute branch probabilities with the Wu-Larus heuristics "
+             "instead of BranchProbabilityInfo"),
+    cl::init(false));
+
+namespace {
+
+/// Names and instrumentation records identifying a function in profile and
+/// coverage data, and the entry count its frequencies are scaled to. They are
+/// derived once per function and handed to every consumer; the buffers are
+/// reused from one function to the next.
+struct FunctionProfileInfo {
+  /// Name used by frontend instrumentation (getPGOFuncName).
+  std::string PGOName;
+  /// Name the profile record is written under (getIRPGOFuncName).
+  std::string IRPGOName;
+  /// MD5 of PGOName, the key of the coverage and profile data records.
+  uint64_t NameHash = 0;
+  /// Coverage and profile data records of the function, if instrumented.
+  const InstrumentedFunctionRecord *Instr = nullptr;
+  /// Entry count the block frequencies of the function are scaled to.
+  uint64_t EntryCount = 0;
+};
+
+} // end anonymous namespace
+
+/// Entry count the block frequencies of \p F are scaled to, unless entry
+/// counts are propagated from callers.
+static uint64_t getScalingEntryCount(const Function &F,
+                                     const StaticProfileExporterOptions &Opts) {
+  if (Opts.UseFunctionEntryCount)
+    if (std::optional<Function::ProfileCount> Count = F.getEntryCount(true))
+      if (Count->getCount())
+        return Count->getCount();
+  return Opts.EntryCount;
+}
+
+/// Function metadata holding the PGO and IR PGO names of a local function
+/// before it was linked into another module (see preserveProfileNames).
+static constexpr StringLiteral ProfileNamesMetadata = "casp.profile.names";
+
+std::string getProfileName(const Function &F, bool IR) {
+  if (const MDNode *Names = F.getMetadata(ProfileNamesMetadata))
+    if (const auto *Name = dyn_cast<MDString>(Names->getOperand(IR)))
+      return Name->getString().str();
+  return IR ? getIRPGOFuncName(F) : getPGOFuncName(F);
+}
+
+void preserveProfileNames(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  for (Function &F : M) {
+    if (F.isDeclaration() || !F.hasLocalLinkage() ||
+        F.getMetadata(ProfileNamesMetadata))
+      continue;
+    F.setMetadata(ProfileNamesMetadata,
+                  MDNode::get(Ctx, {MDString::get(Ctx, getPGOFuncName(F)),
+                                    MDString::get(Ctx, getIRPGOFuncName(F))}));
   }
-  
-  return std::nullopt;
+}
+
+/// Fill \p Info with the names and instrumentation records of \p F.
+static void computeFunctionProfileInfo(const Function &F,
+                                       const CoverageRecordIndex &Index,
+                                       const StaticProfileExporterOptions &Opts,
+                                       FunctionProfileInfo &Info) {
+  Info.PGOName = getProfileName(F);
+  Info.IRPGOName = getProfileName(F, /*IR=*/true);
+  Info.NameHash = IndexedInstrProf::ComputeHash(Info.PGOName);
+  Info.Instr = Index.lookup(Info.NameHash);
+  Info.EntryCount = getScalingEntryCount(F, Opts);
 }
 
 /// Compute the function hash for profile compatibility.
@@ -77,47 +152,104 @@ static std::optional<uint64_t> tryExtractCoverageHash(const Module &M, const Fun
 /// Note: Always prefer the structural hash from coverage mapping metadata, if present,
 /// because it ensures compatibility with llvm-cov. This function falls back to PGO name hash
 /// for non-instrumented functions.
-static uint64_t computeFunctionHash(const Module &M, const Function &F) {
-  // First try to extract hash from coverage mapping (if IR was instrumented)
-  if (auto CovHash = tryExtractCoverageHash(M, F)) {
+static uint64_t computeFunctionHash(const Function &F,
+                                    const FunctionProfileInfo &Info) {
+  // First try the hash from the coverage record (if IR was instrumented)
+  if (Info.Instr && Info.Instr->StructHash) {
     LLVM_DEBUG(dbgs() << "Using coverage struct hash for " << F.getName() 
-                      << ": " << format_hex(*CovHash, 18) << "\n");
-    return *CovHash;
+                      << ": " << format_hex(*Info.Instr->StructHash, 18) << "\n");
+    return *Info.Instr->StructHash;
   }
   
-  // Fallback: compute MD5 hash of function name (this is the standard PGO method)
+  // Fallback: use the MD5 hash of function name (this is the standard PGO method)
   // This will work for PGO but not for coverage visualization with llvm-cov
-  std::string FuncName = getPGOFuncName(F);
-  uint64_t Hash = IndexedInstrProf::ComputeHash(FuncName);
   LLVM_DEBUG(dbgs() << "Using PGO name hash for " << F.getName() 
-                    << ": " << format_hex(Hash, 18) << " (no coverage metadata)\n");
-  return Hash;
+                    << ": " << format_hex(Info.NameHash, 18) << " (no coverage metadata)\n");
+  return Info.NameHash;
 }
 
-/// Try to extract the number of counters from PGO instrumentation metadata.
-/// The __profd_ global contains profiling metadata including counter count.
-/// Structure: { name_hash (i64), cfg_hash (i64), counter_ptr_offset (i64), 
-///              function_ptr (i64), values (ptr), num_value_sites (ptr),
-///              num_counters (i32), ... }
-static std::optional<unsigned> tryExtractCounterCount(const Module &M, const Function &F) {
-  std::string FuncName = getPGOFuncName(F);
-  std::string ProfdName = "__profd_" + FuncName;
-  
-  if (const GlobalVariable *Profd = M.getNamedGlobal(ProfdName)) {
-    if (const ConstantStruct *CS = dyn_cast_or_null<ConstantStruct>(Profd->getInitializer())) {
-      // num_counters is the 7th field (index 6) in the __profd_ struct
-      if (CS->getNumOperands() > 6) {
-        if (const ConstantInt *NumCounters = dyn_cast<ConstantInt>(CS->getOperand(6))) {
-          unsigned Count = NumCounters->getZExtValue();
-          LLVM_DEBUG(dbgs() << "Extracted counter count for " << F.getName() 
-                           << ": " << Count << "\n");
-          return Count;
-        }
-      }
+/// The record of \p F in the base profile of \p Opts, if the runs reached
+/// it. \p Info is filled in either way when there is a base profile.
+static std::optional<InstrProfRecord>
+lookupBaseRecord(const Function &F, const CoverageRecordIndex &Index,
+                 const StaticProfileExporterOptions &Opts,
+                 FunctionProfileInfo &Info) {
+  if (!Opts.BaseProfile)
+    return std::nullopt;
+  computeFunctionProfileInfo(F, Index, Opts, Info);
+  return Opts.BaseProfile->lookup(Info.IRPGOName, Info.PGOName,
+                                  computeFunctionHash(F, Info));
+}
+
+/// Frequency of \p BB, corrected by \p Refinement if there is one.
+static uint64_t getBlockFreq(const BasicBlock &BB,
+                             const BlockFrequencyInfo &BFI,
+                             const LoopTripCountRefinement *Refinement) {
+  uint64_t Freq = BFI.getBlockFreq(&BB).getFrequency();
+  return Refinement ? Refinement->refine(BB, Freq) : Freq;
+}
+
+/// Frequencies of the blocks of \p F, in layout order.
+static void collectBlockFrequencies(const Function &F,
+                                    const BlockFrequencyInfo &BFI,
+                                    const LoopTripCountRefinement *Refinement,
+                                    SmallVectorImpl<uint64_t> &Freqs) {
+  Freqs.clear();
+  Freqs.reserve(F.size());
+  for (const BasicBlock &BB : F)
+    Freqs.push_back(getBlockFreq(BB, BFI, Refinement));
+}
+
+/// Fallback counter assignment for instrumented functions whose increments
+/// cannot be located in the IR.
+///
+/// - Counter 0: Entry block execution count
+/// - Remaining counters: block counts in descending order
+///
+/// This is a heuristic that works reasonably well for basic coverage estimation
+/// but doesn't capture the precise counter-to-region mapping.
+///
+/// \p Scratch.BlockCounts holds the scaled block counts, indexed by block
+/// number.
+static void assignCountersBySortedFrequency(const Function &F,
+                                            const FrequencyScaler &Scaler,
+                                            unsigned NumCounters,
+                                            CounterScratch &Scratch,
+                                            std::vector<uint64_t> &Counts) {
+  // Collect all block counts and sort them
+  SmallVectorImpl<uint64_t> &BlockFreqs = Scratch.Freqs;
+  BlockFreqs.clear();
+  BlockFreqs.reserve(F.size());
+  for (const BasicBlock &BB : F)
+    BlockFreqs.push_back(Scratch.BlockCounts[BB.getNumber()]);
+
+  // Sort in descending order to assign higher counts to early counters
+  std::sort(BlockFreqs.rbegin(), BlockFreqs.rend());
+
+  // Assign counts to instrumentation counters
+  // Counter 0 always gets entry count
+  const uint64_t EntryCount = Scaler.getEntryCount();
+  Counts.reserve(std::max(NumCounters, 1u));
+  Counts.push_back(EntryCount);
+
+  // Distribute remaining block frequencies to counters
+  // If we have more counters than blocks, pad with progressively lower counts
+  // If we have fewer counters than blocks, use the highest frequency blocks
+  for (unsigned i = 1; i < NumCounters; ++i) {
+    if (i < BlockFreqs.size()) {
+      Counts.push_back(BlockFreqs[i]);
+    } else {
+      // We pad with scaled-down entry count for regions beyond our block count
+      Counts.push_back(EntryCount / (i + 1));
     }
   }
-  
-  return std::nullopt;
+
+  LLVM_DEBUG({
+    dbgs() << "Heuristic counter assignment for " << F.getName() << ":\n";
+    for (unsigned i = 0; i < Counts.size(); ++i) {
+      dbgs() << "  Counter[" << i << "] = " << Counts[i] << "\n";
+    }
+  });
 }
 
 /// Convert BlockFrequencyInfo frequencies to execution counts.
@@ -127,13 +259,23 @@ static std::optional<unsigned> tryExtractCounterCount(const Module &M, const Fun
 /// layout from the coverage mapping.
 ///
 /// Note:
-/// - For instrumented IR: We match the counter count from __profd_, use scaled BFI
+/// - For instrumented IR: Every counter gets the scaled BFI count of the
+///   block(s) that increment it (see CounterAssignment.h)
 /// - For non-instrumented IR: We create one counter per basic block with BFI frequencies
 /// 
 /// All frequencies are scaled relative to the entry block frequency to produce
-/// realistic execution count estimates.
-static bool convertBFIToCounts(const Module &M, const Function &F, const BlockFrequencyInfo &BFI,
-                                std::vector<uint64_t> &Counts) {
+/// realistic execution count estimates (see FrequencyScaler). \p Refinement,
+/// if not null, corrects them for the trip counts of their loops first.
+///
+/// \p Scratch is reused across calls, so \p Counts, sized exactly once, is
+/// the only allocation in steady state.
+static bool convertBFIToCounts(const Function &F,
+                               const FunctionProfileInfo &Info,
+                               const CoverageRecordIndex &Index,
+                               const BlockFrequencyInfo &BFI,
+                               const LoopTripCountRefinement *Refinement,
+                               CounterScratch &Scratch,
+                               std::vector<uint64_t> &Counts) {
   const BasicBlock &EntryBB = F.getEntryBlock();
   BlockFrequency EntryFreq = BFI.getBlockFreq(&EntryBB);
   
@@ -144,60 +286,32 @@ static bool convertBFIToCounts(const Module &M, const Function &F, const BlockFr
   }
 
   Counts.clear();
-  
-  auto InstrCounterCount = tryExtractCounterCount(M, F);
+  FrequencyScaler Scaler(Info.EntryCount, EntryFreq.getFrequency());
+
+  std::optional<unsigned> InstrCounterCount;
+  if (Info.Instr)
+    InstrCounterCount = Info.Instr->NumCounters;
   
   if (InstrCounterCount) {
     // IR is instrumented - match the counter layout from coverage mapping
-    // 
-    // Note: Proper implementation would parse the coverage mapping to understand
-    // which counters correspond to which regions, then map BFI blocks to those
-    // regions. For now, we use a simplified approach:
-    // - Counter 0: Entry block execution count
-    // - Remaining counters: Scaled based on average block frequency
-    //
-    // This is a heuristic that works reasonably well for basic coverage estimation
-    // but doesn't capture the precise counter-to-region mapping.
-    
     LLVM_DEBUG(dbgs() << "Function " << F.getName() << " has " << *InstrCounterCount 
                       << " instrumented counters\n");
-    
-    // Collect all block frequencies and sort them
-    std::vector<uint64_t> BlockFreqs;
-    BlockFreqs.reserve(std::distance(F.begin(), F.end()));
-    
-    for (const BasicBlock &BB : F) {
-      BlockFrequency BBFreq = BFI.getBlockFreq(&BB);
-      uint64_t ScaledCount = (DefaultEntryCount * BBFreq.getFrequency()) / 
-                             EntryFreq.getFrequency();
-      BlockFreqs.push_back(ScaledCount);
-    }
-    
-    // Sort in descending order to assign higher counts to early counters
-    std::sort(BlockFreqs.rbegin(), BlockFreqs.rend());
-    
-    // Assign counts to instrumentation counters
-    // Counter 0 always gets entry count
-    Counts.push_back(DefaultEntryCount);
-    
-    // Distribute remaining block frequencies to counters
-    // If we have more counters than blocks, pad with progressively lower counts
-    // If we have fewer counters than blocks, use the highest frequency blocks
-    for (unsigned i = 1; i < *InstrCounterCount; ++i) {
-      if (i < BlockFreqs.size()) {
-        Counts.push_back(BlockFreqs[i]);
-      } else {
-        // We pad with scaled-down entry count for regions beyond our block count
-        Counts.push_back(DefaultEntryCount / (i + 1));
-      }
-    }
-    
-    LLVM_DEBUG({
-      dbgs() << "Counter assignment for " << F.getName() << ":\n";
-      for (unsigned i = 0; i < Counts.size(); ++i) {
-        dbgs() << "  Counter[" << i << "] = " << Counts[i] << "\n";
-      }
-    });
+
+    // Scale every block once, up front; counter sites and the fallback below
+    // only look the counts up.
+    SmallVectorImpl<uint64_t> &BlockCounts = Scratch.BlockCounts;
+    BlockCounts.assign(F.getMaxBlockNumber(), 0);
+    for (const BasicBlock &BB : F)
+      BlockCounts[BB.getNumber()] = getBlockFreq(BB, BFI, Refinement);
+    Scaler.scale(BlockCounts, BlockCounts.data());
+
+    auto BlockCount = [&](const BasicBlock &BB) {
+      return BlockCounts[BB.getNumber()];
+    };
+    if (!assignInstrumentationCounters(F, Info.PGOName, *Info.Instr, Index,
+                                       BlockCount, Scratch, Counts))
+      assignCountersBySortedFrequency(F, Scaler, *InstrCounterCount, Scratch,
+                                      Counts);
     
   } else {
     // If no instrumentation, then we  use one counter per basic block.
@@ -207,95 +321,1157 @@ static bool convertBFIToCounts(const Module &M, const Function &F, const BlockFr
     LLVM_DEBUG(dbgs() << "Function " << F.getName() 
                       << " has no instrumentation, using per-block counters\n");
     
-    for (const BasicBlock &BB : F) {
-      BlockFrequency BBFreq = BFI.getBlockFreq(&BB);
-      uint64_t Count = (DefaultEntryCount * BBFreq.getFrequency()) / 
-                       EntryFreq.getFrequency();
-      Counts.push_back(Count);
-      
-      LLVM_DEBUG(dbgs() << "  BB " << BB.getName() << ": freq=" 
-                        << BBFreq.getFrequency() << " → count=" << Count << "\n");
-    }
+    SmallVectorImpl<uint64_t> &Freqs = Scratch.Freqs;
+    collectBlockFrequencies(F, BFI, Refinement, Freqs);
+    Counts.resize(Freqs.size());
+    Scaler.scale(Freqs, Counts.data());
+
+    LLVM_DEBUG({
+      unsigned I = 0;
+      for (const BasicBlock &BB : F) {
+        dbgs() << "  BB " << BB.getName() << ": freq=" << Freqs[I]
+               << " → count=" << Counts[I] << "\n";
+        ++I;
+      }
+    });
   }
   
   return !Counts.empty();
 }
 
-PreservedAnalyses StaticProfileExporterPass::run(Module &M,
-                                                  ModuleAnalysisManager &MAM) {
-  if (ProfilePath.empty()) {
-    errs() << "Warning: No profile output path specified\n";
-    return PreservedAnalyses::all();
+/// Path of the source file that defines \p F, whose PGO name hashes to
+/// \p NameHash: the file of its DISubprogram, or else the main file of its
+/// coverage mapping. Empty if neither is available.
+static std::string getSourceFile(const Function &F, uint64_t NameHash,
+                                 const CoverageRecordIndex &Index,
+                                 CounterScratch &Scratch) {
+  if (const DISubprogram *SP = F.getSubprogram()) {
+    StringRef Filename = SP->getFilename();
+    if (sys::path::is_absolute(Filename) || SP->getDirectory().empty())
+      return Filename.str();
+    SmallString<256> Path(SP->getDirectory());
+    sys::path::append(Path, Filename);
+    return std::string(Path);
   }
 
-  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  if (const InstrumentedFunctionRecord *Instr = Index.lookup(NameHash)) {
+    if (Error Err = Index.readMapping(*Instr, Scratch.Expressions,
+                                      Scratch.Regions, &Scratch.Filenames)) {
+      consumeError(std::move(Err));
+      return "";
+    }
+    if (!Scratch.Filenames.empty())
+      return Scratch.Filenames.front().str();
+  }
+  return "";
+}
+
+/// Whether \p Filter accepts \p F. A lazily loaded body is only materialized
+/// when a file rule needs its debug info and the coverage mapping does not
+/// name the file; \p Loaded is set if it was.
+static bool isExported(Function &F, uint64_t NameHash,
+                       const FunctionFilter &Filter,
+                       const CoverageRecordIndex &Index,
+                       CounterScratch &Scratch, bool &Loaded) {
+  return Filter.accepts(F, NameHash, [&]() -> std::string {
+    std::string File = getSourceFile(F, NameHash, Index, Scratch);
+    if (!File.empty() || !F.isMaterializable())
+      return File;
+    if (Error Err = F.materialize()) {
+      LLVM_DEBUG(dbgs() << "Cannot load " << F.getName()
+                        << " for the file filters: "
+                        << toString(std::move(Err)) << "\n");
+      consumeError(std::move(Err));
+      return "";
+    }
+    Loaded = true;
+    return getSourceFile(F, NameHash, Index, Scratch);
+  });
+}
+
+namespace {
+
+/// The analyses behind a BlockFrequencyInfo computed without an analysis
+/// manager. This mirrors what BlockFrequencyAnalysis pulls out of the FAM, so
+/// a function gets the same frequencies on either path. With \p WuLarus, the
+/// branch probabilities come from the Wu-Larus heuristics instead.
+struct StandaloneBFI {
+  DominatorTree DT;
+  PostDominatorTree PDT;
+  LoopInfo LI;
+  BranchProbabilityInfo BPI;
+  BlockFrequencyInfo BFI;
+
+  StandaloneBFI(Function &F, const TargetLibraryInfo &TLI, bool WuLarus)
+      : DT(F), PDT(F), LI(DT) {
+    if (WuLarus)
+      computeWuLarusProbabilities(F, LI, PDT, BPI);
+    else
+      BPI.calculate(F, LI, &TLI, &DT, &PDT);
+    BFI.calculate(F, BPI, LI);
+  }
+};
+
+/// Provides the block frequencies of one function at a time, from \p FAM
+/// when there is one and computed with \p TLII otherwise. A result is valid
+/// until the next call.
+class FunctionBFI {
+  FunctionAnalysisManager *FAM;
+  const TargetLibraryInfoImpl *TLII;
+  bool WuLarus;
+
+  std::optional<TargetLibraryInfo> TLI;
+  std::optional<StandaloneBFI> Standalone;
+  // Wu-Larus frequencies computed on top of the loops and postdominators
+  // cached in FAM.
+  std::optional<BranchProbabilityInfo> BPI;
+  BlockFrequencyInfo BFI;
+  // Trip counts of the loops of Standalone.
+  std::optional<AssumptionCache> AC;
+  std::optional<ScalarEvolution> SE;
+  LoopTripCountRefinement Refinement;
+
+public:
+  FunctionBFI(FunctionAnalysisManager *FAM, const TargetLibraryInfoImpl *TLII,
+              bool WuLarus)
+      : FAM(FAM), TLII(TLII), WuLarus(WuLarus) {}
+
+  const BlockFrequencyInfo &get(Function &F) {
+    if (FAM && !WuLarus)
+      return FAM->getResult<BlockFrequencyAnalysis>(F);
+    if (FAM) {
+      const LoopInfo &LI = FAM->getResult<LoopAnalysis>(F);
+      BPI.emplace();
+      computeWuLarusProbabilities(
+          F, LI, FAM->getResult<PostDominatorTreeAnalysis>(F), *BPI);
+      BFI.calculate(F, *BPI, LI);
+      return BFI;
+    }
+    SE.reset();
+    AC.reset();
+    Standalone.reset();
+    TLI.emplace(*TLII, &F);
+    Standalone.emplace(F, *TLI, WuLarus);
+    return Standalone->BFI;
+  }
+
+  /// The trip count corrections of \p BFI, the result of the last get(F)
+  /// (see LoopTripCountRefinement.h). Valid until the next call of either.
+  const LoopTripCountRefinement &refine(Function &F,
+                                        const BlockFrequencyInfo &BFI) {
+    if (FAM) {
+      Refinement.compute(F, FAM->getResult<LoopAnalysis>(F),
+                         FAM->getResult<ScalarEvolutionAnalysis>(F), BFI);
+      return Refinement;
+    }
+    AC.emplace(F);
+    SE.emplace(F, *TLI, *AC, Standalone->DT, Standalone->LI);
+    Refinement.compute(F, Standalone->LI, *SE, BFI);
+    return Refinement;
+  }
+};
 
-  InstrProfWriter Writer;
-  unsigned FunctionsProcessed = 0;
-  unsigned FunctionsSkipped = 0;
+} // end anonymous namespace
+
+/// Compute the key of the cache entry of \p F from everything its record is
+/// derived from: the IR of the body, the callees whose attributes and names
+/// steer branch probabilities, the instrumentation records, the scaling and
+/// the branch probability engine, the target, whose library functions and
+/// data layout the analyses depend on, and the versions of CASP and LLVM.
+static uint64_t
+computeStaticProfileCacheKey(const Function &F, const FunctionProfileInfo &Info,
+                             const StaticProfileExporterOptions &Opts) {
+  SmallVector<stable_hash, 16> Parts = {
+      StaticProfileCache::Version,
+      xxh3_64bits(LLVM_VERSION_STRING),
+      xxh3_64bits(F.getParent()->getTargetTriple()),
+      xxh3_64bits(F.getParent()->getDataLayoutStr()),
+      Opts.WuLarusHeuristics,
+      Opts.RefineLoopTripCounts,
+      Info.EntryCount,
+      xxh3_64bits(Info.IRPGOName),
+      StructuralHash(F, /*DetailedHash=*/true)};
+
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB)
+      if (const auto *CB = dyn_cast<CallBase>(&I)) {
+        const Function *Callee = CB->getCalledFunction();
+        Parts.push_back(Callee ? xxh3_64bits(Callee->getName()) : 0);
+        Parts.push_back(CB->doesNotReturn());
+        Parts.push_back(CB->hasFnAttr(Attribute::Cold));
+      }
+
+  if (const InstrumentedFunctionRecord *Instr = Info.Instr) {
+    Parts.push_back(Instr->StructHash.value_or(0));
+    Parts.push_back(Instr->NumCounters.value_or(0));
+    Parts.push_back(xxh3_64bits(Instr->MappingData));
+  }
+
+  return stable_hash_combine(Parts);
+}
+
+/// Seconds elapsed since \p Start.
+static double secondsSince(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       Start)
+      .count();
+}
+
+/// Record that \p F took \p Seconds to analyze in \p Stats, if it may be one
+/// of the N slowest functions.
+static void recordFunctionTime(StaticProfileStats &Stats, unsigned N,
+                               const Function &F, StringRef Name,
+                               double Seconds) {
+  std::vector<StaticProfileStats::FunctionTime> &Slowest =
+      Stats.SlowestFunctions;
+  Slowest.push_back({Seconds, static_cast<unsigned>(F.size()), Name.str()});
+  // Trim in batches, so that recording a function stays cheap.
+  if (Slowest.size() < 2 * N)
+    return;
+  auto Slower = [](const StaticProfileStats::FunctionTime &L,
+                   const StaticProfileStats::FunctionTime &R) {
+    return L.Seconds > R.Seconds;
+  };
+  std::nth_element(Slowest.begin(), Slowest.begin() + (N - 1), Slowest.end(),
+                   Slower);
+  Slowest.resize(N);
+}
+
+void printSlowestFunctions(raw_ostream &OS, const StaticProfileStats &Stats,
+                           unsigned N) {
+  std::vector<const StaticProfileStats::FunctionTime *> Slowest;
+  for (const StaticProfileStats::FunctionTime &T : Stats.SlowestFunctions)
+    Slowest.push_back(&T);
+  llvm::stable_sort(Slowest, [](const StaticProfileStats::FunctionTime *L,
+                                const StaticProfileStats::FunctionTime *R) {
+    return L->Seconds > R->Seconds;
+  });
+  if (Slowest.size() > N)
+    Slowest.resize(N);
+  if (Slowest.empty())
+    return;
+
+  OS << "Slowest " << Slowest.size() << " function(s) to analyze:\n";
+  for (const StaticProfileStats::FunctionTime *T : Slowest)
+    OS << format("  %10.3f ms %8u blocks  ", T->Seconds * 1e3, T->Blocks)
+       << T->Name << "\n";
+}
+
+/// Add \p Counts, the counters of \p F, to the frequency file of \p Opts if
+/// there is one and they are per-block counts of the current body.
+static void addBlockFrequencies(const Function &F,
+                                const FunctionProfileInfo &Info,
+                                ArrayRef<uint64_t> Counts,
+                                const StaticProfileExporterOptions &Opts) {
+  if (Opts.Frequencies && !Info.Instr && Counts.size() == F.size())
+    Opts.Frequencies->addFunction(
+        F, IndexedInstrProf::ComputeHash(Info.IRPGOName), Counts);
+}
 
+/// Compute the record of \p F, or load it from \p Cache if it holds one for
+/// the same inputs. \p Analyses are only computed on a cache miss. Cache hits, the
+/// blocks analyzed and the time spent are added to \p Stats. \p Timed is
+/// false on worker threads (see StaticProfilePhase). \p Scratch belongs to
+/// the calling thread.
+static std::optional<StaticFunctionProfile>
+computeFunctionProfile(Function &F, const FunctionProfileInfo &Info,
+                       const CoverageRecordIndex &Index,
+                       const StaticProfileCache &Cache,
+                       const StaticProfileExporterOptions &Opts,
+                       FunctionBFI &Analyses,
+                       CounterScratch &Scratch, StaticProfileStats &Stats,
+                       bool Timed) {
+  StaticFunctionProfile Profile;
+  Profile.Name = Info.IRPGOName;
+
+  uint64_t Key = 0;
+  if (Cache.isEnabled()) {
+    Key = computeStaticProfileCacheKey(F, Info, Opts);
+    if (Cache.lookup(Key, Profile.Hash, Profile.Counts)) {
+      LLVM_DEBUG(dbgs() << "Loaded cached profile for " << F.getName()
+                        << "\n");
+      ++Stats.CacheHits;
+      addBlockFrequencies(F, Info, Profile.Counts, Opts);
+      return Profile;
+    }
+  }
+
+  auto Start = std::chrono::steady_clock::now();
+  const BlockFrequencyInfo *BFI;
+  const LoopTripCountRefinement *Refinement = nullptr;
+  {
+    StaticProfilePhase Phase("ComputeBFI", "Compute block frequencies",
+                             F.getName(), Timed);
+    BFI = &Analyses.get(F);
+    if (Opts.RefineLoopTripCounts)
+      Refinement = &Analyses.refine(F, *BFI);
+  }
+  double BFISeconds = secondsSince(Start);
+  Stats.BFISeconds += BFISeconds;
+  Stats.BlocksAnalyzed += F.size();
+
+  Start = std::chrono::steady_clock::now();
+  bool Converted;
+  {
+    StaticProfilePhase Phase("ConvertBFIToCounts",
+                             "Convert block frequencies to counts",
+                             F.getName(), Timed);
+    Converted =
+        convertBFIToCounts(F, Info, Index, *BFI, Refinement, Scratch,
+                           Profile.Counts);
+  }
+  double ConvertSeconds = secondsSince(Start);
+  Stats.ConvertSeconds += ConvertSeconds;
+  if (Opts.SlowestFunctions)
+    recordFunctionTime(Stats, Opts.SlowestFunctions, F, Profile.Name,
+                       BFISeconds + ConvertSeconds);
+  if (!Converted)
+    return std::nullopt;
+  Profile.Hash = computeFunctionHash(F, Info);
+  addBlockFrequencies(F, Info, Profile.Counts, Opts);
+
+  if (Cache.isEnabled())
+    Cache.store(Key, Profile.Hash, Profile.Counts);
+  return Profile;
+}
+
+/// Compute the profile records of \p Defined on a pool of worker threads and
+/// hand them to \p Consume on the calling thread, in module order.
+///
+/// Analyses are not thread-safe within a single LLVMContext (value handles
+/// register themselves in the context), so the module is serialized to
+/// bitcode once, unless it was lazily loaded from \p SourceBitcode, and every
+/// worker lazily loads its own copy into a private context. Workers pull
+/// function indices from a shared counter, materialize only the bodies they
+/// analyze and free them right after. \p Positions holds the position of each
+/// function of \p Defined in the function list of \p M. The instrumentation
+/// records are looked up in \p Index, which belongs to \p M and is only read.
+/// \p EntryCounts, if not empty, holds the propagated entry counts of
+/// \p Defined. Cache hits, blocks and analysis times of the workers are added
+/// to \p WorkerStats once they are done.
+///
+/// Finished records are consumed as soon as every earlier function is done,
+/// and workers stay within a fixed window ahead of the consumer, so the
+/// number of records held at once does not grow with the module.
+///
+/// Returns the number of functions consumed. It is less than Defined.size()
+/// only if a worker failed, in which case the caller finishes the rest.
+static size_t computeProfilesInParallel(
+    const Module &M, ArrayRef<Function *> Defined, ArrayRef<size_t> Positions,
+    std::optional<MemoryBufferRef> SourceBitcode,
+    const CoverageRecordIndex &Index, const StaticProfileCache &Cache,
+    const StaticProfileExporterOptions &Opts, ArrayRef<uint64_t> EntryCounts,
+    StaticProfileStats &WorkerStats,
+    function_ref<void(size_t, std::optional<StaticFunctionProfile> &&)> Consume) {
+  SmallVector<char, 0> Bitcode;
+  MemoryBufferRef BitcodeRef;
+  if (SourceBitcode) {
+    BitcodeRef = *SourceBitcode;
+  } else {
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+    BitcodeRef = MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                                 M.getModuleIdentifier());
+  }
+
+  // Workers run on the caller's pool if there is one, so that long-running
+  // clients do not start threads for every module.
+  std::optional<DefaultThreadPool> OwnPool;
+  ThreadPoolInterface *Pool = Opts.Pool;
+  if (!Pool)
+    Pool = &OwnPool.emplace(hardware_concurrency(Opts.Threads));
+  unsigned NumWorkers =
+      std::min<size_t>(Pool->getMaxConcurrency(), Defined.size());
+  const size_t Window = std::max<size_t>(64, 16 * NumWorkers);
+
+  // Everything below is guarded by Mutex.
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::vector<std::optional<StaticFunctionProfile>> Results(Defined.size());
+  std::vector<bool> Ready(Defined.size(), false);
+  size_t NextFunction = 0;
+  size_t Consumed = 0;
+  unsigned ActiveWorkers = NumWorkers;
+  bool Failed = false;
+  StaticProfileStats Totals;
+
+  auto ReportError = [&](Error Err) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (!Failed)
+      errs() << "Warning: Parallel static profile worker failed: "
+             << toString(std::move(Err)) << "\n";
+    else
+      consumeError(std::move(Err));
+    Failed = true;
+  };
+
+  auto Work = [&](StaticProfileStats &Stats) {
+    LLVMContext Ctx;
+    Expected<std::unique_ptr<Module>> WMOrErr =
+        getLazyBitcodeModule(BitcodeRef, Ctx);
+    if (!WMOrErr)
+      return ReportError(WMOrErr.takeError());
+    Module &WM = **WMOrErr;
+    if (Error Err = WM.materializeMetadata())
+      return ReportError(std::move(Err));
+
+    // Bitcode preserves function order, so the Nth function here is the Nth
+    // function of the original module.
+    std::vector<Function *> WorkerFunctions;
+    WorkerFunctions.reserve(M.size());
+    for (Function &F : WM)
+      WorkerFunctions.push_back(&F);
+    if (WorkerFunctions.size() != M.size())
+      return ReportError(createStringError(inconvertibleErrorCode(),
+                                           "function list mismatch after "
+                                           "bitcode round trip"));
+
+    TargetLibraryInfoImpl TLII(Triple(WM.getTargetTriple()));
+    FunctionProfileInfo Info;
+    CounterScratch Scratch;
+    while (true) {
+      size_t I;
+      {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        Changed.wait(Lock, [&] {
+          return Failed || NextFunction >= Defined.size() ||
+                 NextFunction < Consumed + Window;
+        });
+        if (Failed || NextFunction >= Defined.size())
+          return;
+        I = NextFunction++;
+      }
+
+      Function &F = *WorkerFunctions[Positions[I]];
+      if (Error Err = F.materialize())
+        return ReportError(std::move(Err));
+
+      std::optional<StaticFunctionProfile> Result;
+      {
+        computeFunctionProfileInfo(F, Index, Opts, Info);
+        if (!EntryCounts.empty())
+          Info.EntryCount = EntryCounts[I];
+        FunctionBFI BFI(/*FAM=*/nullptr, &TLII, Opts.WuLarusHeuristics);
+        Result = computeFunctionProfile(F, Info, Index, Cache, Opts, BFI,
+                                        Scratch, Stats, /*Timed=*/false);
+      }
+
+      // The body is not needed anymore; drop it to bound worker memory.
+      F.deleteBody();
+
+      {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Results[I] = std::move(Result);
+        Ready[I] = true;
+      }
+      Changed.notify_all();
+    }
+  };
+
+  ThreadPoolTaskGroup Workers(*Pool);
+  for (unsigned W = 0; W != NumWorkers; ++W) {
+    Workers.async([&] {
+      StaticProfileStats Stats;
+      Work(Stats);
+      {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Totals += Stats;
+        --ActiveWorkers;
+      }
+      Changed.notify_all();
+    });
+  }
+
+  size_t I = 0;
+  for (size_t E = Defined.size(); I != E; ++I) {
+    std::optional<StaticFunctionProfile> Result;
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+      Changed.wait(Lock, [&] { return Ready[I] || ActiveWorkers == 0; });
+      if (!Ready[I])
+        break;
+      Result = std::move(Results[I]);
+      Results[I].reset();
+      ++Consumed;
+    }
+    Changed.notify_all();
+    Consume(I, std::move(Result));
+  }
+  Workers.wait();
+
+  WorkerStats += Totals;
+  return I;
+}
+
+StaticProfileCapture::StaticProfileCapture() = default;
+StaticProfileCapture::~StaticProfileCapture() = default;
+
+void StaticProfileCapture::capture(Function &F, FunctionAnalysisManager &FAM,
+                                   const StaticProfileExporterOptions &Opts) {
+  const Module *M = F.getParent();
+  if (M != IndexedModule) {
+    // Nothing captured for another module applies to this one.
+    EntryIndex.clear();
+    Entries.clear();
+    Index = std::make_unique<CoverageRecordIndex>(*M);
+    Scratch = std::make_unique<CounterScratch>();
+    IndexedModule = M;
+  }
+
+  // The exporter drops filtered functions; do not analyze them here either.
+  bool Loaded = false;
+  if (Opts.Filter &&
+      !isExported(F, IndexedInstrProf::ComputeHash(getProfileName(F)),
+                  *Opts.Filter, *Index, *Scratch, Loaded))
+    return;
+
+  FunctionProfileInfo Info;
+  std::vector<uint64_t> Counts;
+  if (std::optional<InstrProfRecord> Record =
+          lookupBaseRecord(F, *Index, Opts, Info)) {
+    // The exporter takes the record from the base profile; keep its counts
+    // here in case F is removed before the export.
+    Counts = std::move(Record->Counts);
+  } else {
+    // Computing the analysis on a miss caches it for the passes that follow.
+    // Cached frequencies come from BranchProbabilityInfo, so the Wu-Larus
+    // engine only reuses the loops and postdominators they were built on.
+    FunctionBFI WuLarusBFI(&FAM, /*TLII=*/nullptr, /*WuLarus=*/true);
+    const BlockFrequencyInfo *BFI = nullptr;
+    if (Opts.WuLarusHeuristics) {
+      BFI = &WuLarusBFI.get(F);
+      ++ComputedBFI;
+    } else if ((BFI = FAM.getCachedResult<BlockFrequencyAnalysis>(F))) {
+      ++ReusedBFI;
+    } else {
+      BFI = &FAM.getResult<BlockFrequencyAnalysis>(F);
+      ++ComputedBFI;
+    }
+
+    // The loops and their trip counts come from FAM on either engine.
+    const LoopTripCountRefinement *Refinement = nullptr;
+    if (Opts.RefineLoopTripCounts)
+      Refinement = &WuLarusBFI.refine(F, *BFI);
+
+    computeFunctionProfileInfo(F, *Index, Opts, Info);
+    if (!convertBFIToCounts(F, Info, *Index, *BFI, Refinement, *Scratch,
+                            Counts)) {
+      LLVM_DEBUG(dbgs() << "Failed to capture profile of " << F.getName()
+                        << ", leaving it to the exporter\n");
+      return;
+    }
+  }
+
+  auto [It, Inserted] = EntryIndex.try_emplace(Info.IRPGOName, Entries.size());
+  if (Inserted)
+    Entries.emplace_back();
+  Entries[It->second].Profile = StaticFunctionProfile{
+      Info.IRPGOName, computeFunctionHash(F, Info), std::move(Counts)};
+}
+
+StaticFunctionProfile *StaticProfileCapture::take(StringRef Name) {
+  auto It = EntryIndex.find(Name);
+  if (It == EntryIndex.end())
+    return nullptr;
+  Entry &E = Entries[It->second];
+  if (E.Exported)
+    return nullptr;
+  E.Exported = true;
+  return &E.Profile;
+}
+
+void StaticProfileCapture::flushRemaining(StaticProfileRecordSink Sink,
+                                          StaticProfileStats &Stats) {
+  // Whatever was not taken belongs to functions removed after the capture,
+  // typically local functions inlined into all of their callers. Coverage
+  // still maps their regions, so keep their records.
+  for (Entry &E : Entries) {
+    if (E.Exported)
+      continue;
+    LLVM_DEBUG(dbgs() << "Adding captured profile of removed function "
+                      << E.Profile.Name << "\n");
+    Sink(nullptr, NamedInstrProfRecord(E.Profile.Name, E.Profile.Hash,
+                                       std::move(E.Profile.Counts)));
+    ++Stats.FunctionsProcessed;
+  }
+
+  LLVM_DEBUG(dbgs() << "Captured block frequencies: " << ReusedBFI
+                    << " reused, " << ComputedBFI << " computed\n");
+
+  EntryIndex.clear();
+  Entries.clear();
+  Index.reset();
+  IndexedModule = nullptr;
+  ReusedBFI = ComputedBFI = 0;
+}
+
+PreservedAnalyses StaticProfileCapturePass::run(Function &F,
+                                                FunctionAnalysisManager &FAM) {
+  if (!F.isDeclaration())
+    Capture->capture(F, FAM, Options);
+  return PreservedAnalyses::all();
+}
+
+/// Collect the calls of the functions \p All of \p M into \p Calls, indexed
+/// like \p All, on the threads of \p Opts. Every worker loads its own copy of
+/// \p M from \p Bitcode and holds one function body at a time, so neither the
+/// bodies nor their analyses accumulate; \p Positions are the positions of
+/// \p All in the function list. Returns false if a worker failed.
+static bool collectCallsInParallel(const Module &M, ArrayRef<Function *> All,
+                                   ArrayRef<size_t> Positions,
+                                   MemoryBufferRef Bitcode,
+                                   const StaticProfileExporterOptions &Opts,
+                                   std::vector<FunctionCalls> &Calls) {
+  std::mutex Mutex;
+  std::atomic<size_t> NextFunction{0};
+  std::atomic<bool> Failed{false};
+
+  auto ReportError = [&](Error Err) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (!Failed.exchange(true))
+      errs() << "Warning: Entry count propagation worker failed: "
+             << toString(std::move(Err)) << "\n";
+    else
+      consumeError(std::move(Err));
+  };
+
+  auto Work = [&] {
+    LLVMContext Ctx;
+    Expected<std::unique_ptr<Module>> WMOrErr =
+        getLazyBitcodeModule(Bitcode, Ctx);
+    if (!WMOrErr)
+      return ReportError(WMOrErr.takeError());
+    Module &WM = **WMOrErr;
+    if (Error Err = WM.materializeMetadata())
+      return ReportError(std::move(Err));
+
+    // Bitcode preserves function order, so the Nth function here is the Nth
+    // function of the original module.
+    std::vector<Function *> WorkerFunctions;
+    WorkerFunctions.reserve(M.size());
+    for (Function &F : WM)
+      WorkerFunctions.push_back(&F);
+    if (WorkerFunctions.size() != M.size())
+      return ReportError(createStringError(inconvertibleErrorCode(),
+                                           "function list mismatch after "
+                                           "bitcode round trip"));
+    DenseMap<const Function *, unsigned> Ids;
+    Ids.reserve(All.size());
+    for (unsigned I = 0, E = All.size(); I != E; ++I)
+      Ids[WorkerFunctions[Positions[I]]] = I;
+
+    TargetLibraryInfoImpl TLII(Triple(WM.getTargetTriple()));
+    for (size_t I = NextFunction++; I < All.size() && !Failed;
+         I = NextFunction++) {
+      Function &F = *WorkerFunctions[Positions[I]];
+      if (Error Err = F.materialize())
+        return ReportError(std::move(Err));
+      FunctionBFI BFI(/*FAM=*/nullptr, &TLII, Opts.WuLarusHeuristics);
+      collectFunctionCalls(F, BFI.get(F), Ids, Calls[I]);
+      F.deleteBody();
+    }
+  };
+
+  if (Opts.Threads == 1) {
+    Work();
+    return !Failed;
+  }
+
+  std::optional<DefaultThreadPool> OwnPool;
+  ThreadPoolInterface *Pool = Opts.Pool;
+  if (!Pool)
+    Pool = &OwnPool.emplace(hardware_concurrency(Opts.Threads));
+  ThreadPoolTaskGroup Workers(*Pool);
+  for (unsigned W = 0, E = std::min<size_t>(Pool->getMaxConcurrency(),
+                                            All.size());
+       W != E; ++W)
+    Workers.async(Work);
+  Workers.wait();
+  return !Failed;
+}
+
+/// Propagate entry counts from callers to callees (see EntryCountPropagation.h)
+/// and store those of \p Defined in \p EntryCounts. The call graph spans every
+/// defined function of \p M, filtered out or not, so every body is analyzed.
+///
+/// Without \p FAM, the calls are collected by collectCallsInParallel from
+/// \p SourceBitcode, or from \p M serialized when it runs on several threads,
+/// so lazily loaded bodies of \p M stay unloaded until the export needs them;
+/// only a lazily loaded module without its bitcode is loaded whole. With
+/// \p FAM, the block frequencies are those the export reuses. \p TLII is
+/// used without one. \p EntryCounts stays empty if the module cannot be
+/// loaded.
+static void
+computePropagatedEntryCounts(Module &M, ArrayRef<Function *> Defined,
+                             FunctionAnalysisManager *FAM,
+                             const TargetLibraryInfoImpl *TLII,
+                             const StaticProfileExporterOptions &Opts,
+                             std::optional<MemoryBufferRef> SourceBitcode,
+                             std::vector<uint64_t> &EntryCounts) {
+  std::vector<Function *> All;
+  std::vector<size_t> Positions;
+  size_t Position = 0;
+  for (Function &F : M) {
+    if (!F.isDeclaration()) {
+      All.push_back(&F);
+      Positions.push_back(Position);
+    }
+    ++Position;
+  }
+
+  std::vector<FunctionCalls> Calls(All.size());
+  bool InPlace =
+      FAM || (!SourceBitcode && (Opts.Threads == 1 || All.size() <= 1));
+  // Serializing a lazily loaded module needs every body as well.
+  if (!SourceBitcode) {
+    if (Error Err = M.materializeAll()) {
+      errs() << "Warning: Cannot load module for entry count propagation: "
+             << toString(std::move(Err)) << "\n";
+      return;
+    }
+  }
+
+  if (InPlace) {
+    DenseMap<const Function *, unsigned> Ids;
+    Ids.reserve(All.size());
+    for (unsigned I = 0, E = All.size(); I != E; ++I)
+      Ids[All[I]] = I;
+    for (unsigned I = 0, E = All.size(); I != E; ++I) {
+      Function &F = *All[I];
+      if (Error Err = F.materialize()) {
+        errs() << "Warning: Cannot load function " << F.getName()
+               << " for entry count propagation: " << toString(std::move(Err))
+               << "\n";
+        return;
+      }
+      FunctionBFI BFI(FAM, TLII, Opts.WuLarusHeuristics);
+      collectFunctionCalls(F, BFI.get(F), Ids, Calls[I]);
+    }
+  } else {
+    SmallVector<char, 0> Bitcode;
+    MemoryBufferRef BitcodeRef;
+    if (SourceBitcode) {
+      BitcodeRef = *SourceBitcode;
+    } else {
+      raw_svector_ostream OS(Bitcode);
+      WriteBitcodeToFile(M, OS);
+      BitcodeRef = MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                                   M.getModuleIdentifier());
+    }
+    if (!collectCallsInParallel(M, All, Positions, BitcodeRef, Opts, Calls))
+      return;
+  }
+
+  std::vector<uint64_t> AllCounts;
+  propagateEntryCounts(All, Calls, Opts.EntryCount, AllCounts);
+
+  // Both lists are in module order and Defined is a subset of All.
+  EntryCounts.reserve(Defined.size());
+  size_t J = 0;
+  for (Function *F : Defined) {
+    while (All[J] != F)
+      ++J;
+    EntryCounts.push_back(AllCounts[J]);
+  }
+}
+
+StaticProfileStats
+exportStaticProfile(Module &M, FunctionAnalysisManager *FAM,
+                    const StaticProfileExporterOptions &Opts,
+                    StaticProfileRecordSink Sink, StaticProfileCapture *Capture,
+                    std::optional<MemoryBufferRef> SourceBitcode) {
+  TimeTraceScope ExportScope("StaticProfileExport", M.getModuleIdentifier());
+  StaticProfileStats Stats;
+
+  // Rank the records on their way out. The order functions are added in
+  // breaks ties, so clients that export modules concurrently leave Hotness
+  // unset and rank the records themselves in a fixed order.
+  auto RankingSink = [&Opts, Inner = Sink](const Function *F,
+                                           NamedInstrProfRecord &&Record) {
+    if (F)
+      Opts.Hotness->addFunction(F->getName(), Record.Counts);
+    Inner(F, std::move(Record));
+  };
+  if (Opts.Hotness)
+    Sink = RankingSink;
+
+  // Heap growth of the export is told apart by where it stays: the records
+  // are measured as the sink takes them, and the rest is held by analyses,
+  // or by function bodies loaded for them.
+  uint64_t HeapStart = Opts.StatsMemory ? getHeapUsageBytes() : 0;
+  auto MeasuringSink = [&Stats, Inner = Sink](const Function *F,
+                                              NamedInstrProfRecord &&Record) {
+    uint64_t Before = getHeapUsageBytes();
+    Inner(F, std::move(Record));
+    Stats.RecordBytes += getHeapGrowthBytes(Before);
+  };
+  if (Opts.StatsMemory)
+    Sink = MeasuringSink;
+  auto AnalysisBytes = [&] {
+    uint64_t Growth = getHeapGrowthBytes(HeapStart);
+    return Growth > Stats.RecordBytes ? Growth - Stats.RecordBytes : 0;
+  };
+  auto SampleAnalyses = [&] {
+    if (Opts.StatsMemory)
+      Stats.AnalysisPeakBytes =
+          std::max(Stats.AnalysisPeakBytes, AnalysisBytes());
+  };
+  auto FinishMemoryStats = [&] {
+    if (Opts.StatsMemory)
+      Stats.AnalysisRetainedBytes = AnalysisBytes();
+  };
+
+  // Captured records were scaled to per-function entry counts.
+  if (Opts.PropagateEntryCounts)
+    Capture = nullptr;
+
+  // Clients that export several modules at once time them on their own
+  // thread (see StaticProfilePhase).
+  const bool Timed = !Opts.OnWorkerThread;
+
+  std::optional<CoverageRecordIndex> IndexStorage;
+  if (!Opts.Index) {
+    StaticProfilePhase Phase("IndexCoverageRecords",
+                             "Index coverage and profile data records", "",
+                             Timed);
+    IndexStorage.emplace(M);
+  }
+  const CoverageRecordIndex &Index = Opts.Index ? *Opts.Index : *IndexStorage;
+  StaticProfileCache Cache(Opts.CacheDir);
+
+  // Functions of a lazily loaded module are not declarations until they are
+  // materialized, and names do not depend on the body, so the filters below
+  // only load a body when a file rule needs its debug info.
+  std::vector<Function *> Defined;
+  std::vector<size_t> Positions;
+  // Whether the function filter loaded the body, indexed like Defined.
+  std::vector<bool> LoadedByFilter;
+  // Name and hash of the copies claimed with KeepOne, indexed like Defined;
+  // the name is empty for functions that claimed nothing.
+  std::vector<std::pair<std::string, uint64_t>> Claims;
+  CounterScratch Scratch;
+  FunctionProfileInfo EarlyInfo;
+  size_t Position = 0;
   for (Function &F : M) {
+    size_t FPosition = Position++;
     if (F.isDeclaration()) {
       LLVM_DEBUG(dbgs() << "Skipping declaration: " << F.getName() << "\n");
       continue;
     }
+    uint64_t NameHash = 0;
+    if (Opts.InstrumentedOnly || Opts.Filter)
+      NameHash = IndexedInstrProf::ComputeHash(getProfileName(F));
+    if (Opts.InstrumentedOnly && !Index.lookup(NameHash)) {
+      LLVM_DEBUG(dbgs() << "Skipping uninstrumented function: " << F.getName()
+                        << "\n");
+      continue;
+    }
+    bool Loaded = false;
+    if (Opts.Filter &&
+        !isExported(F, NameHash, *Opts.Filter, Index, Scratch, Loaded)) {
+      LLVM_DEBUG(dbgs() << "Skipping filtered function: " << F.getName()
+                        << "\n");
+      if (Loaded)
+        F.deleteBody();
+      ++Stats.FunctionsFiltered;
+      continue;
+    }
+    // Copies taken from the base profile are deduplicated as well, or the
+    // writer would sum the same record once per module.
+    std::pair<std::string, uint64_t> Claim;
+    if (Opts.Dedup && Opts.Dedup->getPolicy() == DuplicatePolicy::KeepOne &&
+        StaticProfileDedup::mayBeDuplicated(F)) {
+      computeFunctionProfileInfo(F, Index, Opts, EarlyInfo);
+      uint64_t Hash = computeFunctionHash(F, EarlyInfo);
+      if (!Opts.Dedup->claim(EarlyInfo.IRPGOName, Hash)) {
+        LLVM_DEBUG(dbgs() << "Skipping copy of " << F.getName()
+                          << " exported by another module\n");
+        if (Loaded)
+          F.deleteBody();
+        continue;
+      }
+      Claim = {EarlyInfo.IRPGOName, Hash};
+    }
+    if (std::optional<InstrProfRecord> Record =
+            lookupBaseRecord(F, Index, Opts, EarlyInfo)) {
+      LLVM_DEBUG(dbgs() << "Using base profile record for " << F.getName()
+                        << "\n");
+      // The record replaces whatever was captured for F.
+      if (Capture)
+        Capture->take(EarlyInfo.IRPGOName);
+      NamedInstrProfRecord Named;
+      static_cast<InstrProfRecord &>(Named) = std::move(*Record);
+      Named.Name = EarlyInfo.IRPGOName;
+      Named.Hash = computeFunctionHash(F, EarlyInfo);
+      Sink(&F, std::move(Named));
+      ++Stats.FunctionsProcessed;
+      ++Stats.FunctionsFromBaseProfile;
+      if (Loaded)
+        F.deleteBody();
+      continue;
+    }
+    Defined.push_back(&F);
+    Positions.push_back(FPosition);
+    LoadedByFilter.push_back(Loaded);
+    Claims.push_back(std::move(Claim));
+  }
+
+  // A function that claimed its copy but gets no record leaves the copy to
+  // the next module that defines it.
+  auto Skip = [&](size_t I) {
+    ++Stats.FunctionsSkipped;
+    if (!Claims[I].first.empty())
+      Opts.Dedup->release(Claims[I].first, Claims[I].second);
+  };
 
-    // Get block frequency analysis for this function
-    BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+  std::optional<TargetLibraryInfoImpl> TLII;
+  if (!FAM)
+    TLII.emplace(Triple(M.getTargetTriple()));
+
+  // Entry counts propagated from callers, indexed like Defined.
+  std::vector<uint64_t> EntryCounts;
+  if (Opts.PropagateEntryCounts) {
+    StaticProfilePhase Phase("PropagateEntryCounts",
+                             "Propagate entry counts along the call graph", "",
+                             Timed);
+    computePropagatedEntryCounts(M, Defined, FAM, TLII ? &*TLII : nullptr,
+                                 Opts, SourceBitcode, EntryCounts);
+  }
 
-    // Convert BFI frequencies into execution counts
-    std::vector<uint64_t> Counts;
-    if (!convertBFIToCounts(M, F, BFI, Counts)) {
-      LLVM_DEBUG(dbgs() << "Failed to convert BFI to counts for " 
+  // Compute block frequencies on worker threads and merge the results here in
+  // module order, so the records do not depend on thread timing. Captured
+  // profiles make the extra threads pointless.
+  size_t Done = 0;
+  bool Parallel =
+      Opts.Threads != 1 && Defined.size() > 1 && (!Capture || Capture->empty());
+  if (Parallel && !SourceBitcode) {
+    // Serializing a lazily loaded module needs every body.
+    if (Error Err = M.materializeAll()) {
+      errs() << "Warning: Cannot load module for parallel static profile "
+                "generation: "
+             << toString(std::move(Err)) << "\n";
+      Parallel = false;
+    }
+  }
+  if (Parallel) {
+    // Worker threads are not traced and their phases are not timed one by
+    // one; their totals end up in Stats.
+    StaticProfilePhase Phase("ComputeProfilesInParallel",
+                             "Compute profiles on worker threads", "", Timed);
+    Done = computeProfilesInParallel(
+        M, Defined, Positions, SourceBitcode, Index, Cache, Opts, EntryCounts,
+        Stats,
+        [&](size_t I, std::optional<StaticFunctionProfile> &&P) {
+          if (!P) {
+            LLVM_DEBUG(dbgs() << "Failed to convert BFI to counts for "
+                              << Defined[I]->getName() << ", skipping\n");
+            Skip(I);
+            return;
+          }
+          SampleAnalyses();
+          Sink(Defined[I],
+               NamedInstrProfRecord(P->Name, P->Hash, std::move(P->Counts)));
+          ++Stats.FunctionsProcessed;
+        });
+    if (Done == Defined.size()) {
+      FinishMemoryStats();
+      return Stats;
+    }
+    errs() << "Warning: Finishing static profile generation on a single "
+              "thread\n";
+  }
+
+  FunctionProfileInfo Info;
+  for (size_t I = Done, E = Defined.size(); I != E; ++I) {
+    Function &F = *Defined[I];
+    TimeTraceScope FunctionScope("StaticProfileFunction", F.getName());
+    {
+      StaticProfilePhase Phase("ExtractFunctionHash",
+                               "Extract function names and hashes",
+                               F.getName(), Timed);
+      computeFunctionProfileInfo(F, Index, Opts, Info);
+    }
+    if (!EntryCounts.empty())
+      Info.EntryCount = EntryCounts[I];
+
+    if (Capture) {
+      if (StaticFunctionProfile *P = Capture->take(Info.IRPGOName)) {
+        LLVM_DEBUG(dbgs() << "Using captured profile for " << F.getName()
+                          << "\n");
+        addBlockFrequencies(F, Info, P->Counts, Opts);
+        Sink(&F, NamedInstrProfRecord(P->Name, P->Hash, std::move(P->Counts)));
+        ++Stats.FunctionsProcessed;
+        continue;
+      }
+    }
+
+    // Bodies of a lazily loaded module are only materialized for the
+    // analysis and dropped again once the record is out.
+    bool Materialized = F.isMaterializable() || LoadedByFilter[I];
+    if (F.isMaterializable()) {
+      if (Error Err = F.materialize()) {
+        errs() << "Warning: Cannot load function " << F.getName() << ": "
+               << toString(std::move(Err)) << "\n";
+        Skip(I);
+        continue;
+      }
+    }
+    auto DropBody = make_scope_exit([&] {
+      if (FAM && (Materialized || Opts.ClearAnalyses))
+        FAM->clear(F, F.getName());
+      if (Materialized)
+        F.deleteBody();
+    });
+
+    FunctionBFI BFI(FAM, TLII ? &*TLII : nullptr, Opts.WuLarusHeuristics);
+    std::optional<StaticFunctionProfile> P = computeFunctionProfile(
+        F, Info, Index, Cache, Opts, BFI, Scratch, Stats, Timed);
+    SampleAnalyses();
+    if (!P) {
+      LLVM_DEBUG(dbgs() << "Failed to convert BFI to counts for "
                         << F.getName() << ", skipping\n");
-      ++FunctionsSkipped;
+      Skip(I);
       continue;
     }
-    
-    // Get function name and hash for profile record
-    std::string FuncName = getIRPGOFuncName(F);
-    uint64_t FuncHash = computeFunctionHash(M, F);
-    
-    // Create and add profile record
-    NamedInstrProfRecord Record(FuncName, FuncHash, Counts);
-    
-    Writer.addRecord(std::move(Record), 1, [&](Error Err) {
-      errs() << "Warning: Failed to add profile record for " << F.getName() 
-             << ": " << toString(std::move(Err)) << "\n";
-      ++FunctionsSkipped;
-    });
-    
-    ++FunctionsProcessed;
-    LLVM_DEBUG(dbgs() << "Added profile for " << F.getName() << " (" 
-                      << Counts.size() << " counters)\n");
+
+    LLVM_DEBUG(dbgs() << "Added profile for " << F.getName() << " ("
+                      << P->Counts.size() << " counters)\n");
+
+    Sink(&F, NamedInstrProfRecord(P->Name, P->Hash, std::move(P->Counts)));
+    ++Stats.FunctionsProcessed;
   }
 
-  if (FunctionsProcessed == 0) {
-    errs() << "Warning: No functions processed for static profile generation\n";
-    if (FunctionsSkipped > 0) {
-      errs() << "  " << FunctionsSkipped << " function(s) were skipped due to errors\n";
+  if (Capture)
+    Capture->flushRemaining(Sink, Stats);
+
+  FinishMemoryStats();
+  return Stats;
+}
+
+void compareBranchProbabilityEngines(
+    Module &M, const StaticProfileExporterOptions &Opts,
+    function_ref<void(BranchEngineComparison &&)> Consume) {
+  // Small functions take microseconds to analyze, so keep the fastest of a
+  // few runs to filter out timer noise.
+  constexpr unsigned Runs = 3;
+
+  if (Error Err = M.materializeAll()) {
+    errs() << "Warning: Cannot load module for branch heuristic comparison: "
+           << toString(std::move(Err)) << "\n";
+    return;
+  }
+
+  CoverageRecordIndex Index(M);
+  TargetLibraryInfoImpl TLII{Triple(M.getTargetTriple())};
+  FunctionProfileInfo Info;
+  CounterScratch Scratch;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    uint64_t NameHash = IndexedInstrProf::ComputeHash(getProfileName(F));
+    if (Opts.InstrumentedOnly && !Index.lookup(NameHash))
+      continue;
+    bool Loaded = false;
+    if (Opts.Filter &&
+        !isExported(F, NameHash, *Opts.Filter, Index, Scratch, Loaded))
+      continue;
+
+    computeFunctionProfileInfo(F, Index, Opts, Info);
+    TargetLibraryInfo TLI(TLII, &F);
+
+    BranchEngineComparison C;
+    C.F = &F;
+    C.Name = Info.IRPGOName;
+    C.PGOName = Info.PGOName;
+    C.Hash = computeFunctionHash(F, Info);
+    C.NumBlocks = F.size();
+    for (bool WuLarus : {false, true}) {
+      BranchEngineResult &R = WuLarus ? C.WuLarus : C.Stock;
+      std::optional<StandaloneBFI> Analyses;
+      for (unsigned Run = 0; Run != Runs; ++Run) {
+        Analyses.reset();
+        auto Start = std::chrono::steady_clock::now();
+        Analyses.emplace(F, TLI, WuLarus);
+        double Seconds = secondsSince(Start);
+        if (Run == 0 || Seconds < R.Seconds)
+          R.Seconds = Seconds;
+      }
+      if (!convertBFIToCounts(F, Info, Index, Analyses->BFI,
+                              /*Refinement=*/nullptr, Scratch, R.Counts))
+        R.Counts.clear();
     }
-    return PreservedAnalyses::all();
+    Consume(std::move(C));
   }
+}
 
-  std::error_code EC;
-  raw_fd_ostream Output(ProfilePath, EC, sys::fs::OF_None);
-  if (EC) {
-    errs() << "Error: Cannot open profile output file '" << ProfilePath
-           << "': " << EC.message() << "\n";
+PreservedAnalyses StaticProfileExporterPass::run(Module &M,
+                                                  ModuleAnalysisManager &MAM) {
+  if (ProfilePath.empty()) {
+    errs() << "Warning: No profile output path specified\n";
     return PreservedAnalyses::all();
   }
 
-  if (auto Err = Writer.write(Output)) {
-    errs() << "Error: Failed to write profile data: " 
-           << toString(std::move(Err)) << "\n";
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  std::string OutputPath =
+      Options.ShardByModule
+          ? getStaticProfileShardPath(ProfilePath, M.getModuleIdentifier())
+          : ProfilePath;
+
+  StaticProfileExporterOptions Opts = Options;
+  std::optional<StaticFrequencyWriter> Frequencies;
+  if (!Opts.Frequencies && !Opts.FrequencyFile.empty())
+    Opts.Frequencies = &Frequencies.emplace();
+  std::optional<HotnessRanking> Hotness;
+  if (!Opts.Hotness && !Opts.SymbolOrderingFile.empty())
+    Opts.Hotness = &Hotness.emplace(/*K=*/0, /*KeepFunctions=*/true);
+
+  StaticProfileWriter Writer(OutputPath, Opts.StreamChunkSize,
+                             Opts.UpdateProfile);
+  StaticProfileStats Stats;
+  Stats += exportStaticProfile(
+      M, &FAM, Opts,
+      [&](const Function *, NamedInstrProfRecord &&Record) {
+        Writer.addRecord(std::move(Record), Stats);
+      },
+      Capture.get());
+
+  if (Stats.FunctionsProcessed == 0) {
+    if (StatsOut)
+      *StatsOut += Stats;
+    errs() << "Warning: No functions processed for static profile generation\n";
+    if (Stats.FunctionsSkipped > 0) {
+      errs() << "  " << Stats.FunctionsSkipped << " function(s) were skipped due to errors\n";
+    }
     return PreservedAnalyses::all();
   }
 
-  LLVM_DEBUG(dbgs() << "Successfully wrote static profile to '" << ProfilePath 
+  bool Written = Writer.write(Stats);
+  if (!Written)
+    ++Stats.WriteFailures;
+  if (Written && Frequencies)
+    Frequencies->write(Options.ShardByModule
+                           ? getStaticProfileShardPath(Options.FrequencyFile,
+                                                       M.getModuleIdentifier())
+                           : Options.FrequencyFile);
+  if (Written && Hotness)
+    Hotness->writeSymbolOrderingFile(
+        Options.ShardByModule
+            ? getStaticProfileShardPath(Options.SymbolOrderingFile,
+                                        M.getModuleIdentifier())
+            : Options.SymbolOrderingFile);
+  if (Options.SlowestFunctions)
+    printSlowestFunctions(errs(), Stats, Options.SlowestFunctions);
+  if (StatsOut)
+    *StatsOut += Stats;
+  if (!Written)
+    return PreservedAnalyses::all();
+
+  LLVM_DEBUG(dbgs() << "Successfully wrote static profile to '" << OutputPath
                     << "'\n");
-  LLVM_DEBUG(dbgs() << "  Functions processed: " << FunctionsProcessed << "\n");
-  LLVM_DEBUG(dbgs() << "  Functions skipped: " << FunctionsSkipped << "\n");
+  LLVM_DEBUG(dbgs() << "  Functions processed: " << Stats.FunctionsProcessed << "\n");
+  LLVM_DEBUG(dbgs() << "  Functions skipped: " << Stats.FunctionsSkipped << "\n");
+  LLVM_DEBUG(dbgs() << "  Loaded from cache: " << Stats.CacheHits << "\n");
 
   return PreservedAnalyses::all();
 }
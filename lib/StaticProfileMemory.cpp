@@ -0,0 +1,37 @@
+//===- StaticProfileMemory.cpp - Memory use of a static profile -----------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the memory probes of static profile exports.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StaticProfileMemory.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Process.h"
+
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
+using namespace llvm;
+
+uint64_t llvm::getHeapUsageBytes() { return sys::Process::GetMallocUsage(); }
+
+std::optional<uint64_t> llvm::getPeakRSSBytes() {
+#ifdef LLVM_ON_UNIX
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) == 0) {
+#ifdef __APPLE__
+    return uint64_t(Usage.ru_maxrss);
+#else
+    return uint64_t(Usage.ru_maxrss) * 1024;
+#endif
+  }
+#endif
+  return std::nullopt;
+}
@@ -0,0 +1,411 @@
+//===- StaticProfileWriter.cpp - Output of static profiles ----------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the in-memory and streaming output of static profiles,
+// and the merging of sharded exports.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StaticProfileWriter.h"
+#include "StaticProfileMemory.h"
+#include "StaticProfileTimer.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <chrono>
+#include <optional>
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+
+StaticProfileWriter::StaticProfileWriter(std::string OutputPath,
+                                         unsigned ChunkSize, bool Update)
+    : OutputPath(std::move(OutputPath)), ChunkSize(ChunkSize), Update(Update) {}
+
+StaticProfileWriter::~StaticProfileWriter() {
+  if (Spill) {
+    Spill.reset();
+    sys::fs::remove(SpillPath);
+  }
+}
+
+static void addToWriter(InstrProfWriter &Writer, NamedInstrProfRecord &&Record,
+                        StaticProfileStats &Stats) {
+  StringRef Name = Record.Name;
+  Writer.addRecord(std::move(Record), 1, [&](Error Err) {
+    errs() << "Warning: Failed to add profile record for " << Name
+           << ": " << toString(std::move(Err)) << "\n";
+    ++Stats.FunctionsSkipped;
+  });
+}
+
+void StaticProfileWriter::addRecord(NamedInstrProfRecord &&Record,
+                                    StaticProfileStats &Stats) {
+  StaticProfilePhase Phase("AddProfileRecord", "Add profile records",
+                           Record.Name);
+  if (Update)
+    Names.insert(Record.Name);
+  // The spill only carries counters; the value profiles and MC/DC bitmap
+  // bytes of records taken from a base profile would be lost there, so such
+  // records go straight to the writer. They are few, and merging is
+  // independent of the order records arrive in.
+  if (!ChunkSize || Record.getNumValueKinds() || !Record.BitmapBytes.empty())
+    return addToWriter(Writer, std::move(Record), Stats);
+
+  // Same layout as the text profile format written by llvm-profdata.
+  raw_string_ostream OS(Chunk);
+  OS << Record.Name << "\n"
+     << "# Func Hash:\n" << Record.Hash << "\n"
+     << "# Num Counters:\n" << Record.Counts.size() << "\n"
+     << "# Counter Values:\n";
+  for (uint64_t Count : Record.Counts)
+    OS << Count << "\n";
+  OS << "\n";
+
+  if (++ChunkRecords >= ChunkSize)
+    flushChunk();
+}
+
+void StaticProfileWriter::flushChunk() {
+  if (SpillFailed)
+    return;
+
+  if (!Spill) {
+    int FD;
+    if (std::error_code EC = sys::fs::createUniqueFile(
+            OutputPath + ".spill-%%%%%%", FD, SpillPath)) {
+      errs() << "Warning: Cannot create profile spill file next to '"
+             << OutputPath << "': " << EC.message()
+             << "; keeping records in memory\n";
+      SpillFailed = true;
+      return;
+    }
+    Spill = std::make_unique<raw_fd_ostream>(FD, /*shouldClose=*/true);
+  }
+
+  *Spill << Chunk;
+  Spill->flush();
+  LLVM_DEBUG(dbgs() << "Spilled " << ChunkRecords << " profile record(s) to '"
+                    << SpillPath << "'\n");
+  Chunk.clear();
+  ChunkRecords = 0;
+}
+
+bool StaticProfileWriter::loadSpill(StaticProfileStats &Stats) {
+  // Records that did not fill a chunk go through the spill as well, so the
+  // spilled records reach the writer in the order they were added.
+  if (ChunkRecords)
+    flushChunk();
+
+  if (!Spill) {
+    // Creating the spill failed; parse the pending chunk from memory.
+    if (Chunk.empty())
+      return true;
+    auto ReaderOrErr = InstrProfReader::create(
+        MemoryBuffer::getMemBuffer(Chunk, "<spill>", false));
+    if (!ReaderOrErr) {
+      errs() << "Error: Cannot read back profile records: "
+             << toString(ReaderOrErr.takeError()) << "\n";
+      return false;
+    }
+    for (NamedInstrProfRecord &Record : **ReaderOrErr)
+      addToWriter(Writer, std::move(Record), Stats);
+    Chunk.clear();
+    return true;
+  }
+
+  Spill->close();
+  if (Spill->has_error()) {
+    errs() << "Error: Failed to write profile spill file '" << SpillPath
+           << "': " << Spill->error().message() << "\n";
+    Spill->clear_error();
+    return false;
+  }
+
+  auto FS = vfs::getRealFileSystem();
+  auto ReaderOrErr = InstrProfReader::create(SpillPath, *FS);
+  if (!ReaderOrErr) {
+    errs() << "Error: Cannot read profile spill file '" << SpillPath
+           << "': " << toString(ReaderOrErr.takeError()) << "\n";
+    return false;
+  }
+
+  InstrProfReader &Reader = **ReaderOrErr;
+  for (NamedInstrProfRecord &Record : Reader)
+    addToWriter(Writer, std::move(Record), Stats);
+  if (Reader.hasError()) {
+    errs() << "Error: Malformed profile spill file '" << SpillPath
+           << "': " << toString(Reader.getError()) << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool StaticProfileWriter::write(StaticProfileStats &Stats) {
+  StaticProfilePhase Phase("WriteIndexedProfile", "Write the indexed profile",
+                           OutputPath);
+  auto Start = std::chrono::steady_clock::now();
+  // The indexed profile is built in memory, which makes writing the peak of
+  // many exports.
+  std::optional<uint64_t> PeakRSSStart = getPeakRSSBytes();
+  auto RecordTime = make_scope_exit([&] {
+    Stats.WriteSeconds += std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - Start)
+                              .count();
+    if (std::optional<uint64_t> PeakRSS = getPeakRSSBytes())
+      if (PeakRSSStart && *PeakRSS > *PeakRSSStart)
+        Stats.WritePeakRSSGrowth += *PeakRSS - *PeakRSSStart;
+  });
+
+  if (ChunkSize && !loadSpill(Stats))
+    return false;
+
+  if (Update)
+    return writeUpdate();
+
+  std::error_code EC;
+  raw_fd_ostream Output(OutputPath, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << "Error: Cannot open profile output file '" << OutputPath
+           << "': " << EC.message() << "\n";
+    return false;
+  }
+
+  if (auto Err = Writer.write(Output)) {
+    errs() << "Error: Failed to write profile data: "
+           << toString(std::move(Err)) << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool StaticProfileWriter::loadBaseProfile() {
+  StaticProfilePhase Phase("LoadBaseProfile", "Load the profile to update",
+                           OutputPath);
+  if (!sys::fs::exists(OutputPath))
+    return true;
+
+  // A read-only mapping; only the records that are kept get decoded into the
+  // writer, and the mapping is released before the profile is replaced.
+  auto BufferOrErr = MemoryBuffer::getFile(OutputPath, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+  if (std::error_code EC = BufferOrErr.getError()) {
+    errs() << "Error: Cannot read profile to update '" << OutputPath
+           << "': " << EC.message() << "\n";
+    return false;
+  }
+  if (!IndexedInstrProfReader::hasFormat(**BufferOrErr)) {
+    errs() << "Error: Cannot update '" << OutputPath
+           << "': not an indexed profile\n";
+    return false;
+  }
+
+  auto ReaderOrErr = IndexedInstrProfReader::create(std::move(*BufferOrErr));
+  if (!ReaderOrErr) {
+    errs() << "Error: Cannot read profile to update '" << OutputPath
+           << "': " << toString(ReaderOrErr.takeError()) << "\n";
+    return false;
+  }
+
+  IndexedInstrProfReader &Reader = **ReaderOrErr;
+  if (Error Err = Writer.mergeProfileKind(Reader.getProfileKind())) {
+    errs() << "Error: Cannot update '" << OutputPath
+           << "': " << toString(std::move(Err)) << "\n";
+    return false;
+  }
+
+  unsigned Kept = 0, Replaced = 0;
+  for (NamedInstrProfRecord &Record : Reader) {
+    if (Names.contains(Record.Name)) {
+      ++Replaced;
+      continue;
+    }
+    StringRef Name = Record.Name;
+    Writer.addRecord(std::move(Record), 1, [&](Error Err) {
+      errs() << "Warning: Dropping profile record for " << Name
+             << " from '" << OutputPath << "': " << toString(std::move(Err))
+             << "\n";
+    });
+    ++Kept;
+  }
+  if (Reader.hasError()) {
+    errs() << "Error: Malformed profile to update '" << OutputPath
+           << "': " << toString(Reader.getError()) << "\n";
+    return false;
+  }
+
+  LLVM_DEBUG(dbgs() << "Updating '" << OutputPath << "': " << Kept
+                    << " record(s) kept, " << Replaced << " replaced\n");
+  return true;
+}
+
+bool StaticProfileWriter::writeUpdate() {
+  std::string LockPath = OutputPath + ".lock";
+  int LockFD;
+  if (std::error_code EC = sys::fs::openFileForWrite(
+          LockPath, LockFD, sys::fs::CD_OpenAlways)) {
+    errs() << "Error: Cannot open lock file '" << LockPath
+           << "': " << EC.message() << "\n";
+    return false;
+  }
+  auto CloseLock = make_scope_exit(
+      [&] { sys::Process::SafelyCloseFileDescriptor(LockFD); });
+  if (std::error_code EC = sys::fs::lockFile(LockFD)) {
+    errs() << "Error: Cannot lock '" << LockPath << "': " << EC.message()
+           << "\n";
+    return false;
+  }
+  auto Unlock = make_scope_exit([&] { sys::fs::unlockFile(LockFD); });
+
+  if (!loadBaseProfile())
+    return false;
+
+  // Write next to the output and rename, so readers of the output never see
+  // a partial profile.
+  int FD;
+  SmallString<128> TempPath;
+  if (std::error_code EC =
+          sys::fs::createUniqueFile(OutputPath + ".tmp-%%%%%%", FD, TempPath)) {
+    errs() << "Error: Cannot create profile output file next to '"
+           << OutputPath << "': " << EC.message() << "\n";
+    return false;
+  }
+
+  raw_fd_ostream Output(FD, /*shouldClose=*/true);
+  if (auto Err = Writer.write(Output)) {
+    errs() << "Error: Failed to write profile data: "
+           << toString(std::move(Err)) << "\n";
+    Output.close();
+    sys::fs::remove(TempPath);
+    return false;
+  }
+  Output.close();
+  if (Output.has_error()) {
+    errs() << "Error: Failed to write profile output file '" << TempPath
+           << "': " << Output.error().message() << "\n";
+    Output.clear_error();
+    sys::fs::remove(TempPath);
+    return false;
+  }
+
+  if (std::error_code EC = sys::fs::rename(TempPath, OutputPath)) {
+    errs() << "Error: Cannot replace profile '" << OutputPath
+           << "': " << EC.message() << "\n";
+    sys::fs::remove(TempPath);
+    return false;
+  }
+  return true;
+}
+
+static constexpr StringLiteral ShardInfix = ".thinlto.";
+static constexpr size_t ShardHashDigits = 16;
+
+std::string llvm::getStaticProfileShardPath(StringRef OutputPath,
+                                            StringRef ModuleID) {
+  std::string Path = (Twine(OutputPath) + ShardInfix).str();
+  raw_string_ostream(Path) << format_hex_no_prefix(xxh3_64bits(ModuleID),
+                                                   ShardHashDigits);
+  return Path;
+}
+
+std::error_code
+llvm::findStaticProfileShards(StringRef OutputPath,
+                              std::vector<std::string> &Shards) {
+  StringRef Dir = sys::path::parent_path(OutputPath);
+  if (Dir.empty())
+    Dir = ".";
+  std::string Prefix = (Twine(sys::path::filename(OutputPath)) + ShardInfix).str();
+
+  std::error_code EC;
+  for (sys::fs::directory_iterator It(Dir, EC), End; It != End && !EC;
+       It.increment(EC)) {
+    // Matching the exact suffix keeps the spill files of shards out.
+    StringRef Name = sys::path::filename(It->path());
+    if (!Name.consume_front(Prefix) || Name.size() != ShardHashDigits ||
+        !all_of(Name, isHexDigit))
+      continue;
+    Shards.push_back(It->path());
+  }
+  llvm::sort(Shards);
+  return EC;
+}
+
+bool llvm::mergeStaticProfileShards(ArrayRef<std::string> Shards,
+                                    StaticProfileWriter &Writer,
+                                    StaticProfileStats &Stats) {
+  // Newest first, so that a function whose hash changed keeps the record of
+  // the shard that was written last rather than that of a stale one. Ties
+  // keep the order given.
+  std::vector<std::pair<sys::TimePoint<>, StringRef>> Ordered;
+  Ordered.reserve(Shards.size());
+  for (const std::string &Shard : Shards) {
+    sys::fs::file_status Status;
+    if (std::error_code EC = sys::fs::status(Shard, Status)) {
+      errs() << "Error: Cannot read profile shard '" << Shard
+             << "': " << EC.message() << "\n";
+      return false;
+    }
+    Ordered.emplace_back(Status.getLastModificationTime(), Shard);
+  }
+  llvm::stable_sort(Ordered, [](const auto &L, const auto &R) {
+    return L.first > R.first;
+  });
+
+  auto FS = vfs::getRealFileSystem();
+  // Hash of the record kept for every name, and the shard it came from.
+  StringMap<std::pair<uint64_t, StringRef>> Seen;
+  unsigned Duplicates = 0;
+  for (StringRef Shard : make_second_range(Ordered)) {
+    auto ReaderOrErr = InstrProfReader::create(Shard, *FS);
+    if (!ReaderOrErr) {
+      errs() << "Error: Cannot read profile shard '" << Shard
+             << "': " << toString(ReaderOrErr.takeError()) << "\n";
+      return false;
+    }
+
+    InstrProfReader &Reader = **ReaderOrErr;
+    for (NamedInstrProfRecord &Record : Reader) {
+      auto [It, Inserted] =
+          Seen.try_emplace(Record.Name, Record.Hash, Shard);
+      if (!Inserted) {
+        if (It->second.first != Record.Hash)
+          errs() << "Warning: Profile shard '" << Shard << "' has a record of "
+                 << Record.Name << " with another hash than the newer shard '"
+                 << It->second.second << "'; keeping the newer one\n";
+        ++Duplicates;
+        continue;
+      }
+      Writer.addRecord(std::move(Record), Stats);
+      ++Stats.FunctionsProcessed;
+    }
+    if (Reader.hasError()) {
+      errs() << "Error: Malformed profile shard '" << Shard
+             << "': " << toString(Reader.getError()) << "\n";
+      return false;
+    }
+  }
+
+  LLVM_DEBUG(dbgs() << "Merged " << Shards.size() << " profile shard(s), "
+                    << Duplicates << " duplicate record(s) dropped\n");
+  return true;
+}
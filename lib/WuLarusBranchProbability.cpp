@@ -0,0 +1,269 @@
+//===- WuLarusBranchProbability.cpp - Wu-Larus branch heuristics ----------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the Wu-Larus branch probability engine.
+//
+// Each heuristic looks at the two successors of a conditional branch and
+// applies only when exactly one of them has the property it tests for. It
+// then predicts that successor to be taken, or not taken, with the hit rate
+// Wu and Larus measured for it on the SPEC benchmarks. Starting from an even
+// split, the predictions are combined one at a time with
+//
+//   P' = P * Q / (P * Q + (1 - P) * (1 - Q))
+//
+// where P is the probability of the first successor so far and Q the one the
+// heuristic predicts, so agreeing heuristics reinforce each other and
+// disagreeing ones cancel out.
+//
+//===----------------------------------------------------------------------===//
+
+#include "WuLarusBranchProbability.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/BranchProbability.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+#define DEBUG_TYPE "static-profile-export"
+
+using namespace llvm;
+
+// Hit rates of the heuristics, from Table 1 of Wu and Larus.
+static constexpr double LoopBranchHitRate = 0.88;
+static constexpr double LoopExitHitRate = 0.80;
+static constexpr double LoopHeaderHitRate = 0.75;
+static constexpr double PointerHitRate = 0.60;
+static constexpr double OpcodeHitRate = 0.84;
+static constexpr double GuardHitRate = 0.62;
+static constexpr double CallHitRate = 0.78;
+static constexpr double StoreHitRate = 0.55;
+static constexpr double ReturnHitRate = 0.72;
+
+namespace {
+
+/// Accumulates the predictions of the heuristics for one branch.
+class BranchPrediction {
+  /// Probability of taking the first successor.
+  double P = 0.5;
+
+public:
+  /// Predict that successor \p Succ is taken with probability \p HitRate.
+  void taken(unsigned Succ, double HitRate) {
+    double Q = Succ == 0 ? HitRate : 1.0 - HitRate;
+    P = P * Q / (P * Q + (1.0 - P) * (1.0 - Q));
+  }
+
+  /// Predict that successor \p Succ is not taken with probability \p HitRate.
+  void notTaken(unsigned Succ, double HitRate) { taken(1 - Succ, HitRate); }
+
+  double getProbability() const { return P; }
+};
+
+} // end anonymous namespace
+
+/// The successor of \p Br, 0 or 1, that has property \p Has while the other
+/// one does not, if any.
+template <typename PredicateT>
+static std::optional<unsigned> findUniqueSuccessor(const BranchInst &Br,
+                                                   PredicateT Has) {
+  bool First = Has(Br.getSuccessor(0));
+  if (First == Has(Br.getSuccessor(1)))
+    return std::nullopt;
+  return First ? 0 : 1;
+}
+
+/// Whether the edge from \p BB to \p Succ goes back to the header of a loop
+/// that contains \p BB.
+static bool isBackEdge(const BasicBlock *BB, const BasicBlock *Succ,
+                       const LoopInfo &LI) {
+  const Loop *L = LI.getLoopFor(Succ);
+  return L && L->getHeader() == Succ && L->contains(BB);
+}
+
+/// Whether \p BB is a loop header or the preheader of one.
+static bool isLoopHeaderOrPreheader(const BasicBlock *BB, const LoopInfo &LI) {
+  if (LI.isLoopHeader(BB))
+    return true;
+  const BasicBlock *Next = BB->getSingleSuccessor();
+  if (!Next || !LI.isLoopHeader(Next))
+    return false;
+  return !LI.getLoopFor(Next)->contains(BB);
+}
+
+/// Whether \p BB contains a call that is not an intrinsic.
+static bool containsCall(const BasicBlock *BB) {
+  for (const Instruction &I : *BB)
+    if (const auto *CB = dyn_cast<CallBase>(&I))
+      if (!isa<IntrinsicInst>(CB))
+        return true;
+  return false;
+}
+
+static bool containsStore(const BasicBlock *BB) {
+  for (const Instruction &I : *BB)
+    if (isa<StoreInst>(I))
+      return true;
+  return false;
+}
+
+/// Whether an instruction of \p BB other than a PHI uses \p V.
+static bool usesValue(const BasicBlock *BB, const Value *V) {
+  for (const User *U : V->users())
+    if (const auto *I = dyn_cast<Instruction>(U))
+      if (I->getParent() == BB && !isa<PHINode>(I))
+        return true;
+  return false;
+}
+
+/// Opcode heuristic: comparisons of integers against zero predict that they
+/// are not negative, and equality comparisons against constants and between
+/// floating-point values predict inequality. Returns the successor predicted
+/// to be taken.
+static std::optional<unsigned> predictByOpcode(const CmpInst &Cmp) {
+  if (const auto *FCmp = dyn_cast<FCmpInst>(&Cmp)) {
+    switch (FCmp->getPredicate()) {
+    case CmpInst::FCMP_OEQ:
+    case CmpInst::FCMP_UEQ:
+      return 1;
+    case CmpInst::FCMP_ONE:
+    case CmpInst::FCMP_UNE:
+      return 0;
+    default:
+      return std::nullopt;
+    }
+  }
+
+  const auto *RHS = dyn_cast<Constant>(Cmp.getOperand(1));
+  if (!RHS || Cmp.getOperand(0)->getType()->isPointerTy())
+    return std::nullopt;
+  switch (Cmp.getPredicate()) {
+  case CmpInst::ICMP_EQ:
+    return 1;
+  case CmpInst::ICMP_NE:
+    return 0;
+  case CmpInst::ICMP_SLT:
+  case CmpInst::ICMP_SLE:
+    return RHS->isNullValue() ? std::optional<unsigned>(1) : std::nullopt;
+  case CmpInst::ICMP_SGT:
+  case CmpInst::ICMP_SGE:
+    return RHS->isNullValue() ? std::optional<unsigned>(0) : std::nullopt;
+  default:
+    return std::nullopt;
+  }
+}
+
+/// Probability of taking the first successor of \p Br.
+static double predictBranch(const BranchInst &Br, const LoopInfo &LI,
+                            const PostDominatorTree &PDT) {
+  const BasicBlock *BB = Br.getParent();
+  BranchPrediction Prediction;
+
+  // Loop branch: edges back to a loop header are taken.
+  if (std::optional<unsigned> Succ = findUniqueSuccessor(
+          Br, [&](const BasicBlock *S) { return isBackEdge(BB, S, LI); }))
+    Prediction.taken(*Succ, LoopBranchHitRate);
+
+  // Loop exit: in a loop, when neither successor is a loop header, the edge
+  // leaving the loop is not taken.
+  if (const Loop *L = LI.getLoopFor(BB))
+    if (!LI.isLoopHeader(Br.getSuccessor(0)) &&
+        !LI.isLoopHeader(Br.getSuccessor(1)))
+      if (std::optional<unsigned> Succ = findUniqueSuccessor(
+              Br, [&](const BasicBlock *S) { return !L->contains(S); }))
+        Prediction.notTaken(*Succ, LoopExitHitRate);
+
+  // Loop header: a successor that enters a loop without postdominating the
+  // branch is taken.
+  if (std::optional<unsigned> Succ =
+          findUniqueSuccessor(Br, [&](const BasicBlock *S) {
+            return !isBackEdge(BB, S, LI) && isLoopHeaderOrPreheader(S, LI) &&
+                   !PDT.dominates(S, BB);
+          }))
+    Prediction.taken(*Succ, LoopHeaderHitRate);
+
+  if (const auto *Cmp = dyn_cast<CmpInst>(Br.getCondition())) {
+    // Pointer: pointers are usually not null and not equal to each other.
+    if (isa<ICmpInst>(Cmp) && Cmp->isEquality() &&
+        Cmp->getOperand(0)->getType()->isPointerTy())
+      Prediction.taken(Cmp->getPredicate() == CmpInst::ICMP_EQ ? 1 : 0,
+                       PointerHitRate);
+    else if (std::optional<unsigned> Succ = predictByOpcode(*Cmp))
+      Prediction.taken(*Succ, OpcodeHitRate);
+
+    // Guard: a successor that uses an operand of the comparison without
+    // postdominating the branch is the one the comparison guards.
+    for (const Value *Op : Cmp->operands()) {
+      if (isa<Constant>(Op))
+        continue;
+      if (std::optional<unsigned> Succ =
+              findUniqueSuccessor(Br, [&](const BasicBlock *S) {
+                return usesValue(S, Op) && !PDT.dominates(S, BB);
+              })) {
+        Prediction.taken(*Succ, GuardHitRate);
+        break;
+      }
+    }
+  }
+
+  // Call: a successor that calls a function without postdominating the
+  // branch is not taken.
+  if (std::optional<unsigned> Succ =
+          findUniqueSuccessor(Br, [&](const BasicBlock *S) {
+            return containsCall(S) && !PDT.dominates(S, BB);
+          }))
+    Prediction.notTaken(*Succ, CallHitRate);
+
+  // Store: a successor that stores to memory without postdominating the
+  // branch is not taken.
+  if (std::optional<unsigned> Succ =
+          findUniqueSuccessor(Br, [&](const BasicBlock *S) {
+            return containsStore(S) && !PDT.dominates(S, BB);
+          }))
+    Prediction.notTaken(*Succ, StoreHitRate);
+
+  // Return: a successor that returns is not taken.
+  if (std::optional<unsigned> Succ = findUniqueSuccessor(
+          Br, [](const BasicBlock *S) {
+            return isa<ReturnInst>(S->getTerminator());
+          }))
+    Prediction.notTaken(*Succ, ReturnHitRate);
+
+  return Prediction.getProbability();
+}
+
+void llvm::computeWuLarusProbabilities(const Function &F, const LoopInfo &LI,
+                                       const PostDominatorTree &PDT,
+                                       BranchProbabilityInfo &BPI) {
+  const uint32_t Denominator = BranchProbability::getDenominator();
+  for (const BasicBlock &BB : F) {
+    const auto *Br = dyn_cast<BranchInst>(BB.getTerminator());
+    if (!Br || !Br->isConditional() ||
+        Br->getSuccessor(0) == Br->getSuccessor(1))
+      continue;
+
+    double P = predictBranch(*Br, LI, PDT);
+    // Keep both edges possible, so that no block gets a zero frequency.
+    uint32_t Numerator = static_cast<uint32_t>(std::clamp<double>(
+        std::round(P * Denominator), 1, Denominator - 1));
+    SmallVector<BranchProbability, 2> Probs = {
+        BranchProbability(Numerator, Denominator),
+        BranchProbability(Denominator - Numerator, Denominator)};
+
+    LLVM_DEBUG(dbgs() << "Wu-Larus probabilities of " << BB.getName() << ": "
+                      << Probs[0] << ", " << Probs[1] << "\n");
+    BPI.setEdgeProbability(&BB, Probs);
+  }
+}
@@ -10,66 +10,1307 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "CoverageRecordIndex.h"
+#include "DynamicBaseProfile.h"
+#include "FunctionFilter.h"
+#include "HotnessRanking.h"
+#include "StaticCoverageReport.h"
+#include "StaticFrequencyFile.h"
+#include "StaticProfileCache.h"
+#include "StaticProfileDedup.h"
 #include "StaticProfileExporter.h"
+#include "StaticProfileMemory.h"
+#include "StaticProfileTimer.h"
+#include "StaticProfileWriter.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/VirtualFileSystem.h"
 #include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <tuple>
 
 using namespace llvm;
 
-static void printHelp(const char *ProgName) {
-  outs() << "OVERVIEW: CASP - Coverage Approximation via Static Profiles\n\n"
-         << "DESCRIPTION:\n"
-         << "  This tool generates static profile data from LLVM IR using block\n"
-         << "  frequency analysis. The output is compatible with llvm-profdata and\n"
-         << "  can be used with llvm-cov for coverage visualization.\n\n"
-         << "USAGE: " << ProgName << " <input.ll> [output.profdata]\n\n"
-         << "ARGUMENTS:\n"
-         << "  <input.ll>        LLVM IR input file (.ll or .bc)\n"
-         << "  [output.profdata] Output profile file (default: output.profdata)\n\n"
-         << "EXAMPLES:\n"
-         << "  # Generate static profile from IR\n"
-         << "  " << ProgName << " program.ll profile.profdata\n\n"
-         << "  # Use with default output filename\n"
-         << "  " << ProgName << " program.ll\n\n"
-         << "  # View coverage with llvm-cov\n"
-         << "  llvm-cov show program -instr-profile=profile.profdata\n\n";
+static cl::OptionCategory CASPCategory("CASP Options");
+
+static cl::list<std::string> Positionals(cl::Positional,
+                                         cl::desc("<input.ll> [output.profdata]"),
+                                         cl::cat(CASPCategory));
+
+static cl::opt<std::string> InputList(
+    "input-list",
+    cl::desc("File listing one LLVM IR file per line; all modules are merged "
+             "into a single profile"),
+    cl::value_desc("filename"), cl::cat(CASPCategory));
+
+static cl::opt<std::string> CompileCommands(
+    "compile-commands",
+    cl::desc("Compilation database whose outputs are LLVM IR or bitcode "
+             "(e.g. built with -emit-llvm or -flto); all modules are merged "
+             "into a single profile"),
+    cl::value_desc("compile_commands.json"), cl::cat(CASPCategory));
+
+static cl::opt<uint64_t> EntryCount(
+    "entry-count",
+    cl::desc("Entry block count that block frequencies are scaled to; larger "
+             "values keep more resolution for cold blocks"),
+    cl::value_desc("N"), cl::init(StaticProfileExporterOptions().EntryCount),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> UseFunctionEntryCount(
+    "use-function-entry-count",
+    cl::desc("Scale block frequencies to the function's entry count metadata "
+             "when present"),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> PropagateEntryCounts(
+    "propagate-entry-counts",
+    cl::desc("Derive function entry counts from their callers by walking the "
+             "call graph in SCC order; --entry-count then applies to "
+             "functions callable from outside the module"),
+    cl::cat(CASPCategory));
+
+static cl::opt<unsigned>
+    Threads("threads",
+            cl::desc("Number of threads used to compute block frequencies, or "
+                     "to process modules in batch mode (0 = all hardware "
+                     "threads)"),
+            cl::value_desc("N"), cl::init(1), cl::cat(CASPCategory));
+
+static cl::opt<unsigned> StreamChunkSize(
+    "stream-chunk-size",
+    cl::desc("Spill profile records to disk in chunks of N records while "
+             "analyzing and build the indexed profile at the end, so the "
+             "records and the IR are not in memory at the same time "
+             "(0 = keep all records in memory)"),
+    cl::value_desc("N"), cl::init(0), cl::cat(CASPCategory));
+
+static cl::opt<std::string> BaseProfile(
+    "base-profile",
+    cl::desc("Indexed profile of real runs: keep its records for the functions "
+             "it reached and only compute static counts for the others, "
+             "scaled to its median entry count unless --entry-count is given"),
+    cl::value_desc("profdata"), cl::cat(CASPCategory));
+
+static cl::opt<bool> Update(
+    "update",
+    cl::desc("Replace or insert this export's records in the existing output "
+             "profile and keep the records of all other functions, instead "
+             "of overwriting it"),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> Lazy(
+    "lazy",
+    cl::desc("Load bitcode lazily: materialize each function body only while "
+             "its counts are computed and free it right after"),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> Link(
+    "link",
+    cl::desc("Batch mode: link all input modules into one module in a shared "
+             "context and export it, so functions defined in several modules, "
+             "such as linkonce_odr and inline functions, are analyzed once"),
+    cl::cat(CASPCategory));
+
+static cl::opt<unsigned> ReadThreads(
+    "read-threads",
+    cl::desc("Batch mode: number of threads reading input files ahead of the "
+             "analysis, for inputs on slow or network file systems"),
+    cl::value_desc("N"), cl::init(1), cl::cat(CASPCategory));
+
+static cl::opt<unsigned> PipelineDepth(
+    "pipeline-depth",
+    cl::desc("Batch mode: most input modules read, analyzed or waiting to be "
+             "written at once (default: twice the analysis threads)"),
+    cl::value_desc("N"), cl::init(0), cl::cat(CASPCategory));
+
+static cl::opt<DuplicatePolicy> Duplicates(
+    "duplicates",
+    cl::desc("Batch mode: what the profile gets for a function defined by "
+             "several modules, such as a template instantiation"),
+    cl::values(
+        clEnumValN(DuplicatePolicy::KeepOne, "keep-one",
+                   "The record of one copy; the other copies are not "
+                   "analyzed (default)"),
+        clEnumValN(DuplicatePolicy::Average, "average",
+                   "The average of the records of all copies"),
+        clEnumValN(DuplicatePolicy::Sum, "sum",
+                   "The sum of the records of all copies")),
+    cl::init(DuplicatePolicy::KeepOne), cl::cat(CASPCategory));
+
+static cl::opt<bool> RefineTripCounts(
+    "refine-trip-counts",
+    cl::desc("Give loops with a constant or maximum trip count known to "
+             "ScalarEvolution that many iterations instead of the ones "
+             "implied by branch probabilities"),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> InstrumentedOnly(
+    "instrumented-only",
+    cl::desc("Only export functions with instrumentation records; with --lazy "
+             "the bodies of other functions are never loaded"),
+    cl::cat(CASPCategory));
+
+static cl::list<std::string> IncludeFiles(
+    "include-file",
+    cl::desc("Only export functions defined in source files matching this "
+             "glob (repeatable)"),
+    cl::value_desc("glob"), cl::cat(CASPCategory));
+
+static cl::list<std::string> ExcludeFiles(
+    "exclude-file",
+    cl::desc("Do not export functions defined in source files matching this "
+             "glob (repeatable)"),
+    cl::value_desc("glob"), cl::cat(CASPCategory));
+
+static cl::list<std::string> IncludeFunctions(
+    "include-function",
+    cl::desc("Only export functions whose mangled or demangled name matches "
+             "this regex (repeatable)"),
+    cl::value_desc("regex"), cl::cat(CASPCategory));
+
+static cl::list<std::string> ExcludeFunctions(
+    "exclude-function",
+    cl::desc("Do not export functions whose mangled or demangled name "
+             "matches this regex (repeatable)"),
+    cl::value_desc("regex"), cl::cat(CASPCategory));
+
+static cl::list<std::string> IncludeSections(
+    "include-section",
+    cl::desc("Only export functions placed in this section (repeatable)"),
+    cl::value_desc("section"), cl::cat(CASPCategory));
+
+static cl::list<std::string> ExcludeSections(
+    "exclude-section",
+    cl::desc("Do not export functions placed in this section (repeatable)"),
+    cl::value_desc("section"), cl::cat(CASPCategory));
+
+static cl::opt<std::string> IncludeGUIDs(
+    "include-guids",
+    cl::desc("Only export the functions whose GUIDs are listed in this file, "
+             "one per line"),
+    cl::value_desc("file"), cl::cat(CASPCategory));
+
+static cl::opt<std::string> ExcludeGUIDs(
+    "exclude-guids",
+    cl::desc("Do not export the functions whose GUIDs are listed in this "
+             "file, one per line"),
+    cl::value_desc("file"), cl::cat(CASPCategory));
+
+static cl::opt<unsigned> SamplePercent(
+    "sample-percent",
+    cl::desc("Export a fixed, GUID-based sample of N percent of the "
+             "functions"),
+    cl::value_desc("N"), cl::init(100), cl::cat(CASPCategory));
+
+static cl::opt<std::string> CacheDir(
+    "cache-dir",
+    cl::desc("Directory caching the records of unchanged functions across "
+             "runs; only functions whose IR changed are analyzed again"),
+    cl::value_desc("directory"), cl::cat(CASPCategory));
+
+static cl::opt<bool> MergeShards(
+    "merge-shards",
+    cl::desc("Merge the partial profiles written by ThinLTO backends into the "
+             "output profile; shards are taken from the remaining positional "
+             "arguments, or found next to the output profile"),
+    cl::cat(CASPCategory));
+
+static cl::opt<std::string> PruneShardsBefore(
+    "prune-shards-before",
+    cl::desc("With --merge-shards, delete the shards last written before "
+             "this file, e.g. a stamp touched when the link started, instead "
+             "of merging them"),
+    cl::value_desc("file"), cl::cat(CASPCategory));
+
+static cl::opt<std::string> FrequencyFile(
+    "frequency-file",
+    cl::desc("Also write the scaled count and source line of every basic block "
+             "of the uninstrumented functions to this static frequency file"),
+    cl::value_desc("file"), cl::cat(CASPCategory));
+
+static cl::opt<unsigned> HotFunctions(
+    "hot-functions",
+    cl::desc("Print the N hottest functions and counters of the exported "
+             "profile; counts of different functions are only comparable "
+             "with --propagate-entry-counts"),
+    cl::value_desc("N"), cl::init(0), cl::cat(CASPCategory));
+
+static cl::opt<std::string> SymbolOrderingFile(
+    "symbol-ordering-file",
+    cl::desc("Also write the functions with a nonzero count, hottest first, "
+             "as an lld --symbol-ordering-file"),
+    cl::value_desc("file"), cl::cat(CASPCategory));
+
+static cl::opt<bool> ShowFrequencies(
+    "show-frequencies",
+    cl::desc("Print the blocks of a static frequency file given as the first "
+             "positional argument, for all functions or the GUIDs that "
+             "follow it"),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> Serve(
+    "serve",
+    cl::desc("Server mode: read export requests from stdin, one JSON object "
+             "per line, and answer each with a line of JSON on stdout, "
+             "keeping analysis managers and worker threads across requests"),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> CompareBranchHeuristics(
+    "compare-branch-heuristics",
+    cl::desc("Benchmark the Wu-Larus heuristics against BranchProbabilityInfo: "
+             "print the analysis time of both engines for every function as "
+             "CSV instead of writing a profile"),
+    cl::cat(CASPCategory));
+
+static cl::opt<std::string> ReferenceProfile(
+    "reference-profile",
+    cl::desc("Indexed profile of real runs that --compare-branch-heuristics "
+             "measures the counts of both engines against"),
+    cl::value_desc("filename"), cl::cat(CASPCategory));
+
+static cl::opt<bool> CompareProfiles(
+    "compare-profiles",
+    cl::desc("Score the static profile given as the first positional argument "
+             "against the profile of real runs given as the second: print the "
+             "rank correlation of their counts and how often they disagree "
+             "on coverage as JSON instead of writing a profile"),
+    cl::cat(CASPCategory));
+
+static cl::opt<std::string> BenchmarkJSON(
+    "benchmark-json",
+    cl::desc("Write the throughput, peak memory and time spent in each phase "
+             "of the export to this file as JSON"),
+    cl::value_desc("filename"), cl::cat(CASPCategory));
+
+static cl::opt<bool> Report(
+    "report",
+    cl::desc("Print an llvm-cov report style coverage summary of the static "
+             "profile instead of writing it; needs IR built with "
+             "-fprofile-instr-generate -fcoverage-mapping"),
+    cl::cat(CASPCategory));
+
+static cl::opt<unsigned> ReportSlowest(
+    "report-slowest",
+    cl::desc("Print the N functions that took longest to analyze"),
+    cl::value_desc("N"), cl::init(0), cl::cat(CASPCategory));
+
+static cl::opt<bool> StatsMemory(
+    "stats-memory",
+    cl::desc("Print how much heap the IR, the analyses and the profile "
+             "records took; only meaningful with --threads=1"),
+    cl::cat(CASPCategory));
+
+static cl::opt<bool> ClearAnalyses(
+    "clear-analyses",
+    cl::desc("Clear each function's analyses once its counts are taken "
+             "instead of keeping them until the module is done"),
+    cl::cat(CASPCategory));
+
+static cl::opt<std::string> TimeTrace(
+    "time-trace",
+    cl::desc("Write a Chrome trace of the export phases to this file, for "
+             "chrome://tracing or speedscope"),
+    cl::value_desc("filename"), cl::cat(CASPCategory));
+
+static cl::opt<unsigned> TimeTraceGranularity(
+    "time-trace-granularity",
+    cl::desc("Minimum duration of the regions in the --time-trace output, in "
+             "microseconds"),
+    cl::value_desc("us"), cl::init(500), cl::cat(CASPCategory));
+
+static cl::extrahelp Examples(
+    "\nEXAMPLES:\n"
+    "  # Generate static profile from IR\n"
+    "  llvm-sprofgen program.ll profile.profdata\n\n"
+    "  # Use with default output filename\n"
+    "  llvm-sprofgen program.ll\n\n"
+    "  # Spread the analysis over 8 threads\n"
+    "  llvm-sprofgen --threads=8 program.ll profile.profdata\n\n"
+    "  # Only analyze instrumented functions, loading one body at a time\n"
+    "  llvm-sprofgen --lazy --instrumented-only program.bc profile.profdata\n\n"
+    "  # Only export the functions of the files touched by a patch\n"
+    "  llvm-sprofgen --include-file='net/*.c' program.ll net.profdata\n\n"
+    "  # Keep a server running and send it one request per line\n"
+    "  llvm-sprofgen --serve --threads=0 < requests.jsonl\n\n"
+    "  # Accumulate the modules of a build in one profile\n"
+    "  llvm-sprofgen --update foo.bc app.profdata\n"
+    "  llvm-sprofgen --update bar.bc app.profdata\n\n"
+    "  # Merge every module of a compilation database into one profile\n"
+    "  llvm-sprofgen --compile-commands=build/compile_commands.json "
+    "merged.profdata\n\n"
+    "  # Combine the shards of a ThinLTO link that used the plugin with\n"
+    "  # -static-profile-dump-path=app.profdata\n"
+    "  llvm-sprofgen --merge-shards app.profdata\n\n"
+    "  # Compare the cost and accuracy of both branch probability engines\n"
+    "  llvm-sprofgen --compare-branch-heuristics "
+    "--reference-profile=real.profdata program.ll > engines.csv\n\n"
+    "  # Summarize coverage without writing a profile or linking\n"
+    "  llvm-sprofgen --report program.ll\n\n"
+    "  # View coverage with llvm-cov\n"
+    "  llvm-cov show program -instr-profile=profile.profdata\n");
+
+/// Seconds elapsed since \p Start.
+static double secondsSince(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       Start)
+      .count();
 }
 
-int main(int argc, char **argv) {
-  // Check for help before InitLLVM processes arguments
-  if (argc == 2 && (StringRef(argv[1]) == "-h" || 
-                    StringRef(argv[1]) == "--help" || 
-                    StringRef(argv[1]) == "-help")) {
-    printHelp(argv[0]);
-    return 0;
+/// Append the IR files listed in \p Path, one per line, to \p Inputs. Blank
+/// lines and lines starting with '#' are ignored.
+static bool readInputList(StringRef Path, std::vector<std::string> &Inputs) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+      MemoryBuffer::getFileOrSTDIN(Path);
+  if (!BufOrErr) {
+    errs() << "Error: Cannot read input list '" << Path
+           << "': " << BufOrErr.getError().message() << "\n";
+    return false;
   }
 
-  InitLLVM X(argc, argv);
+  SmallVector<StringRef, 0> Lines;
+  (*BufOrErr)->getBuffer().split(Lines, '\n', /*MaxSplit=*/-1,
+                                 /*KeepEmpty=*/false);
+  for (StringRef Line : Lines) {
+    Line = Line.trim();
+    if (Line.empty() || Line.starts_with("#"))
+      continue;
+    Inputs.push_back(Line.str());
+  }
+  return true;
+}
+
+/// Driver options that start with "-o" but are not a joined -o<file>.
+static constexpr StringLiteral OtherOSpellings[] = {
+    "-objcmt-", "-object", "-opt-record-", "-order_file",
+    "-output-asm-variant"};
+
+/// Return the value of the -o flag in the compile command \p Args, given as
+/// "-o <file>", "-o<file>", "--output <file>" or "--output=<file>".
+static std::optional<StringRef> findOutputArgument(ArrayRef<StringRef> Args) {
+  for (size_t I = 0, E = Args.size(); I != E; ++I) {
+    StringRef Arg = Args[I];
+    if ((Arg == "-o" || Arg == "--output") && I + 1 != E)
+      return Args[I + 1];
+    if (Arg.consume_front("--output="))
+      return Arg;
+    if (Arg.size() > 2 && Arg.starts_with("-o") &&
+        none_of(OtherOSpellings,
+                [&](StringRef Other) { return Arg.starts_with(Other); }))
+      return Arg.drop_front(2);
+  }
+  return std::nullopt;
+}
+
+/// Append the output file of every entry of the compilation database \p Path
+/// to \p Inputs. The outputs must be LLVM IR or bitcode, which is the case
+/// when the project is built with -emit-llvm or -flto.
+static bool readCompileCommands(StringRef Path,
+                                std::vector<std::string> &Inputs) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+      MemoryBuffer::getFile(Path);
+  if (!BufOrErr) {
+    errs() << "Error: Cannot read compilation database '" << Path
+           << "': " << BufOrErr.getError().message() << "\n";
+    return false;
+  }
+
+  Expected<json::Value> Root = json::parse((*BufOrErr)->getBuffer());
+  if (!Root) {
+    errs() << "Error: Malformed compilation database '" << Path
+           << "': " << toString(Root.takeError()) << "\n";
+    return false;
+  }
+
+  const json::Array *Entries = Root->getAsArray();
+  if (!Entries) {
+    errs() << "Error: Compilation database '" << Path
+           << "' is not a JSON array\n";
+    return false;
+  }
+
+  StringSet<> Seen;
+  for (const json::Value &Value : *Entries) {
+    const json::Object *Entry = Value.getAsObject();
+    if (!Entry)
+      continue;
+
+    BumpPtrAllocator Alloc;
+    StringSaver Saver(Alloc);
+    std::optional<StringRef> Output = Entry->getString("output");
+    if (!Output) {
+      SmallVector<StringRef, 32> Args;
+      if (const json::Array *Arguments = Entry->getArray("arguments")) {
+        for (const json::Value &Arg : *Arguments)
+          if (std::optional<StringRef> S = Arg.getAsString())
+            Args.push_back(*S);
+      } else if (std::optional<StringRef> Command =
+                     Entry->getString("command")) {
+        SmallVector<const char *, 32> Argv;
+        cl::TokenizeGNUCommandLine(*Command, Saver, Argv);
+        for (const char *Arg : Argv)
+          Args.push_back(Arg);
+      }
+      Output = findOutputArgument(Args);
+    }
 
-  if (argc < 2 || argc > 3) {
-    errs() << "Usage: " << argv[0] << " <input.ll> [output.profdata]\n";
-    errs() << "Run '" << argv[0] << " --help' for more information.\n";
+    if (!Output) {
+      StringRef File = Entry->getString("file").value_or("<unknown>");
+      errs() << "Warning: No output file for '" << File
+             << "' in compilation database, skipping\n";
+      continue;
+    }
+
+    SmallString<256> FullPath(*Output);
+    if (!sys::path::is_absolute(FullPath)) {
+      FullPath = Entry->getString("directory").value_or("");
+      sys::path::append(FullPath, *Output);
+    }
+    if (Seen.insert(FullPath).second)
+      Inputs.push_back(std::string(FullPath));
+  }
+  return true;
+}
+
+/// Print how the functions of an export were obtained, below the line that
+/// names the profile written.
+static void printExportSummary(const StaticProfileStats &Stats,
+                               const StaticProfileExporterOptions &Opts) {
+  if (!Opts.CacheDir.empty())
+    outs() << "  " << Stats.CacheHits << " of " << Stats.FunctionsProcessed
+           << " function(s) loaded from cache\n";
+  if (Opts.Filter)
+    outs() << "  " << Stats.FunctionsFiltered
+           << " function(s) left out by the filters\n";
+  if (Opts.BaseProfile)
+    outs() << "  " << Stats.FunctionsFromBaseProfile << " of "
+           << Stats.FunctionsProcessed
+           << " function(s) taken from the base profile\n";
+}
+
+/// Export every module in \p Inputs into a single profile at \p Output.
+///
+/// The export runs as a pipeline of three stages. Reader threads load the
+/// input files into memory, analysis threads parse and export each module in
+/// its own LLVMContext and collect its records privately, and the main thread
+/// feeds those into the shared writer in input order as soon as each module
+/// is done, so the result does not depend on scheduling and no intermediate
+/// profiles are written to disk. Reading the next files overlaps with the
+/// analysis of the previous ones, and at most --pipeline-depth modules are in
+/// flight between reading and writing, which bounds the memory held by
+/// buffers and records. The statistics of the export are added to \p Stats
+/// and the time spent reading and loading modules, summed over threads, to
+/// \p ParseSeconds.
+static int runBatch(ArrayRef<std::string> Inputs, StringRef Output,
+                    const StaticProfileExporterOptions &Opts,
+                    const char *ProgName, StaticProfileStats &Stats,
+                    double &ParseSeconds) {
+  // Parallelism comes from processing several modules at once.
+  StaticProfileExporterOptions ModuleOpts = Opts;
+  ModuleOpts.Threads = 1;
+  ModuleOpts.OnWorkerThread = true;
+  // Modules finish in any order, so the main thread ranks the records as it
+  // writes them, in input order.
+  ModuleOpts.Hotness = nullptr;
+  // Block counts go to the frequency file in input order as well, through a
+  // writer per module.
+  ModuleOpts.Frequencies = nullptr;
+  StaticProfileDedup Dedup(Duplicates);
+  if (Duplicates != DuplicatePolicy::Sum)
+    ModuleOpts.Dedup = &Dedup;
+
+  struct ModuleResult {
+    BumpPtrAllocator Alloc;
+    StringSaver Names{Alloc};
+    std::vector<NamedInstrProfRecord> Records;
+    /// Symbol name of the function of each record, for the ranking; empty
+    /// for records captured from functions that no longer exist.
+    std::vector<StringRef> Symbols;
+    /// Profile name, hash and symbol name of the copies given to Dedup.
+    std::vector<std::tuple<StringRef, uint64_t, StringRef>> Averaged;
+    StaticFrequencyWriter Frequencies;
+    StaticProfileStats Stats;
+    double ParseSeconds = 0;
+    bool Loaded = false;
+  };
+
+  ThreadPoolStrategy AnalysisStrategy = hardware_concurrency(Opts.Threads);
+  size_t Depth = PipelineDepth ? PipelineDepth
+                               : 2 * AnalysisStrategy.compute_thread_count();
+
+  // Everything below is guarded by Mutex. A module is in flight from the
+  // time a reader takes it until the main thread has written its records.
+  std::mutex Mutex;
+  std::condition_variable Changed;
+  std::vector<std::unique_ptr<MemoryBuffer>> Buffers(Inputs.size());
+  std::vector<std::unique_ptr<ModuleResult>> Results(Inputs.size());
+  size_t NextRead = 0;
+  size_t Written = 0;
+  std::mutex DiagMutex;
+
+  auto Finish = [&](size_t I, std::unique_ptr<ModuleResult> Result) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Results[I] = std::move(Result);
+    }
+    Changed.notify_all();
+  };
+
+  auto Analyze = [&](size_t I, double ReadSeconds) {
+    auto Result = std::make_unique<ModuleResult>();
+    std::unique_ptr<MemoryBuffer> Buffer;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Buffer = std::move(Buffers[I]);
+    }
+    LLVMContext Context;
+    SMDiagnostic Err;
+    auto ParseStart = std::chrono::steady_clock::now();
+    uint64_t HeapStart = getHeapUsageBytes();
+    // A lazily loaded module reads its bodies from the buffer it owns, which
+    // the export may read again to analyze them on the side.
+    std::optional<MemoryBufferRef> SourceBitcode;
+    StringRef Bytes = Buffer->getBuffer();
+    if (Lazy && isBitcode(Bytes.bytes_begin(), Bytes.bytes_end()))
+      SourceBitcode = Buffer->getMemBufferRef();
+    std::unique_ptr<Module> M =
+        Lazy ? getLazyIRModule(std::move(Buffer), Err, Context)
+             : parseIR(Buffer->getMemBufferRef(), Err, Context);
+    Buffer.reset();
+    Result->ParseSeconds = ReadSeconds + secondsSince(ParseStart);
+    if (Opts.StatsMemory)
+      Result->Stats.IRBytes = getHeapGrowthBytes(HeapStart);
+    if (!M) {
+      std::lock_guard<std::mutex> Lock(DiagMutex);
+      Err.print(ProgName, errs());
+    } else {
+      StaticProfileExporterOptions ThisOpts = ModuleOpts;
+      if (Opts.Frequencies)
+        ThisOpts.Frequencies = &Result->Frequencies;
+      Result->Stats += exportStaticProfile(
+          *M, /*FAM=*/nullptr, ThisOpts,
+          [&](const Function *F, NamedInstrProfRecord &&Record) {
+            StringRef Symbol = F ? Result->Names.save(F->getName()) : "";
+            if (Duplicates == DuplicatePolicy::Average && F &&
+                StaticProfileDedup::mayBeDuplicated(*F)) {
+              Dedup.add(Record);
+              Result->Averaged.emplace_back(Result->Names.save(Record.Name),
+                                            Record.Hash, Symbol);
+              return;
+            }
+            // Keep value profiles of base profile records as well.
+            Record.Name = Result->Names.save(Record.Name);
+            Result->Records.push_back(std::move(Record));
+            Result->Symbols.push_back(Symbol);
+          },
+          /*Capture=*/nullptr, SourceBitcode);
+      Result->Loaded = true;
+    }
+    Finish(I, std::move(Result));
+  };
+
+  // The pools are declared last so that their threads are joined before the
+  // state they use goes away. Readers only block on I/O and on the depth of
+  // the pipeline, so they get their own pool and never hold up analyses.
+  DefaultThreadPool AnalysisPool(AnalysisStrategy);
+  DefaultThreadPool ReadPool(
+      hardware_concurrency(std::max(1u, unsigned(ReadThreads))));
+  for (unsigned R = 0, E = ReadPool.getMaxConcurrency(); R != E; ++R) {
+    ReadPool.async([&] {
+      while (true) {
+        size_t I;
+        {
+          std::unique_lock<std::mutex> Lock(Mutex);
+          Changed.wait(Lock, [&] {
+            return NextRead >= Inputs.size() || NextRead < Written + Depth;
+          });
+          if (NextRead >= Inputs.size())
+            return;
+          I = NextRead++;
+        }
+
+        // Read the whole file now instead of mapping it, so that the
+        // analysis does not fault its pages in from a remote file system.
+        auto ReadStart = std::chrono::steady_clock::now();
+        ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+            MemoryBuffer::getFile(Inputs[I], /*IsText=*/false,
+                                  /*RequiresNullTerminator=*/true,
+                                  /*IsVolatile=*/true);
+        double ReadSeconds = secondsSince(ReadStart);
+        if (!BufOrErr) {
+          {
+            std::lock_guard<std::mutex> Lock(DiagMutex);
+            errs() << "Error: Cannot read '" << Inputs[I]
+                   << "': " << BufOrErr.getError().message() << "\n";
+          }
+          Finish(I, std::make_unique<ModuleResult>());
+          continue;
+        }
+        {
+          std::lock_guard<std::mutex> Lock(Mutex);
+          Buffers[I] = std::move(*BufOrErr);
+        }
+        AnalysisPool.async([&Analyze, I, ReadSeconds] {
+          Analyze(I, ReadSeconds);
+        });
+      }
+    });
+  }
+
+  StaticProfileWriter Writer(Output.str(), Opts.StreamChunkSize,
+                             Opts.UpdateProfile);
+  // Averaged functions are ranked once their copies are all in, in the order
+  // their first copy appears in the input, by the symbol name of that copy.
+  // Keyed by the MD5 of the profile name and the hash, like Dedup.
+  using FunctionKey = std::pair<uint64_t, uint64_t>;
+  std::vector<std::pair<FunctionKey, std::string>> AveragedOrder;
+  DenseSet<FunctionKey> AveragedSeen;
+  // The frequency file keeps the blocks of the first copy of a function in
+  // input order; an averaged function gets the average counts if its hash is
+  // that of the first copy. Keyed by the MD5 of the profile name.
+  DenseMap<uint64_t, uint64_t> FrequencyHashes;
+  unsigned ModulesFailed = 0;
+  for (size_t I = 0, E = Inputs.size(); I != E; ++I) {
+    // The exports on the analysis threads are not timed; the main thread
+    // times each module from the end of the previous one until its records
+    // are in the writer.
+    StaticProfilePhase Phase("ExportModule", "Export the modules of a batch",
+                             Inputs[I]);
+    std::unique_ptr<ModuleResult> Result;
+    {
+      std::unique_lock<std::mutex> Lock(Mutex);
+      Changed.wait(Lock, [&] { return Results[I] != nullptr; });
+      Result = std::move(Results[I]);
+    }
+    ParseSeconds += Result->ParseSeconds;
+    if (!Result->Loaded) {
+      ++ModulesFailed;
+    } else {
+      for (size_t J = 0, N = Result->Records.size(); J != N; ++J) {
+        NamedInstrProfRecord &Record = Result->Records[J];
+        if (Opts.Hotness && !Result->Symbols[J].empty())
+          Opts.Hotness->addFunction(Result->Symbols[J], Record.Counts);
+        Writer.addRecord(std::move(Record), Stats);
+      }
+      if (Opts.Hotness)
+        for (const auto &[Name, Hash, Symbol] : Result->Averaged) {
+          FunctionKey Key(IndexedInstrProf::ComputeHash(Name), Hash);
+          if (AveragedSeen.insert(Key).second)
+            AveragedOrder.emplace_back(Key, Symbol.str());
+        }
+      if (Opts.Frequencies) {
+        for (const auto &[Name, Hash, Symbol] : Result->Averaged)
+          FrequencyHashes.try_emplace(IndexedInstrProf::ComputeHash(Name),
+                                      Hash);
+        Opts.Frequencies->merge(std::move(Result->Frequencies));
+      }
+      Stats += Result->Stats;
+    }
+    Result.reset();
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      ++Written;
+    }
+    Changed.notify_all();
+  }
+  ReadPool.wait();
+  AnalysisPool.wait();
+  DenseMap<FunctionKey, std::vector<uint64_t>> AveragedCounts;
+  Dedup.flush([&](const Function *, NamedInstrProfRecord &&Record) {
+    uint64_t GUID = IndexedInstrProf::ComputeHash(Record.Name);
+    if (Opts.Hotness)
+      AveragedCounts[{GUID, Record.Hash}] = Record.Counts;
+    if (Opts.Frequencies) {
+      auto It = FrequencyHashes.find(GUID);
+      if (It != FrequencyHashes.end() && It->second == Record.Hash)
+        Opts.Frequencies->replaceCounts(GUID, Record.Counts);
+    }
+    Writer.addRecord(std::move(Record), Stats);
+  });
+  for (const auto &[Key, Symbol] : AveragedOrder) {
+    auto It = AveragedCounts.find(Key);
+    if (It != AveragedCounts.end())
+      Opts.Hotness->addFunction(Symbol, It->second);
+  }
+
+  if (Stats.FunctionsProcessed == 0) {
+    errs() << "Error: No functions processed for static profile generation\n";
     return 1;
   }
 
-  std::string InputFilename = argv[1];
-  std::string OutputFilename = argc == 3 ? argv[2] : "output.profdata";
+  if (!Writer.write(Stats))
+    return 1;
+
+  outs() << "Static profile for " << (Inputs.size() - ModulesFailed)
+         << " module(s) written to: " << Output << "\n";
+  if (Dedup.getNumDuplicates())
+    outs() << "  " << Dedup.getNumDuplicates()
+           << (Duplicates == DuplicatePolicy::KeepOne
+                   ? " copy(ies) of functions defined by several modules "
+                     "skipped\n"
+                   : " copy(ies) of functions defined by several modules "
+                     "averaged\n");
+  printExportSummary(Stats, Opts);
+  printSlowestFunctions(outs(), Stats, Opts.SlowestFunctions);
+  if (ModulesFailed) {
+    errs() << "Error: " << ModulesFailed << " module(s) could not be loaded\n";
+    return 1;
+  }
+  return 0;
+}
 
+/// Link the modules \p Inputs into one and write its static profile to
+/// \p Output. The inputs are loaded lazily into a single context, so types
+/// are shared and only the bodies the linker keeps are read; a function
+/// defined in several modules keeps one definition and is analyzed once. The
+/// statistics of the export are added to \p Stats.
+static int runLinked(ArrayRef<std::string> Inputs, StringRef Output,
+                     const StaticProfileExporterOptions &Opts,
+                     const char *ProgName, StaticProfileStats &Stats,
+                     double &ParseSeconds) {
+  LLVMContext Context;
+  auto Combined = std::make_unique<Module>("llvm-sprofgen-linked", Context);
+  Linker L(*Combined);
+
+  uint64_t HeapStart = getHeapUsageBytes();
+  uint64_t Definitions = 0;
+  for (const std::string &Input : Inputs) {
+    SMDiagnostic Err;
+    auto ParseStart = std::chrono::steady_clock::now();
+    std::unique_ptr<Module> M = getLazyIRFileModule(Input, Err, Context);
+    if (!M) {
+      Err.print(ProgName, errs());
+      return 1;
+    }
+    // Linking renames clashing local functions; keep the names their records
+    // and coverage mapping use.
+    preserveProfileNames(*M);
+    for (const Function &F : *M)
+      if (!F.isDeclaration())
+        ++Definitions;
+    if (L.linkInModule(std::move(M))) {
+      errs() << "Error: Cannot link '" << Input << "'\n";
+      return 1;
+    }
+    ParseSeconds += secondsSince(ParseStart);
+  }
+
+  if (Opts.StatsMemory)
+    Stats.IRBytes += getHeapGrowthBytes(HeapStart);
+
+  uint64_t Linked = 0;
+  for (const Function &F : *Combined)
+    if (!F.isDeclaration())
+      ++Linked;
+  StaticProfileWriter Writer(Output.str(), Opts.StreamChunkSize,
+                             Opts.UpdateProfile);
+  Stats += exportStaticProfile(
+      *Combined, /*FAM=*/nullptr, Opts,
+      [&](const Function *, NamedInstrProfRecord &&Record) {
+        Writer.addRecord(std::move(Record), Stats);
+      });
+  Combined.reset();
+
+  if (Stats.FunctionsProcessed == 0) {
+    errs() << "Error: No functions processed for static profile generation\n";
+    return 1;
+  }
+
+  if (!Writer.write(Stats))
+    return 1;
+
+  outs() << "Static profile for " << Inputs.size()
+         << " linked module(s) written to: " << Output << "\n";
+  outs() << "  " << Linked << " of " << Definitions
+         << " function definition(s) kept after linking\n";
+  printExportSummary(Stats, Opts);
+  printSlowestFunctions(outs(), Stats, Opts.SlowestFunctions);
+  return 0;
+}
+
+/// Export \p M without a pass pipeline, for streaming and lazy loading. Block
+/// frequencies are computed without an analysis manager, so no analysis
+/// outlives its function, and the module is released before the indexed
+/// profile is built. \p SourceBitcode is the bitcode a lazily loaded \p M
+/// was read from. The statistics of the export are added to \p Stats.
+static int runDirect(std::unique_ptr<Module> M, StringRef Output,
+                     const StaticProfileExporterOptions &Opts,
+                     std::optional<MemoryBufferRef> SourceBitcode,
+                     StaticProfileStats &Stats) {
+  StaticProfileWriter Writer(Output.str(), Opts.StreamChunkSize,
+                             Opts.UpdateProfile);
+  Stats += exportStaticProfile(
+      *M, /*FAM=*/nullptr, Opts,
+      [&](const Function *, NamedInstrProfRecord &&Record) {
+        Writer.addRecord(std::move(Record), Stats);
+      },
+      /*Capture=*/nullptr, SourceBitcode);
+  M.reset();
+
+  if (Stats.FunctionsProcessed == 0) {
+    errs() << "Error: No functions processed for static profile generation\n";
+    return 1;
+  }
+
+  if (!Writer.write(Stats))
+    return 1;
+
+  outs() << "Static profile written to: " << Output << "\n";
+  printExportSummary(Stats, Opts);
+  printSlowestFunctions(outs(), Stats, Opts.SlowestFunctions);
+  return 0;
+}
+
+/// Print the coverage summary of the static profile of \p M, evaluating its
+/// coverage mapping against the counters as they are computed. Only
+/// instrumented functions are analyzed. The statistics of the export are added
+/// to \p Stats.
+static int runReport(Module &M, const StaticProfileExporterOptions &Opts,
+                     std::optional<MemoryBufferRef> SourceBitcode,
+                     StaticProfileStats &Stats) {
+  CoverageRecordIndex Index(M);
+  if (Index.empty()) {
+    errs() << "Error: '" << M.getModuleIdentifier()
+           << "' has no coverage mapping; build it with "
+              "-fprofile-instr-generate -fcoverage-mapping\n";
+    return 1;
+  }
+
+  StaticProfileExporterOptions ReportOpts = Opts;
+  ReportOpts.InstrumentedOnly = true;
+  ReportOpts.Index = &Index;
+  StaticCoverageReport Report;
+  Stats += exportStaticProfile(
+      M, /*FAM=*/nullptr, ReportOpts,
+      [&](const Function *F, NamedInstrProfRecord &&Record) {
+        // Records are named after the profile, but coverage records are keyed
+        // by the frontend name, which differs for local functions.
+        if (!F)
+          return;
+        if (const InstrumentedFunctionRecord *Instr =
+                Index.lookup(IndexedInstrProf::ComputeHash(getProfileName(*F))))
+          Report.addFunction(Index, *Instr, Record.Counts);
+      },
+      /*Capture=*/nullptr, SourceBitcode);
+
+  if (Report.empty()) {
+    errs() << "Error: No coverage mapping could be evaluated\n";
+    return 1;
+  }
+  Report.print(outs());
+  if (unsigned Unmapped = Report.getUnmappedFunctions())
+    errs() << "Warning: " << Unmapped
+           << " function(s) left out because their coverage mapping cannot "
+              "be decoded\n";
+  printSlowestFunctions(outs(), Stats, Opts.SlowestFunctions);
+  return 0;
+}
+
+/// Merge the profile shards \p Shards into \p Output. Without explicit shards,
+/// the ones written next to \p Output by a sharded export are used.
+static int runMergeShards(StringRef Output, std::vector<std::string> Shards,
+                          const StaticProfileExporterOptions &Opts) {
+  if (Shards.empty()) {
+    if (std::error_code EC = findStaticProfileShards(Output, Shards)) {
+      errs() << "Error: Cannot list profile shards of '" << Output
+             << "': " << EC.message() << "\n";
+      return 1;
+    }
+    if (Shards.empty()) {
+      errs() << "Error: No profile shards found next to '" << Output << "'\n";
+      return 1;
+    }
+  }
+
+  if (!PruneShardsBefore.empty()) {
+    sys::fs::file_status Stamp;
+    if (std::error_code EC = sys::fs::status(PruneShardsBefore, Stamp)) {
+      errs() << "Error: Cannot read '" << PruneShardsBefore
+             << "': " << EC.message() << "\n";
+      return 1;
+    }
+    unsigned Pruned = 0;
+    llvm::erase_if(Shards, [&](const std::string &Shard) {
+      sys::fs::file_status Status;
+      if (sys::fs::status(Shard, Status) ||
+          Status.getLastModificationTime() >= Stamp.getLastModificationTime())
+        return false;
+      if (std::error_code EC = sys::fs::remove(Shard))
+        errs() << "Warning: Cannot delete stale profile shard '" << Shard
+               << "': " << EC.message() << "\n";
+      ++Pruned;
+      return true;
+    });
+    outs() << "Pruned " << Pruned << " profile shard(s) older than '"
+           << PruneShardsBefore << "'\n";
+    if (Shards.empty()) {
+      errs() << "Error: No profile shards newer than '" << PruneShardsBefore
+             << "'\n";
+      return 1;
+    }
+  }
+
+  StaticProfileWriter Writer(Output.str(), Opts.StreamChunkSize);
+  StaticProfileStats Stats;
+  if (!mergeStaticProfileShards(Shards, Writer, Stats) || !Writer.write(Stats))
+    return 1;
+
+  outs() << "Merged " << Shards.size() << " profile shard(s) into: " << Output
+         << "\n";
+  return 0;
+}
+
+/// How close the counts \p Static of one engine come to the counts \p Real
+/// of a real run.
+struct CountAccuracy {
+  /// Fraction of counters that both agree are zero or nonzero.
+  double CoverageAgreement = 0;
+  /// Half the L1 distance between the counts normalized to sum to one: 0 when
+  /// they are proportional, 1 when no counter is nonzero in both.
+  double Distance = 0;
+};
+
+static std::optional<CountAccuracy>
+measureCountAccuracy(ArrayRef<uint64_t> Static, ArrayRef<uint64_t> Real) {
+  if (Static.empty() || Static.size() != Real.size())
+    return std::nullopt;
+
+  double StaticSum = 0, RealSum = 0;
+  for (size_t I = 0, E = Static.size(); I != E; ++I) {
+    StaticSum += Static[I];
+    RealSum += Real[I];
+  }
+
+  CountAccuracy Accuracy;
+  unsigned Agreeing = 0;
+  for (size_t I = 0, E = Static.size(); I != E; ++I) {
+    Agreeing += (Static[I] != 0) == (Real[I] != 0);
+    if (StaticSum && RealSum)
+      Accuracy.Distance +=
+          std::abs(Static[I] / StaticSum - Real[I] / RealSum) / 2;
+  }
+  Accuracy.CoverageAgreement = double(Agreeing) / Static.size();
+  if (!StaticSum || !RealSum)
+    Accuracy.Distance = StaticSum == RealSum ? 0 : 1;
+  return Accuracy;
+}
+
+/// Ranks of \p Values in ascending order, starting at 1; tied values share
+/// the mean of their ranks.
+static void computeRanks(ArrayRef<uint64_t> Values,
+                         std::vector<double> &Ranks) {
+  std::vector<size_t> Order(Values.size());
+  for (size_t I = 0, E = Order.size(); I != E; ++I)
+    Order[I] = I;
+  llvm::sort(Order, [&](size_t A, size_t B) { return Values[A] < Values[B]; });
+  Ranks.resize(Values.size());
+  for (size_t I = 0, E = Order.size(); I != E;) {
+    size_t J = I;
+    while (J != E && Values[Order[J]] == Values[Order[I]])
+      ++J;
+    double Rank = (I + J + 1) / 2.0;
+    for (; I != J; ++I)
+      Ranks[Order[I]] = Rank;
+  }
+}
+
+/// Spearman's rank correlation of \p Static and \p Real, or nothing if
+/// their sizes differ or either of them is constant.
+static std::optional<double> computeRankCorrelation(ArrayRef<uint64_t> Static,
+                                                    ArrayRef<uint64_t> Real) {
+  if (Static.size() < 2 || Static.size() != Real.size())
+    return std::nullopt;
+  std::vector<double> StaticRanks, RealRanks;
+  computeRanks(Static, StaticRanks);
+  computeRanks(Real, RealRanks);
+
+  // Both rank vectors have the same mean.
+  double Mean = (Static.size() + 1) / 2.0;
+  double Covariance = 0, StaticVariance = 0, RealVariance = 0;
+  for (size_t I = 0, E = Static.size(); I != E; ++I) {
+    double S = StaticRanks[I] - Mean, R = RealRanks[I] - Mean;
+    Covariance += S * R;
+    StaticVariance += S * S;
+    RealVariance += R * R;
+  }
+  if (StaticVariance == 0 || RealVariance == 0)
+    return std::nullopt;
+  return Covariance / std::sqrt(StaticVariance * RealVariance);
+}
+
+/// Score the static profile \p StaticPath against the profile of real runs
+/// \p RealPath and print the result as JSON, followed by a summary on
+/// stderr. Only functions with a record of the same hash in both are scored.
+static int runCompareProfiles(StringRef StaticPath, StringRef RealPath) {
+  auto FS = vfs::getRealFileSystem();
+  auto StaticOrErr = IndexedInstrProfReader::create(StaticPath, *FS);
+  if (!StaticOrErr) {
+    errs() << "Error: Cannot read static profile '" << StaticPath
+           << "': " << toString(StaticOrErr.takeError()) << "\n";
+    return 1;
+  }
+  auto RealOrErr = IndexedInstrProfReader::create(RealPath, *FS);
+  if (!RealOrErr) {
+    errs() << "Error: Cannot read profile '" << RealPath
+           << "': " << toString(RealOrErr.takeError()) << "\n";
+    return 1;
+  }
+  IndexedInstrProfReader &Static = **StaticOrErr;
+  IndexedInstrProfReader &Real = **RealOrErr;
+
+  unsigned Functions = 0, Matched = 0, Correlated = 0;
+  uint64_t Counters = 0;
+  double Agreeing = 0, Distance = 0, Correlation = 0;
+  // Maximum counts of the matched functions, the basis of hotness rankings.
+  std::vector<uint64_t> StaticMax, RealMax;
+  for (const NamedInstrProfRecord &Record : Static) {
+    ++Functions;
+    Expected<InstrProfRecord> RealRecord =
+        Real.getInstrProfRecord(Record.Name, Record.Hash);
+    if (!RealRecord) {
+      consumeError(RealRecord.takeError());
+      continue;
+    }
+    std::optional<CountAccuracy> Accuracy =
+        measureCountAccuracy(Record.Counts, RealRecord->Counts);
+    if (!Accuracy)
+      continue;
+
+    ++Matched;
+    Counters += Record.Counts.size();
+    Agreeing += Accuracy->CoverageAgreement * Record.Counts.size();
+    Distance += Accuracy->Distance;
+    if (std::optional<double> Rho =
+            computeRankCorrelation(Record.Counts, RealRecord->Counts)) {
+      ++Correlated;
+      Correlation += *Rho;
+    }
+    StaticMax.push_back(*std::max_element(Record.Counts.begin(),
+                                          Record.Counts.end()));
+    RealMax.push_back(*std::max_element(RealRecord->Counts.begin(),
+                                        RealRecord->Counts.end()));
+  }
+  if (Static.hasError()) {
+    errs() << "Error: Malformed static profile '" << StaticPath
+           << "': " << toString(Static.getError()) << "\n";
+    return 1;
+  }
+
+  std::optional<double> FunctionCorrelation =
+      computeRankCorrelation(StaticMax, RealMax);
+  auto Number = [](std::optional<double> V) -> json::Value {
+    if (!V)
+      return nullptr;
+    return *V;
+  };
+  json::OStream J(outs(), /*IndentSize=*/2);
+  J.object([&] {
+    J.attribute("functions", int64_t(Functions));
+    J.attribute("functions_matched", int64_t(Matched));
+    J.attribute("counters", int64_t(Counters));
+    J.attribute("coverage_error",
+                Counters ? json::Value(1 - Agreeing / Counters) : nullptr);
+    J.attribute("mean_distance",
+                Matched ? json::Value(Distance / Matched) : nullptr);
+    J.attribute("mean_count_rank_correlation",
+                Correlated ? json::Value(Correlation / Correlated) : nullptr);
+    J.attribute("function_rank_correlation", Number(FunctionCorrelation));
+  });
+  outs() << "\n";
+
+  auto PrintScore = [](std::optional<double> V) {
+    if (V)
+      errs() << format("%.4f", *V);
+    else
+      errs() << "n/a";
+  };
+  errs() << "Matched " << Matched << " of " << Functions
+         << " function(s) with the profile of real runs";
+  if (Counters) {
+    errs() << "; coverage error ";
+    PrintScore(1 - Agreeing / Counters);
+    errs() << ", mean count rank correlation ";
+    PrintScore(Correlated ? std::optional<double>(Correlation / Correlated)
+                          : std::nullopt);
+    errs() << ", function rank correlation ";
+    PrintScore(FunctionCorrelation);
+  }
+  errs() << "\n";
+  return 0;
+}
+
+/// Print the per-function analysis time of both branch probability engines
+/// on \p M as CSV, and with a reference profile, the accuracy of their counts,
+/// followed by a summary on stderr.
+static int runCompareBranchHeuristics(Module &M,
+                                      const StaticProfileExporterOptions &Opts) {
+  std::unique_ptr<IndexedInstrProfReader> Reference;
+  if (!ReferenceProfile.empty()) {
+    auto FS = vfs::getRealFileSystem();
+    auto ReaderOrErr = IndexedInstrProfReader::create(ReferenceProfile, *FS);
+    if (!ReaderOrErr) {
+      errs() << "Error: Cannot read reference profile '" << ReferenceProfile
+             << "': " << toString(ReaderOrErr.takeError()) << "\n";
+      return 1;
+    }
+    Reference = std::move(*ReaderOrErr);
+  }
+
+  outs() << "function,blocks,stock_us,wularus_us";
+  if (Reference)
+    outs() << ",stock_coverage_agreement,wularus_coverage_agreement,"
+              "stock_distance,wularus_distance";
+  outs() << "\n";
+
+  unsigned Functions = 0, Measured = 0;
+  double StockSeconds = 0, WuLarusSeconds = 0;
+  CountAccuracy StockTotal, WuLarusTotal;
+  compareBranchProbabilityEngines(M, Opts, [&](BranchEngineComparison &&C) {
+    ++Functions;
+    StockSeconds += C.Stock.Seconds;
+    WuLarusSeconds += C.WuLarus.Seconds;
+    outs() << C.Name << "," << C.NumBlocks << ","
+           << format("%.3f", C.Stock.Seconds * 1e6) << ","
+           << format("%.3f", C.WuLarus.Seconds * 1e6);
+    if (!Reference) {
+      outs() << "\n";
+      return;
+    }
+
+    std::optional<CountAccuracy> Stock, WuLarus;
+    Expected<InstrProfRecord> Real =
+        Reference->getInstrProfRecord(C.Name, C.Hash, C.PGOName);
+    if (Real) {
+      Stock = measureCountAccuracy(C.Stock.Counts, Real->Counts);
+      WuLarus = measureCountAccuracy(C.WuLarus.Counts, Real->Counts);
+    } else {
+      consumeError(Real.takeError());
+    }
+    if (!Stock || !WuLarus) {
+      outs() << ",,,,\n";
+      return;
+    }
+
+    ++Measured;
+    StockTotal.CoverageAgreement += Stock->CoverageAgreement;
+    WuLarusTotal.CoverageAgreement += WuLarus->CoverageAgreement;
+    StockTotal.Distance += Stock->Distance;
+    WuLarusTotal.Distance += WuLarus->Distance;
+    outs() << "," << format("%.4f", Stock->CoverageAgreement) << ","
+           << format("%.4f", WuLarus->CoverageAgreement) << ","
+           << format("%.4f", Stock->Distance) << ","
+           << format("%.4f", WuLarus->Distance) << "\n";
+  });
+
+  errs() << "Compared " << Functions << " function(s): BranchProbabilityInfo "
+         << format("%.3f", StockSeconds * 1e3) << " ms, Wu-Larus "
+         << format("%.3f", WuLarusSeconds * 1e3) << " ms\n";
+  if (Reference) {
+    errs() << "  " << Measured << " function(s) found in the reference profile";
+    if (Measured)
+      errs() << "; mean coverage agreement "
+             << format("%.4f", StockTotal.CoverageAgreement / Measured)
+             << " vs "
+             << format("%.4f", WuLarusTotal.CoverageAgreement / Measured)
+             << ", mean distance "
+             << format("%.4f", StockTotal.Distance / Measured) << " vs "
+             << format("%.4f", WuLarusTotal.Distance / Measured);
+    errs() << "\n";
+  }
+  return 0;
+}
+
+/// Export the module in \p InputFilename to \p OutputFilename, or compare
+/// branch probability engines on it. The statistics of the export are added
+/// to \p Stats and the time spent loading the module to \p ParseSeconds.
+static int runSingle(StringRef InputFilename, StringRef OutputFilename,
+                     const StaticProfileExporterOptions &Opts,
+                     const char *ProgName, StaticProfileStats &Stats,
+                     double &ParseSeconds) {
   LLVMContext Context;
   SMDiagnostic Err;
+  auto ParseStart = std::chrono::steady_clock::now();
+  uint64_t HeapStart = getHeapUsageBytes();
+
+  if (Lazy && !CompareBranchHeuristics) {
+    // The module reads function bodies from this buffer on demand, and so do
+    // the worker threads when the input is bitcode.
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufOrErr =
+        MemoryBuffer::getFileOrSTDIN(InputFilename);
+    if (!BufOrErr) {
+      errs() << "Error: Cannot read '" << InputFilename
+             << "': " << BufOrErr.getError().message() << "\n";
+      return 1;
+    }
+    MemoryBufferRef Buffer = (*BufOrErr)->getMemBufferRef();
+    std::unique_ptr<Module> M = getLazyIRModule(
+        MemoryBuffer::getMemBuffer(Buffer, /*RequiresNullTerminator=*/false),
+        Err, Context);
+    if (!M) {
+      Err.print(ProgName, errs());
+      return 1;
+    }
+    ParseSeconds += secondsSince(ParseStart);
+    if (Opts.StatsMemory)
+      Stats.IRBytes += getHeapGrowthBytes(HeapStart);
+    std::optional<MemoryBufferRef> SourceBitcode;
+    StringRef Bytes = Buffer.getBuffer();
+    if (isBitcode(Bytes.bytes_begin(), Bytes.bytes_end()))
+      SourceBitcode = Buffer;
+    if (Report)
+      return runReport(*M, Opts, SourceBitcode, Stats);
+    return runDirect(std::move(M), OutputFilename, Opts, SourceBitcode, Stats);
+  }
 
   // Load the input module
   std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
   if (!M) {
-    Err.print(argv[0], errs());
+    Err.print(ProgName, errs());
     return 1;
   }
+  ParseSeconds += secondsSince(ParseStart);
+  if (Opts.StatsMemory)
+    Stats.IRBytes += getHeapGrowthBytes(HeapStart);
+
+  if (CompareBranchHeuristics)
+    return runCompareBranchHeuristics(*M, Opts);
+
+  if (Report)
+    return runReport(*M, Opts, std::nullopt, Stats);
+
+  if (Opts.StreamChunkSize)
+    return runDirect(std::move(M), OutputFilename, Opts, std::nullopt, Stats);
 
   // Create analysis managers
   LoopAnalysisManager LAM;
@@ -87,9 +1328,438 @@ int main(int argc, char **argv) {
 
   // Run the static profile exporter pass
   ModulePassManager MPM;
-  MPM.addPass(StaticProfileExporterPass(OutputFilename));
+  MPM.addPass(StaticProfileExporterPass(OutputFilename.str(), Opts,
+                                        /*Capture=*/nullptr, &Stats));
+  unsigned WriteFailures = Stats.WriteFailures;
   MPM.run(*M, MAM);
+  // The pass reports its errors on stderr and carries on; the tool must not.
+  if (Stats.WriteFailures != WriteFailures)
+    return 1;
 
   outs() << "Static profile written to: " << OutputFilename << "\n";
+  printExportSummary(Stats, Opts);
+  return 0;
+}
+
+/// Print where the heap of an export went, in MiB, as recorded with
+/// --stats-memory.
+static void printMemoryStats(raw_ostream &OS, const StaticProfileStats &Stats) {
+  auto MiB = [](uint64_t Bytes) { return format("%.1f", Bytes / 1048576.0); };
+  OS << "Memory:\n";
+  auto Line = [&](StringRef Label, uint64_t Bytes) {
+    OS << "  " << left_justify(Label, 22) << MiB(Bytes) << " MiB\n";
+  };
+  Line("IR:", Stats.IRBytes);
+  Line("Analyses (peak):", Stats.AnalysisPeakBytes);
+  Line("Analyses (retained):", Stats.AnalysisRetainedBytes);
+  Line("Profile records:", Stats.RecordBytes);
+  Line("Writing (RSS growth):", Stats.WritePeakRSSGrowth);
+  if (std::optional<uint64_t> PeakRSS = getPeakRSSBytes())
+    Line("Peak RSS:", *PeakRSS);
+  if (Lazy)
+    OS << "  (function bodies loaded lazily count as analyses)\n";
+}
+
+/// Write the throughput, peak memory and phase times of an export of
+/// \p Inputs that took \p WallSeconds to \p Path as JSON.
+static bool writeBenchmarkReport(StringRef Path, ArrayRef<std::string> Inputs,
+                                 const StaticProfileExporterOptions &Opts,
+                                 const StaticProfileStats &Stats,
+                                 double ParseSeconds, double WallSeconds) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "Error: Cannot open benchmark report '" << Path
+           << "': " << EC.message() << "\n";
+    return false;
+  }
+
+  auto PerSecond = [&](double N) -> json::Value {
+    if (WallSeconds <= 0)
+      return nullptr;
+    return N / WallSeconds;
+  };
+
+  json::OStream J(OS, /*IndentSize=*/2);
+  J.object([&] {
+    J.attribute("casp_cache_version", int64_t(StaticProfileCache::Version));
+    J.attribute("llvm_version", LLVM_VERSION_STRING);
+    J.attributeArray("inputs", [&] {
+      for (const std::string &Input : Inputs)
+        J.value(Input);
+    });
+    J.attribute("threads", int64_t(Opts.Threads));
+    J.attribute("functions", int64_t(Stats.FunctionsProcessed));
+    J.attribute("functions_skipped", int64_t(Stats.FunctionsSkipped));
+    J.attribute("cache_hits", int64_t(Stats.CacheHits));
+    J.attribute("functions_from_base_profile",
+                int64_t(Stats.FunctionsFromBaseProfile));
+    J.attribute("functions_filtered", int64_t(Stats.FunctionsFiltered));
+    J.attribute("blocks", int64_t(Stats.BlocksAnalyzed));
+    J.attribute("wall_seconds", WallSeconds);
+    J.attribute("functions_per_second", PerSecond(Stats.FunctionsProcessed));
+    J.attribute("blocks_per_second", PerSecond(Stats.BlocksAnalyzed));
+    if (std::optional<uint64_t> PeakRSS = getPeakRSSBytes())
+      J.attribute("peak_rss_bytes", int64_t(*PeakRSS));
+    else
+      J.attribute("peak_rss_bytes", nullptr);
+    if (Opts.StatsMemory)
+      J.attributeObject("memory_bytes", [&] {
+        J.attribute("ir", int64_t(Stats.IRBytes));
+        J.attribute("analyses_peak", int64_t(Stats.AnalysisPeakBytes));
+        J.attribute("analyses_retained", int64_t(Stats.AnalysisRetainedBytes));
+        J.attribute("records", int64_t(Stats.RecordBytes));
+        J.attribute("write_peak_rss_growth", int64_t(Stats.WritePeakRSSGrowth));
+      });
+    J.attributeObject("phase_seconds", [&] {
+      J.attribute("parse", ParseSeconds);
+      J.attribute("bfi", Stats.BFISeconds);
+      J.attribute("convert", Stats.ConvertSeconds);
+      J.attribute("write", Stats.WriteSeconds);
+    });
+  });
+  OS << "\n";
+  return true;
+}
+
+/// Print the blocks of the functions with the GUIDs \p GUIDs, or of every
+/// function, in the static frequency file \p Path.
+static int runShowFrequencies(StringRef Path, ArrayRef<std::string> GUIDs) {
+  Expected<std::unique_ptr<StaticFrequencyFile>> FileOrErr =
+      StaticFrequencyFile::open(Path);
+  if (!FileOrErr) {
+    errs() << "Error: " << toString(FileOrErr.takeError()) << "\n";
+    return 1;
+  }
+  const StaticFrequencyFile &File = **FileOrErr;
+
+  std::vector<uint64_t> Selected;
+  for (StringRef Arg : GUIDs) {
+    uint64_t GUID;
+    if (Arg.getAsInteger(0, GUID)) {
+      errs() << "Error: Invalid function GUID '" << Arg << "'\n";
+      return 1;
+    }
+    Selected.push_back(GUID);
+  }
+  if (GUIDs.empty())
+    for (size_t I = 0, E = File.size(); I != E; ++I)
+      Selected.push_back(File.getGUID(I));
+
+  int Result = 0;
+  SmallVector<uint32_t, 32> Lines;
+  SmallVector<uint64_t, 32> Counts;
+  for (uint64_t GUID : Selected) {
+    if (!File.lookup(GUID, Lines, Counts)) {
+      errs() << "Error: No function with GUID " << GUID << " in '" << Path
+             << "'\n";
+      Result = 1;
+      continue;
+    }
+    outs() << "GUID " << format_hex(GUID, 18) << ": " << Counts.size()
+           << " block(s)\n";
+    for (size_t I = 0, E = Counts.size(); I != E; ++I)
+      outs() << format("  %6zu  line %6u  %20" PRIu64 "\n", I, Lines[I],
+                       Counts[I]);
+  }
+  return Result;
+}
+
+/// Serve export requests read from stdin until it is closed. Every request is
+/// a line of JSON, {"input": "<IR file>", "output": "<profile>"}, and gets a
+/// line of JSON in reply, with the output path and the statistics of the
+/// export, or an "error" member. The analysis managers and the pool worker
+/// threads run on are set up once and reused, so a request only pays for
+/// parsing its module and analyzing it.
+static int runServer(StaticProfileExporterOptions Opts, StringRef ProgName) {
+  std::optional<DefaultThreadPool> Pool;
+  if (Opts.Threads != 1)
+    Opts.Pool = &Pool.emplace(hardware_concurrency(Opts.Threads));
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  std::string Line;
+  while (std::getline(std::cin, Line)) {
+    if (StringRef(Line).trim().empty())
+      continue;
+
+    auto Start = std::chrono::steady_clock::now();
+    json::Object Response;
+    auto Fail = [&](const Twine &Message) {
+      Response["error"] = Message.str();
+    };
+
+    std::string Input, Output;
+    Expected<json::Value> Request = json::parse(Line);
+    if (!Request) {
+      Fail("malformed request: " + toString(Request.takeError()));
+    } else if (const json::Object *Obj = Request->getAsObject()) {
+      if (std::optional<StringRef> S = Obj->getString("input"))
+        Input = S->str();
+      if (std::optional<StringRef> S = Obj->getString("output"))
+        Output = S->str();
+      Response["input"] = Input;
+      if (Input.empty() || Output.empty())
+        Fail("request needs an \"input\" and an \"output\" path");
+    } else {
+      Fail("request is not a JSON object");
+    }
+
+    StaticProfileStats Stats;
+    if (!Response.get("error")) {
+      LLVMContext Context;
+      SMDiagnostic Err;
+      std::unique_ptr<Module> M = parseIRFile(Input, Err, Context);
+      if (!M) {
+        std::string Message;
+        raw_string_ostream OS(Message);
+        Err.print(ProgName.data(), OS, /*ShowColors=*/false);
+        Fail(StringRef(Message).trim());
+      } else {
+        StaticProfileWriter Writer(Output, Opts.StreamChunkSize,
+                                   Opts.UpdateProfile);
+        Stats += exportStaticProfile(
+            *M, &FAM, Opts,
+            [&](const Function *, NamedInstrProfRecord &&Record) {
+              Writer.addRecord(std::move(Record), Stats);
+            });
+        // Cached results point into the module.
+        FAM.clear();
+        MAM.clear();
+        if (Stats.FunctionsProcessed == 0)
+          Fail("no functions processed");
+        else if (!Writer.write(Stats))
+          Fail("cannot write profile '" + Output + "'");
+        else
+          Response["output"] = Output;
+      }
+    }
+
+    Response["functions"] = int64_t(Stats.FunctionsProcessed);
+    Response["functions_skipped"] = int64_t(Stats.FunctionsSkipped);
+    Response["functions_filtered"] = int64_t(Stats.FunctionsFiltered);
+    Response["cache_hits"] = int64_t(Stats.CacheHits);
+    Response["functions_from_base_profile"] =
+        int64_t(Stats.FunctionsFromBaseProfile);
+    Response["seconds"] = secondsSince(Start);
+    outs() << json::Value(std::move(Response)) << "\n";
+    outs().flush();
+  }
   return 0;
 }
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+
+  UseWuLarusHeuristics.addCategory(CASPCategory);
+  // Times the phases of the export (see StaticProfilePhase).
+  if (cl::Option *TimePasses =
+          cl::getRegisteredOptions().lookup("time-passes"))
+    TimePasses->addCategory(CASPCategory);
+  cl::HideUnrelatedOptions(CASPCategory);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "CASP - Coverage Approximation via Static Profiles\n\n"
+      "  This tool generates static profile data from LLVM IR using block\n"
+      "  frequency analysis. The output is compatible with llvm-profdata and\n"
+      "  can be used with llvm-cov for coverage visualization.\n");
+
+  if (EntryCount == 0) {
+    errs() << "Error: --entry-count must be nonzero\n";
+    return 1;
+  }
+
+  StaticProfileExporterOptions Opts;
+  Opts.EntryCount = EntryCount;
+  Opts.UseFunctionEntryCount = UseFunctionEntryCount;
+  Opts.PropagateEntryCounts = PropagateEntryCounts;
+  Opts.Threads = Threads;
+  Opts.StreamChunkSize = StreamChunkSize;
+  Opts.CacheDir = CacheDir;
+  Opts.UpdateProfile = Update;
+  Opts.InstrumentedOnly = InstrumentedOnly;
+  Opts.WuLarusHeuristics = UseWuLarusHeuristics;
+  Opts.RefineLoopTripCounts = RefineTripCounts;
+  Opts.SlowestFunctions = ReportSlowest;
+  Opts.StatsMemory = StatsMemory;
+  Opts.ClearAnalyses = ClearAnalyses;
+
+  FunctionFilterOptions FilterOpts;
+  FilterOpts.IncludeFiles.assign(IncludeFiles.begin(), IncludeFiles.end());
+  FilterOpts.ExcludeFiles.assign(ExcludeFiles.begin(), ExcludeFiles.end());
+  FilterOpts.IncludeFunctions.assign(IncludeFunctions.begin(),
+                                     IncludeFunctions.end());
+  FilterOpts.ExcludeFunctions.assign(ExcludeFunctions.begin(),
+                                     ExcludeFunctions.end());
+  FilterOpts.IncludeSections.assign(IncludeSections.begin(),
+                                    IncludeSections.end());
+  FilterOpts.ExcludeSections.assign(ExcludeSections.begin(),
+                                    ExcludeSections.end());
+  FilterOpts.IncludeGUIDFile = IncludeGUIDs;
+  FilterOpts.ExcludeGUIDFile = ExcludeGUIDs;
+  FilterOpts.SamplePercent = SamplePercent;
+  auto FilterOrErr = FunctionFilter::create(FilterOpts);
+  if (!FilterOrErr) {
+    errs() << "Error: " << toString(FilterOrErr.takeError()) << "\n";
+    return 1;
+  }
+  Opts.Filter = std::move(*FilterOrErr);
+
+  if (!BaseProfile.empty()) {
+    auto BaseOrErr = DynamicBaseProfile::create(BaseProfile);
+    if (!BaseOrErr) {
+      errs() << "Error: " << toString(BaseOrErr.takeError()) << "\n";
+      return 1;
+    }
+    Opts.BaseProfile = std::move(*BaseOrErr);
+    if (!EntryCount.getNumOccurrences() && Opts.BaseProfile->getEntryCount())
+      Opts.EntryCount = Opts.BaseProfile->getEntryCount();
+  }
+
+  if (MergeShards) {
+    if (Positionals.empty()) {
+      errs() << "Usage: " << argv[0]
+             << " --merge-shards <output.profdata> [shard...]\n";
+      return 1;
+    }
+    return runMergeShards(
+        Positionals.front(),
+        std::vector<std::string>(Positionals.begin() + 1, Positionals.end()),
+        Opts);
+  }
+
+  if (ShowFrequencies) {
+    if (Positionals.empty()) {
+      errs() << "Usage: " << argv[0]
+             << " --show-frequencies <file> [GUID...]\n";
+      return 1;
+    }
+    return runShowFrequencies(
+        Positionals.front(),
+        std::vector<std::string>(Positionals.begin() + 1, Positionals.end()));
+  }
+
+  if (CompareProfiles) {
+    if (Positionals.size() != 2) {
+      errs() << "Usage: " << argv[0]
+             << " --compare-profiles <static.profdata> <real.profdata>\n";
+      return 1;
+    }
+    return runCompareProfiles(Positionals[0], Positionals[1]);
+  }
+
+  if (Serve) {
+    if (!Positionals.empty() || !InputList.empty() || !CompileCommands.empty()) {
+      errs() << "Error: --serve takes its inputs from stdin\n";
+      return 1;
+    }
+    return runServer(Opts, argv[0]);
+  }
+
+  if (!TimeTrace.empty())
+    timeTraceProfilerInitialize(TimeTraceGranularity, argv[0]);
+  auto WriteTimeTrace = make_scope_exit([&] {
+    if (!timeTraceProfilerEnabled())
+      return;
+    if (Error Err = timeTraceProfilerWrite(TimeTrace, TimeTrace))
+      errs() << "Warning: Cannot write time trace '" << TimeTrace
+             << "': " << toString(std::move(Err)) << "\n";
+    timeTraceProfilerCleanup();
+  });
+
+  std::optional<StaticFrequencyWriter> Frequencies;
+  if (!FrequencyFile.empty())
+    Opts.Frequencies = &Frequencies.emplace();
+  std::optional<HotnessRanking> Hotness;
+  if (HotFunctions || !SymbolOrderingFile.empty()) {
+    Opts.Hotness = &Hotness.emplace(
+        HotFunctions, /*KeepFunctions=*/!SymbolOrderingFile.empty());
+    if (!Opts.PropagateEntryCounts && !Opts.UseFunctionEntryCount)
+      errs() << "Warning: Every function is scaled to the same entry count; "
+                "use --propagate-entry-counts to rank functions against each "
+                "other\n";
+  }
+
+  auto Start = std::chrono::steady_clock::now();
+  StaticProfileStats Stats;
+  double ParseSeconds = 0;
+  std::vector<std::string> Inputs;
+  int Result;
+
+  if (!InputList.empty() || !CompileCommands.empty()) {
+    if (Positionals.size() > 1) {
+      errs() << "Error: Batch mode takes at most one positional argument, "
+                "the output profile\n";
+      return 1;
+    }
+    if (Report) {
+      errs() << "Error: --report takes a single input module\n";
+      return 1;
+    }
+
+    if (!InputList.empty() && !readInputList(InputList, Inputs))
+      return 1;
+    if (!CompileCommands.empty() && !readCompileCommands(CompileCommands, Inputs))
+      return 1;
+    if (Inputs.empty()) {
+      errs() << "Error: No input modules found\n";
+      return 1;
+    }
+
+    std::string Output =
+        Positionals.empty() ? "output.profdata" : Positionals.front();
+    Result = Link ? runLinked(Inputs, Output, Opts, argv[0], Stats,
+                              ParseSeconds)
+                  : runBatch(Inputs, Output, Opts, argv[0], Stats,
+                             ParseSeconds);
+  } else {
+    if (Link) {
+      errs() << "Error: --link takes the modules of --input-list or "
+                "--compile-commands\n";
+      return 1;
+    }
+    if (Positionals.empty() || Positionals.size() > 2) {
+      errs() << "Usage: " << argv[0] << " <input.ll> [output.profdata]\n";
+      errs() << "Run '" << argv[0] << " --help' for more information.\n";
+      return 1;
+    }
+
+    Inputs.push_back(Positionals[0]);
+    std::string Output =
+        Positionals.size() == 2 ? Positionals[1] : "output.profdata";
+    Result = runSingle(Inputs.front(), Output, Opts, argv[0], Stats,
+                       ParseSeconds);
+  }
+
+  if (Result == 0 && Frequencies && !Frequencies->write(FrequencyFile))
+    return 1;
+  if (Result == 0 && Hotness) {
+    if (HotFunctions)
+      Hotness->print(outs());
+    if (!SymbolOrderingFile.empty() &&
+        !Hotness->writeSymbolOrderingFile(SymbolOrderingFile))
+      return 1;
+  }
+
+  if (Result == 0 && StatsMemory) {
+    if (Opts.Threads != 1)
+      errs() << "Warning: Memory statistics of a parallel export mix the "
+                "phases of concurrent work; use --threads=1\n";
+    printMemoryStats(outs(), Stats);
+  }
+
+  if (!BenchmarkJSON.empty() &&
+      !writeBenchmarkReport(BenchmarkJSON, Inputs, Opts, Stats, ParseSeconds,
+                            secondsSince(Start)))
+    return 1;
+  return Result;
+}
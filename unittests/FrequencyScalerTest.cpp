@@ -0,0 +1,144 @@
+//===- FrequencyScalerTest.cpp - Scaling of block frequencies -------------===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Scales arrays of frequencies with FrequencyScaler and checks every count
+// against floor(EntryCount * Freq / EntryFreq), computed by long division:
+// entry counts and frequencies on both sides of the 32-bit boundary, so the
+// vector kernels and the scalar fallback both run, frequencies around 2^32
+// within one vector, saturated results, and lengths that are not a multiple
+// of the vector width.
+//
+//===----------------------------------------------------------------------===//
+
+#include "FrequencyScaler.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static constexpr uint64_t Max = std::numeric_limits<uint64_t>::max();
+static constexpr uint64_t Max32 = std::numeric_limits<uint32_t>::max();
+
+static unsigned Failures = 0;
+
+static void check(bool Condition, const Twine &What) {
+  if (Condition)
+    return;
+  errs() << "FAIL: " << What << "\n";
+  ++Failures;
+}
+
+/// floor(EntryCount * Freq / EntryFreq), saturated to 64 bits, one bit at a
+/// time.
+static uint64_t reference(uint64_t EntryCount, uint64_t Freq,
+                          uint64_t EntryFreq) {
+  // The 128-bit product, by shifting and adding.
+  uint64_t Hi = 0, Lo = 0;
+  for (int Bit = 63; Bit >= 0; --Bit) {
+    Hi = (Hi << 1) | (Lo >> 63);
+    Lo <<= 1;
+    if ((Freq >> Bit) & 1) {
+      uint64_t Sum = Lo + EntryCount;
+      Hi += Sum < Lo;
+      Lo = Sum;
+    }
+  }
+
+  uint64_t Rem = 0, Quotient = 0;
+  for (int Bit = 127; Bit >= 0; --Bit) {
+    bool Carry = Rem >> 63;
+    Rem = (Rem << 1) | (((Bit >= 64 ? Hi >> (Bit - 64) : Lo >> Bit)) & 1);
+    if (Carry || Rem >= EntryFreq) {
+      Rem -= EntryFreq;
+      if (Bit >= 64)
+        return Max;
+      Quotient |= uint64_t(1) << Bit;
+    }
+  }
+  return Quotient;
+}
+
+/// Scale \p Freqs and compare every count, and the scalar scale(), with the
+/// reference.
+static void checkScale(uint64_t EntryCount, uint64_t EntryFreq,
+                       const std::vector<uint64_t> &Freqs) {
+  FrequencyScaler Scaler(EntryCount, EntryFreq);
+  std::vector<uint64_t> Counts(Freqs.size());
+  Scaler.scale(Freqs, Counts.data());
+  // In place as well, as the exporter does.
+  std::vector<uint64_t> InPlace = Freqs;
+  Scaler.scale(InPlace, InPlace.data());
+
+  for (size_t I = 0, E = Freqs.size(); I != E; ++I) {
+    uint64_t Expected = reference(EntryCount, Freqs[I], EntryFreq);
+    std::string Case = (Twine(EntryCount) + " * " + Twine(Freqs[I]) + " / " +
+                        Twine(EntryFreq) + " at " + Twine(I) + " of " +
+                        Twine(Freqs.size()))
+                           .str();
+    check(Counts[I] == Expected, "array " + Case);
+    check(InPlace[I] == Expected, "in place " + Case);
+    check(Scaler.scale(Freqs[I]) == Expected, "scalar " + Case);
+  }
+}
+
+int main() {
+  const uint64_t EntryCounts[] = {0,         1,         1000,
+                                  Max32 - 1, Max32,     Max32 + 1,
+                                  1ULL << 40, Max / 3,   Max};
+  const uint64_t EntryFreqs[] = {1,     3,         8,         1ULL << 14,
+                                 Max32 - 1, Max32,     Max32 + 1, 1ULL << 48,
+                                 Max};
+
+  // Frequencies on both sides of 2^32 and of the entry frequency, mixed in
+  // every lane of a vector.
+  std::vector<uint64_t> Edges = {0,         1,          2,
+                                 Max32 - 1, Max32,      Max32 + 1,
+                                 Max32 + 2, 1ULL << 33, Max - 1,
+                                 Max};
+
+  // A deterministic stream of frequencies, mostly narrow.
+  uint64_t State = 0x9e3779b97f4a7c15ULL;
+  auto Next = [&] {
+    State = State * 6364136223846793005ULL + 1442695040888963407ULL;
+    return State;
+  };
+
+  for (uint64_t EntryCount : EntryCounts) {
+    for (uint64_t EntryFreq : EntryFreqs) {
+      std::vector<uint64_t> Freqs = Edges;
+      Freqs.push_back(EntryFreq - 1);
+      Freqs.push_back(EntryFreq);
+      if (EntryFreq != Max)
+        Freqs.push_back(EntryFreq + 1);
+      checkScale(EntryCount, EntryFreq, Freqs);
+
+      // Every length up to a few vectors, and one long enough for the kernel
+      // to run long before its tail.
+      for (size_t N : {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 13, 1027}) {
+        std::vector<uint64_t> Stream(N);
+        for (uint64_t &Freq : Stream) {
+          uint64_t Bits = Next();
+          // One in eight frequencies is wide, so the kernel falls back on
+          // some vectors and not on others.
+          uint64_t Range = EntryFreq <= Max32 ? 4 * EntryFreq : Max32 + 1;
+          Freq = (Bits >> 61) ? (Bits >> 16) % Range : Bits;
+        }
+        checkScale(EntryCount, EntryFreq, Stream);
+      }
+    }
+  }
+
+  if (Failures)
+    return 1;
+  outs() << "PASS\n";
+  return 0;
+}
@@ -0,0 +1,144 @@
+//===- StaticFrequencyFileTest.cpp - Static frequency file round trip -----===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Writes a static frequency file, reads it back and checks that every function
+// decodes to what was added, that the first of several additions of a
+// function is kept, and that a file whose index claims more blocks than its
+// data holds is rejected.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StaticFrequencyFile.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+struct TestFunction {
+  uint64_t GUID;
+  std::vector<uint32_t> Lines;
+  std::vector<uint64_t> Counts;
+};
+
+} // end anonymous namespace
+
+static unsigned Failures = 0;
+
+static void check(bool Condition, const Twine &What) {
+  if (Condition)
+    return;
+  errs() << "FAIL: " << What << "\n";
+  ++Failures;
+}
+
+int main() {
+  // Deltas that wrap around in both directions, a function without blocks,
+  // and GUIDs added out of order.
+  const std::vector<TestFunction> Functions = {
+      {0xfedcba9876543210ULL,
+       {12, 3, 3, 40},
+       {100, 0, std::numeric_limits<uint64_t>::max(), 7}},
+      {0x1ULL, {}, {}},
+      {0x8000000000000000ULL, {0}, {1}},
+  };
+
+  SmallString<128> Path;
+  if (std::error_code EC =
+          sys::fs::createTemporaryFile("casp-frequencies", "sfreq", Path)) {
+    errs() << "FAIL: cannot create a temporary file: " << EC.message() << "\n";
+    return 1;
+  }
+
+  // The first function is added again, through another writer, and the
+  // counts of the last one are replaced; neither may change what is read.
+  StaticFrequencyWriter Writer, Later;
+  for (const TestFunction &F : Functions)
+    Writer.addFunction(F.GUID, F.Lines, F.Counts);
+  Later.addFunction(Functions[0].GUID, {1, 2, 3, 4}, {5, 6, 7, 8});
+  Writer.merge(std::move(Later));
+  check(Writer.replaceCounts(Functions[2].GUID, Functions[2].Counts),
+        "replacing counts");
+  check(!Writer.replaceCounts(Functions[2].GUID, {1, 2}),
+        "replacing counts of another number of blocks");
+  check(!Writer.replaceCounts(0x2ULL, {}), "replacing counts of a missing GUID");
+  check(Writer.write(Path), "writing the file");
+
+  {
+    Expected<std::unique_ptr<StaticFrequencyFile>> FileOrErr =
+        StaticFrequencyFile::open(Path);
+    if (!FileOrErr) {
+      errs() << "FAIL: " << toString(FileOrErr.takeError()) << "\n";
+      sys::fs::remove(Path);
+      return 1;
+    }
+    const StaticFrequencyFile &File = **FileOrErr;
+    check(File.size() == Functions.size(), "number of functions");
+    for (size_t I = 1; I < File.size(); ++I)
+      check(File.getGUID(I - 1) < File.getGUID(I), "GUID order");
+
+    SmallVector<uint32_t, 8> Lines;
+    SmallVector<uint64_t, 8> Counts;
+    for (const TestFunction &F : Functions) {
+      bool Found = File.lookup(F.GUID, Lines, Counts);
+      check(Found, "lookup of GUID " + Twine(F.GUID));
+      if (!Found)
+        continue;
+      check(ArrayRef<uint32_t>(Lines) == ArrayRef<uint32_t>(F.Lines),
+            "lines of GUID " + Twine(F.GUID));
+      check(ArrayRef<uint64_t>(Counts) == ArrayRef<uint64_t>(F.Counts),
+            "counts of GUID " + Twine(F.GUID));
+    }
+    check(!File.lookup(0x2ULL, Lines, Counts), "lookup of a missing GUID");
+  }
+
+  // Claim four billion blocks for the first function; decoding must fail on
+  // the size of its data rather than reserve room for them.
+  auto BufferOrErr = MemoryBuffer::getFile(Path);
+  check(bool(BufferOrErr), "reading the file back");
+  if (BufferOrErr) {
+    std::string Bytes = (*BufferOrErr)->getBuffer().str();
+    const size_t HeaderSize = 48, NumBlocksOffset = 20;
+    uint64_t FirstGUID =
+        support::endian::read64le(Bytes.data() + HeaderSize);
+    support::endian::write32le(&Bytes[HeaderSize + NumBlocksOffset],
+                               std::numeric_limits<uint32_t>::max());
+    {
+      std::error_code EC;
+      raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+      check(!EC, "rewriting the file");
+      OS << Bytes;
+    }
+
+    Expected<std::unique_ptr<StaticFrequencyFile>> FileOrErr =
+        StaticFrequencyFile::open(Path);
+    check(bool(FileOrErr), "opening the corrupted file");
+    if (FileOrErr) {
+      SmallVector<uint32_t, 8> Lines;
+      SmallVector<uint64_t, 8> Counts;
+      check(!(*FileOrErr)->lookup(FirstGUID, Lines, Counts),
+            "lookup of a function with too many blocks");
+    } else {
+      consumeError(FileOrErr.takeError());
+    }
+  }
+
+  sys::fs::remove(Path);
+  if (Failures)
+    return 1;
+  outs() << "PASS\n";
+  return 0;
+}